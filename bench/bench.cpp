@@ -0,0 +1,526 @@
+#include "utils.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "aarect.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "material.hpp"
+#include "perlin.hpp"
+#include "texture.hpp"
+#include "baked_texture.hpp"
+#include "quality.hpp"
+#include "replay.hpp"
+#include "scaling.hpp"
+#include "bvh_quality.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+// Microbenchmarks of the renderer's kernels in isolation. Every kernel runs over a fixed
+// set of inputs drawn from a fixed seed, warmed up once, then timed in rounds of at least
+// --min-time seconds; the fastest round is reported in ns per call. --save writes the
+// results as JSON, --baseline compares against such a file and fails if a kernel got
+// slower than --threshold percent. bench/baseline.json holds reference numbers; timings
+// only compare on the same machine, so save a fresh baseline before optimizing.
+//
+// --quality runs the time-to-quality benchmark of quality.hpp instead; see its options
+// in the usage text. --replay traces a ray capture instead (replay.hpp); its result is
+// saved and compared like a kernel's, in ns per ray. --scaling sweeps generated scenes
+// over primitive and thread counts (scaling.hpp). --bvh reports the quality of a scene's
+// BVH (bvh_quality.hpp). Built with RT_ENABLE_PERF_COUNTERS, kernel and replay runs also
+// print and save the hardware counter totals of the regions they ran through.
+
+struct bench_result {
+    std::string name;
+    double ns_per_op;
+};
+
+struct bench_options {
+    double min_time;
+    int rounds;
+    std::string filter;
+};
+
+// Keeps results alive so that the compiler can't drop the kernels.
+volatile double bench_sink;
+
+// Times op(i) for i over [0, inputs), repeating the sweep until a round takes min_time.
+template <typename op_fn>
+void run_bench(const std::string& name, int inputs, const bench_options& options, std::vector<bench_result>& results, op_fn op) {
+    if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+    typedef std::chrono::steady_clock clock;
+    double sum = 0;
+    for (int i = 0; i < inputs; i++) sum += op(i);
+
+    long sweeps = 1;
+    double best = infinity;
+    for (int round = 0; round < options.rounds; round++) {
+        for (;;) {
+            auto start = clock::now();
+            for (long s = 0; s < sweeps; s++) {
+                for (int i = 0; i < inputs; i++) sum += op(i);
+            }
+            std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+            if (elapsed.count() >= options.min_time * 1e9) {
+                best = std::min(best, elapsed.count() / (static_cast<double>(sweeps) * inputs));
+                break;
+            }
+            sweeps *= 2;
+        }
+    }
+    bench_sink = sum;
+    bench_result result = {name, best};
+    results.push_back(result);
+    printf("%-40s %10.2f ns/op\n", name.c_str(), best);
+    fflush(stdout);
+}
+
+// Inputs from their own generator, so that they don't depend on what ran before.
+struct bench_random {
+    std::mt19937 generator;
+    std::uniform_real_distribution<double> distribution;
+    explicit bench_random(unsigned seed) : generator(seed), distribution(0.0, 1.0) {}
+    double operator()() { return distribution(generator); }
+    double operator()(double min, double max) { return min + (max - min) * distribution(generator); }
+    vec3 in_box(double min, double max) {
+        auto x = (*this)(min, max);
+        auto y = (*this)(min, max);
+        return vec3(x, y, (*this)(min, max));
+    }
+    vec3 unit() {
+        for (;;) {
+            auto v = in_box(-1, 1);
+            if (v.length_squared() > 1e-6 && v.length_squared() <= 1) return unit_vector(v);
+        }
+    }
+};
+
+const int bench_inputs = 1024;
+
+// Rays from around `target` towards it, missing it by up to `spread`.
+std::vector<ray> bench_rays(bench_random& rng, const point3& target, double distance, double spread) {
+    std::vector<ray> rays;
+    for (int i = 0; i < bench_inputs; i++) {
+        auto origin = target + distance * rng.unit();
+        auto aim = target + rng.in_box(-spread, spread);
+        rays.push_back(ray(origin, aim - origin, rng()));
+    }
+    return rays;
+}
+
+void bench_intersection(const bench_options& options, std::vector<bench_result>& results) {
+    bench_random rng(1);
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto rays = bench_rays(rng, point3(0, 0, 0), 5, 2);
+    hit_record rec;
+
+    sphere s(point3(0, 0, 0), 1, mat);
+    run_bench("sphere::hit", bench_inputs, options, results, [&](int i) { return s.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0; });
+    moving_sphere ms(point3(0, -0.5, 0), point3(0, 0.5, 0), 0, 1, 1, mat);
+    run_bench("moving_sphere::hit", bench_inputs, options, results, [&](int i) { return ms.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0; });
+    xy_rect xy(-1, 1, -1, 1, 0, mat);
+    run_bench("xy_rect::hit", bench_inputs, options, results, [&](int i) { return xy.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0; });
+    xz_rect xz(-1, 1, -1, 1, 0, mat);
+    run_bench("xz_rect::hit", bench_inputs, options, results, [&](int i) { return xz.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0; });
+    yz_rect yz(-1, 1, -1, 1, 0, mat);
+    run_bench("yz_rect::hit", bench_inputs, options, results, [&](int i) { return yz.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0; });
+    aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+    run_bench("aabb::hit", bench_inputs, options, results, [&](int i) { return box.hit(rays[i], 0.001, infinity) ? 1.0 : 0.0; });
+}
+
+// Random spheres filling a cube, queried by rays through it.
+void bench_traversal(const bench_options& options, std::vector<bench_result>& results) {
+    const int sizes[] = {1000, 10000};
+    for (auto n : sizes) {
+        bench_random rng(2);
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        hittable_list spheres;
+        auto radius = 0.5 * pow(static_cast<double>(n), -1.0 / 3);
+        for (int i = 0; i < n; i++) spheres.add(make_shared<sphere>(rng.in_box(-1, 1), radius, mat));
+        bvh_node bvh(spheres, 0, 1);
+        auto rays = bench_rays(rng, point3(0, 0, 0), 4, 1);
+        hit_record rec;
+        run_bench("bvh_node::hit/" + std::to_string(n) + "_spheres", bench_inputs, options, results,
+                  [&](int i) { return bvh.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0; });
+    }
+}
+
+void bench_shading(const bench_options& options, std::vector<bench_result>& results) {
+    bench_random rng(3);
+    std::vector<ray> rays;
+    std::vector<hit_record> recs;
+    for (int i = 0; i < bench_inputs; i++) {
+        hit_record rec;
+        rec.p = rng.in_box(-1, 1);
+        auto normal = rng.unit();
+        auto direction = rng.unit();
+        if (dot(direction, normal) > 0) direction = -direction;
+        rec.set_face_normal(ray(rec.p - direction, direction), normal);
+        rec.t = 1;
+        rec.u = rng();
+        rec.v = rng();
+        rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+        rays.push_back(ray(rec.p - direction, direction, rng()));
+        recs.push_back(rec);
+    }
+    struct named_material {
+        const char* name;
+        shared_ptr<material> mat;
+    };
+    const named_material materials[] = {
+        {"lambertian::scatter", make_shared<lambertian>(color(0.5, 0.5, 0.5))},
+        {"metal::scatter", make_shared<metal>(color(0.8, 0.8, 0.8), 0.3)},
+        {"dielectric::scatter", make_shared<dielectric>(1.5)},
+        {"diffuse_light::scatter", make_shared<diffuse_light>(color(4, 4, 4))},
+        {"isotropic::scatter", make_shared<isotropic>(color(0.5, 0.5, 0.5))},
+    };
+    for (const auto& m : materials) {
+        color attenuation;
+        ray scattered;
+        run_bench(m.name, bench_inputs, options, results, [&](int i) {
+            return m.mat->scatter(rays[i], recs[i], attenuation, scattered) ? scattered.direction().x() + attenuation.x() : 0.0;
+        });
+    }
+}
+
+void bench_textures(const bench_options& options, std::vector<bench_result>& results) {
+    bench_random rng(4);
+    std::vector<point3> points;
+    std::vector<double> u, v;
+    for (int i = 0; i < bench_inputs; i++) {
+        points.push_back(rng.in_box(-4, 4));
+        u.push_back(rng());
+        v.push_back(rng());
+    }
+    perlin noise;
+    run_bench("perlin::noise", bench_inputs, options, results, [&](int i) { return noise.noise(points[i]); });
+    run_bench("perlin::turb", bench_inputs, options, results, [&](int i) { return noise.turb(points[i]); });
+
+    const int size = 1024;
+    std::vector<unsigned char> texels(static_cast<size_t>(size) * size * image_texture::bytes_per_pixel);
+    for (auto& t : texels) t = static_cast<unsigned char>(256 * rng());
+    image_texture image(texels.data(), size, size);
+    run_bench("image_texture::value", bench_inputs, options, results, [&](int i) { return image.value(u[i], v[i], points[i]).x(); });
+
+    // Procedural textures against their bakes, at points on a unit sphere with footprints
+    // one bake cell wide. The bakes are cached in the temp directory between runs.
+    std::vector<point3> on_sphere;
+    std::vector<double> sphere_u, sphere_v;
+    for (int i = 0; i < bench_inputs; i++) {
+        on_sphere.push_back(rng.unit());
+        double su, sv;
+        sphere::get_sphere_uv(on_sphere.back(), su, sv);
+        sphere_u.push_back(su);
+        sphere_v.push_back(sv);
+    }
+    auto checker = make_shared<checker_texture>(color(0.91, 0.17, 0.36), color(0.99, 0.79, 0.33));
+    auto uv_recipe = default_bake_recipe();
+    uv_recipe.kind = BAKE_UV;
+    uv_recipe.width = 1024;
+    uv_recipe.height = 512;
+    uv_recipe.radius = 1;
+    baked_texture baked_checker(checker, std::string(P_tmpdir) + "/rt_bench_checker.bake", uv_recipe);
+    texture_footprint uv_fp;
+    uv_fp.dpdx = vec3(baked_checker.cell, 0, 0);
+    run_bench("checker_texture::sample", bench_inputs, options, results, [&](int i) {
+        return checker->sample(sphere_u[i], sphere_v[i], on_sphere[i], uv_fp).x();
+    });
+    run_bench("baked_texture::sample/uv_checker", bench_inputs, options, results, [&](int i) {
+        return baked_checker.sample(sphere_u[i], sphere_v[i], on_sphere[i], uv_fp).x();
+    });
+
+    auto marble = make_shared<noise_texture>(10);
+    auto brick_recipe = default_bake_recipe();
+    brick_recipe.kind = BAKE_BRICKS;
+    brick_recipe.voxel = 0.005;
+    brick_recipe.on_sphere = 1;
+    brick_recipe.radius = 1;
+    for (int a = 0; a < 3; a++) {
+        brick_recipe.box_min[a] = -1;
+        brick_recipe.box_max[a] = 1;
+    }
+    baked_texture baked_marble(marble, std::string(P_tmpdir) + "/rt_bench_marble.bake", brick_recipe);
+    texture_footprint brick_fp;
+    brick_fp.dpdx = vec3(baked_marble.cell, 0, 0);
+    run_bench("noise_texture::sample", bench_inputs, options, results, [&](int i) {
+        return marble->sample(0, 0, on_sphere[i], brick_fp).x();
+    });
+    run_bench("baked_texture::sample/brick_marble", bench_inputs, options, results, [&](int i) {
+        return baked_marble.sample(0, 0, on_sphere[i], brick_fp).x();
+    });
+}
+
+// Hardware counter totals per region (perf_counters.hpp) over everything this run traced,
+// as the "perf_counters" member of a JSON object. Writes nothing unless perf counters are
+// compiled in.
+void write_bench_perf_counters(std::ostream& out) {
+    auto s = render_stats::merged();
+    uint64_t prim_tests = 0;
+    for (int i = 0; i < STAT_PRIM_NUM; i++) prim_tests += s.prim_tests[i];
+    write_perf_counters_json(out, s.rays[STAT_RAY_PATH] + s.rays[STAT_RAY_SHADOW], prim_tests);
+}
+
+bool save_results(const std::string& path, const std::vector<bench_result>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    out << "{\n";
+    write_bench_perf_counters(out);
+    out << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        out << "  {\"name\": \"" << results[i].name << "\", \"ns_per_op\": " << results[i].ns_per_op << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// Reads the name / ns_per_op pairs of a file written by save_results.
+bool load_results(const std::string& path, std::vector<bench_result>& results) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "ERROR: cannot open baseline " << path << ".\n";
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    auto text = buffer.str();
+    const std::string name_key = "\"name\": \"", time_key = "\"ns_per_op\": ";
+    size_t pos = 0;
+    while ((pos = text.find(name_key, pos)) != std::string::npos) {
+        pos += name_key.size();
+        auto name_end = text.find('"', pos);
+        auto time = text.find(time_key, name_end);
+        if (name_end == std::string::npos || time == std::string::npos) break;
+        bench_result result = {text.substr(pos, name_end - pos), atof(text.c_str() + time + time_key.size())};
+        results.push_back(result);
+        pos = time;
+    }
+    if (results.empty()) {
+        std::cerr << "ERROR: no benchmarks in baseline " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// Prints each result next to its baseline. Returns false if any is slower by more than
+// threshold percent.
+bool compare_results(const std::vector<bench_result>& results, const std::vector<bench_result>& baseline, double threshold) {
+    bool ok = true;
+    printf("\n%-40s %10s %10s %8s\n", "benchmark", "ns/op", "baseline", "change");
+    for (const auto& r : results) {
+        const bench_result* base = nullptr;
+        for (const auto& b : baseline) {
+            if (b.name == r.name) base = &b;
+        }
+        if (!base || base->ns_per_op <= 0) {
+            printf("%-40s %10.2f %10s %8s\n", r.name.c_str(), r.ns_per_op, "-", "new");
+            continue;
+        }
+        auto change = 100 * (r.ns_per_op / base->ns_per_op - 1);
+        bool slower = change > threshold;
+        printf("%-40s %10.2f %10.2f %+7.1f%%%s\n", r.name.c_str(), r.ns_per_op, base->ns_per_op, change, slower ? "  SLOWER" : "");
+        if (slower) ok = false;
+    }
+    return ok;
+}
+
+// Splits "a,b,c".
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    for (;;) {
+        auto comma = list.find(',', start);
+        auto item = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        if (!item.empty()) items.push_back(item);
+        if (comma == std::string::npos) return items;
+        start = comma + 1;
+    }
+}
+
+std::vector<double> split_numbers(const std::string& list) {
+    std::vector<double> numbers;
+    for (const auto& item : split_list(list)) numbers.push_back(atof(item.c_str()));
+    return numbers;
+}
+
+int main(int argc, char** argv) {
+    bench_options options;
+    options.min_time = 0.05;
+    options.rounds = 5;
+    std::string save_path, baseline_path;
+    double threshold = 10;
+    bool quality = false, make_references = false;
+    quality_options quality_opts;
+    quality_opts.scenes.assign(quality_default_scenes, quality_default_scenes + sizeof(quality_default_scenes) / sizeof(quality_default_scenes[0]));
+    quality_opts.reference_dir = RT_ASSET_DIR "/bench/references";
+    quality_opts.width = 128;
+    quality_opts.reference_spp = 4096;
+    quality_opts.max_spp = 256;
+    quality_opts.time_budget = 0;
+    quality_opts.relmse_targets = split_numbers("0.1,0.03,0.01");
+    quality_opts.ssim_targets = split_numbers("0.8,0.9,0.95");
+    replay_options replay_opts;
+    replay_opts.accel = "bvh";
+    replay_opts.repeat = 5;
+    bool scaling = false;
+    scaling_options scaling_opts;
+    scaling_opts.counts = split_numbers("1e3,1e4,1e5,1e6");
+    scaling_opts.threads.push_back(1);
+    scaling_opts.rays = 200000;
+    bvh_quality_options bvh_opts;
+    bvh_opts.levels = 6;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--quality") {
+            quality = true;
+        }
+        else if (arg == "--make-references") {
+            quality = make_references = true;
+        }
+        else if (arg == "--reference-dir" && i + 1 < argc) {
+            quality_opts.reference_dir = argv[++i];
+        }
+        else if (arg == "--scenes" && i + 1 < argc) {
+            quality_opts.scenes = split_list(argv[++i]);
+        }
+        else if (arg == "--width" && i + 1 < argc) {
+            quality_opts.width = std::max(8, atoi(argv[++i]));
+        }
+        else if (arg == "--reference-spp" && i + 1 < argc) {
+            quality_opts.reference_spp = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--max-spp" && i + 1 < argc) {
+            quality_opts.max_spp = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--time-budget" && i + 1 < argc) {
+            quality_opts.time_budget = atof(argv[++i]);
+        }
+        else if (arg == "--relmse-targets" && i + 1 < argc) {
+            quality_opts.relmse_targets = split_numbers(argv[++i]);
+        }
+        else if (arg == "--ssim-targets" && i + 1 < argc) {
+            quality_opts.ssim_targets = split_numbers(argv[++i]);
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            replay_opts.path = argv[++i];
+        }
+        else if (arg == "--accel" && i + 1 < argc) {
+            replay_opts.accel = argv[++i];
+        }
+        else if (arg == "--repeat" && i + 1 < argc) {
+            replay_opts.repeat = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--scaling") {
+            scaling = true;
+        }
+        else if (arg == "--counts" && i + 1 < argc) {
+            scaling_opts.counts = split_numbers(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            scaling_opts.threads.clear();
+            for (auto t : split_numbers(argv[++i])) scaling_opts.threads.push_back(std::max(1, static_cast<int>(t)));
+        }
+        else if (arg == "--generator" && i + 1 < argc) {
+            if (!parse_scene_generator_options(argv[++i], scaling_opts.scene)) return 1;
+        }
+        else if (arg == "--rays" && i + 1 < argc) {
+            scaling_opts.rays = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--bvh" && i + 1 < argc) {
+            bvh_opts.scene = argv[++i];
+        }
+        else if (arg == "--levels" && i + 1 < argc) {
+            bvh_opts.levels = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--dump" && i + 1 < argc) {
+            bvh_opts.dump_path = argv[++i];
+        }
+        else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--min-time" && i + 1 < argc) {
+            options.min_time = atof(argv[++i]);
+        }
+        else if (arg == "--rounds" && i + 1 < argc) {
+            options.rounds = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--save" && i + 1 < argc) {
+            save_path = argv[++i];
+        }
+        else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        }
+        else if (arg == "--threshold" && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--filter substring] [--min-time seconds] [--rounds n] [--save results.json]"
+                      << " [--baseline results.json] [--threshold percent]\n"
+                      << "       " << argv[0] << " (--quality | --make-references) [--scenes a,b,...] [--width n] [--reference-dir dir]"
+                      << " [--reference-spp n] [--max-spp n] [--time-budget seconds] [--relmse-targets x,y,...] [--ssim-targets x,y,...]"
+                      << " [--save results.json]\n"
+                      << "       " << argv[0] << " --replay capture.rtrays [--accel bvh|list|image] [--repeat n] [--save results.json]"
+                      << " [--baseline results.json] [--threshold percent]\n"
+                      << "       " << argv[0] << " --scaling [--counts 1e3,1e4,...] [--threads 1,2,...] [--rays n]"
+                      << " [--generator distribution=uniform|clustered|ground,mix=spheres:rects:triangles,moving=fraction] [--save results.json]\n"
+                      << "       " << argv[0] << " --bvh (scene-file | scene.rtsi | builtin:name) [--dump boxes.obj] [--levels n] [--save report.json]\n";
+            return 1;
+        }
+    }
+    if (make_references) {
+        mkdir(quality_opts.reference_dir.c_str(), 0755);
+        return make_quality_references(quality_opts) ? 0 : 1;
+    }
+    if (!bvh_opts.scene.empty()) {
+        std::vector<std::pair<std::string, bvh_report>> results;
+        if (!run_bvh_quality(bvh_opts, results)) return 1;
+        return save_path.empty() || save_bvh_quality(save_path, bvh_opts.scene, results) ? 0 : 1;
+    }
+    if (scaling) {
+        std::vector<scaling_point> results;
+        if (!run_scaling_bench(scaling_opts, results)) return 1;
+        return save_path.empty() || save_scaling_results(save_path, scaling_opts, results) ? 0 : 1;
+    }
+    if (quality) {
+        std::vector<quality_scene> results;
+        if (!run_quality_bench(quality_opts, results)) return 1;
+        return save_path.empty() || save_quality_results(save_path, quality_opts, results) ? 0 : 1;
+    }
+    std::vector<bench_result> baseline;
+    if (!baseline_path.empty() && !load_results(baseline_path, baseline)) return 1;
+
+    std::vector<bench_result> results;
+    if (!replay_opts.path.empty()) {
+        bench_result result = {"replay " + replay_opts.accel, 0};
+        if (!run_replay(replay_opts, result.ns_per_op)) return 1;
+        results.push_back(result);
+    }
+    else {
+        bench_intersection(options, results);
+        bench_traversal(options, results);
+        bench_shading(options, results);
+        bench_textures(options, results);
+    }
+
+#ifdef RT_ENABLE_PERF_COUNTERS
+    std::cout << "perf counters:\n";
+    write_bench_perf_counters(std::cout);
+#endif
+    bool ok = true;
+    if (!save_path.empty()) ok = save_results(save_path, results);
+    if (!baseline_path.empty()) ok = compare_results(results, baseline, threshold) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#ifndef BVH_QUALITY_H_
+#define BVH_QUALITY_H_
+
+#include "utils.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "flat_bvh.hpp"
+#include "batch.hpp"
+#include "bvh_inspect.hpp"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Inspects the BVH a render of scene would use (bvh_inspect.hpp). Next to it, as a yardstick,
+// a binned SAH tree (flat_bvh.hpp) over the same primitive boxes with leaves of up to two,
+// as bvh_node's are. A scene image carries its own tree, which is inspected alone.
+
+struct bvh_quality_options {
+    std::string scene;
+    int levels;             // Node boxes kept for dump_path
+    std::string dump_path;  // OBJ wireframe of the inspected tree's first levels, if set
+};
+
+bool run_bvh_quality(const bvh_quality_options& options, std::vector<std::pair<std::string, bvh_report>>& results) {
+    hittable_list objects;
+    render_settings settings;
+    shared_ptr<hittable> image_world;
+    if (!load_scene_objects(options.scene, objects, settings, image_world)) return false;
+
+    bvh_inspector inspector(options.dump_path.empty() ? 0 : options.levels);
+    if (image_world) {
+        if (!inspector.inspect(*image_world, settings.time0, settings.time1)) return false;
+        results.push_back(std::make_pair(std::string("scene image"), inspector.finish()));
+    }
+    else {
+        if (objects.objects.empty()) {
+            std::cerr << "ERROR: " << options.scene << " has no objects.\n";
+            return false;
+        }
+        bvh_node tree(objects, settings.time0, settings.time1);
+        inspector.inspect(tree, settings.time0, settings.time1);
+        results.push_back(std::make_pair(std::string("bvh_node"), inspector.finish()));
+
+        std::vector<aabb> boxes(objects.objects.size());
+        for (size_t k = 0; k < boxes.size(); k++) objects.objects[k]->bounding_box(settings.time0, settings.time1, boxes[k]);
+        std::vector<int> index;
+        std::vector<flat_bvh_node> nodes;
+        build_flat_bvh(boxes, index, nodes, 2);
+        bvh_inspector reference(0);
+        reference.inspect(nodes.data(), 0, 0);
+        results.push_back(std::make_pair(std::string("binned SAH reference"), reference.finish()));
+    }
+    for (const auto& r : results) print_bvh_report(r.first, r.second);
+    if (results.size() > 1 && results[1].second.sah_cost > 0) {
+        printf("bvh_node costs %.2fx the reference\n", results[0].second.sah_cost / results[1].second.sah_cost);
+    }
+    return options.dump_path.empty() || write_bvh_levels_obj(options.dump_path, results[0].second);
+}
+
+bool save_bvh_quality(const std::string& path, const std::string& scene, const std::vector<std::pair<std::string, bvh_report>>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    out << "{\"scene\": \"" << scene << "\", \"trees\": [\n";
+    for (size_t k = 0; k < results.size(); k++) {
+        out << "  ";
+        write_bvh_report_json(out, results[k].first, results[k].second);
+        out << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef QUALITY_H_
+#define QUALITY_H_
+
+#include "utils.hpp"
+#include "batch.hpp"
+#include "renderer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Time-to-quality benchmark. Each builtin scene renders at a small fixed width with the
+// sample count doubling, and after every doubling the image is compared against a
+// high-spp reference of the same view: RMSE and relative MSE on linear radiance, SSIM on
+// the displayed (gamma corrected) luminance. The report gives, per scene, the render
+// time and spp needed to reach a set of relMSE and SSIM targets, interpolated between
+// checkpoints. References come from --make-references, rendered with a different seed
+// than the benchmark so that their noise is independent. The default width's references
+// are committed under bench/references (4096 spp), so every checkout measures against
+// the same images. A change meant to alter what the renderer converges to has to
+// regenerate them in the same commit; any other change must leave them untouched.
+
+struct quality_options {
+    std::vector<std::string> scenes;
+    std::string reference_dir;
+    int width;
+    int reference_spp;
+    int max_spp;
+    double time_budget;                 // Seconds per scene; stops doubling past it
+    std::vector<double> relmse_targets;
+    std::vector<double> ssim_targets;
+};
+
+struct quality_point {
+    int spp;
+    double seconds;     // Render time only
+    double rmse;
+    double relmse;
+    double ssim;
+};
+
+struct quality_scene {
+    std::string name;
+    int width, height;
+    std::vector<quality_point> curve;
+};
+
+const unsigned quality_bench_seed = 1;
+const unsigned quality_reference_seed = 2;
+
+const char* const quality_default_scenes[] = {"random_scene", "two_spheres", "two_perlin_spheres", "simple_light", "cornell_box", "smoke_box"};
+
+// Builds a builtin scene (the same one every time), then seeds rendering.
+bool quality_prepare(const std::string& name, int width, unsigned seed, prepared_scene& scene, render_settings& settings) {
+    if (!prepare_scene("builtin:" + name, scene)) return false;
+    settings = scene.settings;
+    render_parameter w = {"width", {static_cast<double>(width), 0, 0}};
+    apply_render_parameters(settings, std::vector<render_parameter>(1, w));
+    random_generator().seed(seed);
+    return true;
+}
+
+std::vector<float> quality_average(const frame_buffer& frame) {
+    std::vector<float> rgb(frame.sum.size() * 3);
+    for (size_t p = 0; p < frame.sum.size(); p++) {
+        for (int c = 0; c < 3; c++) rgb[3 * p + c] = static_cast<float>(frame.sum[p][c] / frame.samples);
+    }
+    return rgb;
+}
+
+// Displayed luminance, gamma corrected and clamped as write_ppm does.
+std::vector<double> quality_luminance(const std::vector<float>& rgb) {
+    std::vector<double> y(rgb.size() / 3);
+    for (size_t p = 0; p < y.size(); p++) {
+        double display[3];
+        for (int c = 0; c < 3; c++) display[c] = clamp(sqrt(std::max(0.0f, rgb[3 * p + c])), 0.0, 1.0);
+        y[p] = 0.2126 * display[0] + 0.7152 * display[1] + 0.0722 * display[2];
+    }
+    return y;
+}
+
+// Mean SSIM over 8x8 windows spaced 4 pixels apart, for values in [0, 1].
+double quality_ssim(const std::vector<double>& a, const std::vector<double>& b, int width, int height) {
+    const int window = 8, stride = 4;
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    double sum = 0;
+    int count = 0;
+    for (int j = 0; j + window <= height; j += stride) {
+        for (int i = 0; i + window <= width; i += stride) {
+            double ma = 0, mb = 0, vaa = 0, vbb = 0, vab = 0;
+            for (int y = j; y < j + window; y++) {
+                for (int x = i; x < i + window; x++) {
+                    auto pa = a[static_cast<size_t>(y) * width + x], pb = b[static_cast<size_t>(y) * width + x];
+                    ma += pa;
+                    mb += pb;
+                    vaa += pa * pa;
+                    vbb += pb * pb;
+                    vab += pa * pb;
+                }
+            }
+            const double n = window * window;
+            ma /= n;
+            mb /= n;
+            vaa = vaa / n - ma * ma;
+            vbb = vbb / n - mb * mb;
+            vab = vab / n - ma * mb;
+            sum += (2 * ma * mb + c1) * (2 * vab + c2) / ((ma * ma + mb * mb + c1) * (vaa + vbb + c2));
+            count++;
+        }
+    }
+    return count > 0 ? sum / count : 1;
+}
+
+void quality_measure(const std::vector<float>& image, const std::vector<float>& reference, const std::vector<double>& reference_y,
+                     int width, int height, quality_point& point) {
+    double squared = 0, relative = 0;
+    for (size_t k = 0; k < image.size(); k++) {
+        double d = image[k] - reference[k];
+        squared += d * d;
+        relative += d * d / (reference[k] * reference[k] + 1e-2);
+    }
+    point.rmse = sqrt(squared / image.size());
+    point.relmse = relative / image.size();
+    point.ssim = quality_ssim(quality_luminance(image), reference_y, width, height);
+}
+
+std::string quality_reference_path(const quality_options& options, const std::string& scene) {
+    return options.reference_dir + "/" + scene + ".pfm";
+}
+
+bool make_quality_references(const quality_options& options) {
+    for (const auto& name : options.scenes) {
+        prepared_scene scene;
+        render_settings settings;
+        if (!quality_prepare(name, options.width, quality_reference_seed, scene, settings)) return false;
+        auto cam = settings.make_camera();
+        frame_buffer frame(settings.image_width, settings.image_height);
+        auto start = std::chrono::steady_clock::now();
+        for (int s = 0; s < options.reference_spp; s++) render_pass(scene.world, settings, cam, frame, &scene.lighting);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto path = quality_reference_path(options, name);
+        if (!write_pfm(path, frame.width, frame.height, quality_average(frame))) return false;
+        std::cout << "Wrote " << path << " (" << frame.width << "x" << frame.height << ", " << options.reference_spp << " spp in "
+                  << elapsed.count() << "s)" << std::endl;
+    }
+    return true;
+}
+
+// Log-log interpolation of the time (or spp) at which error first falls to target;
+// negative if it never does.
+double quality_reach(const std::vector<quality_point>& curve, double target, bool use_ssim, bool spp) {
+    auto error = [use_ssim](const quality_point& p) { return use_ssim ? 1 - p.ssim : p.relmse; };
+    auto cost = [spp](const quality_point& p) { return spp ? static_cast<double>(p.spp) : p.seconds; };
+    auto goal = use_ssim ? 1 - target : target;
+    for (size_t k = 0; k < curve.size(); k++) {
+        if (error(curve[k]) > goal) continue;
+        if (k == 0 || error(curve[k]) <= 0 || goal <= 0) return cost(curve[k]);
+        auto e0 = log(error(curve[k - 1])), e1 = log(error(curve[k]));
+        auto c0 = log(cost(curve[k - 1])), c1 = log(cost(curve[k]));
+        auto f = e0 > e1 ? (e0 - log(goal)) / (e0 - e1) : 1.0;
+        return exp(c0 + f * (c1 - c0));
+    }
+    return -1;
+}
+
+bool run_quality_bench(const quality_options& options, std::vector<quality_scene>& results) {
+    for (const auto& name : options.scenes) {
+        int ref_width, ref_height;
+        std::vector<float> reference;
+        if (!read_pfm(quality_reference_path(options, name), ref_width, ref_height, reference)) {
+            std::cerr << "ERROR: no reference for " << name << "; run with --make-references first.\n";
+            return false;
+        }
+        prepared_scene scene;
+        quality_scene result;
+        render_settings settings;
+        if (!quality_prepare(name, options.width, quality_bench_seed, scene, settings)) return false;
+        if (settings.image_width != ref_width || settings.image_height != ref_height) {
+            std::cerr << "ERROR: reference for " << name << " is " << ref_width << "x" << ref_height << ", not "
+                      << settings.image_width << "x" << settings.image_height << "; other widths need their own --reference-dir.\n";
+            return false;
+        }
+        result.name = name;
+        result.width = ref_width;
+        result.height = ref_height;
+        auto reference_y = quality_luminance(reference);
+
+        auto cam = settings.make_camera();
+        frame_buffer frame(settings.image_width, settings.image_height);
+        double seconds = 0;
+        printf("%s (%dx%d)\n%8s %10s %12s %12s %8s\n", name.c_str(), ref_width, ref_height, "spp", "seconds", "rmse", "relmse", "ssim");
+        for (int spp = 1; spp <= options.max_spp; spp *= 2) {
+            auto start = std::chrono::steady_clock::now();
+            while (frame.samples < spp) render_pass(scene.world, settings, cam, frame, &scene.lighting);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            quality_point point;
+            point.spp = spp;
+            point.seconds = seconds;
+            quality_measure(quality_average(frame), reference, reference_y, ref_width, ref_height, point);
+            result.curve.push_back(point);
+            printf("%8d %10.3f %12.6g %12.6g %8.4f\n", spp, seconds, point.rmse, point.relmse, point.ssim);
+            fflush(stdout);
+            if (options.time_budget > 0 && seconds >= options.time_budget) break;
+        }
+        results.push_back(result);
+    }
+
+    printf("\n%-20s %-14s %12s %10s\n", "scene", "target", "seconds", "spp");
+    for (const auto& r : results) {
+        for (int use_ssim = 0; use_ssim < 2; use_ssim++) {
+            for (auto target : use_ssim ? options.ssim_targets : options.relmse_targets) {
+                auto t = quality_reach(r.curve, target, use_ssim != 0, false);
+                auto n = quality_reach(r.curve, target, use_ssim != 0, true);
+                char label[32];
+                snprintf(label, sizeof(label), "%s %g", use_ssim ? "ssim>=" : "relmse<=", target);
+                if (t < 0) printf("%-20s %-14s %12s %10s\n", r.name.c_str(), label, "-", "-");
+                else printf("%-20s %-14s %12.3f %10.1f\n", r.name.c_str(), label, t, n);
+            }
+        }
+    }
+    return true;
+}
+
+bool save_quality_results(const std::string& path, const quality_options& options, const std::vector<quality_scene>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    out << "{\"scenes\": [\n";
+    for (size_t s = 0; s < results.size(); s++) {
+        const auto& r = results[s];
+        out << "  {\"name\": \"" << r.name << "\", \"width\": " << r.width << ", \"height\": " << r.height << ",\n   \"curve\": [";
+        for (size_t k = 0; k < r.curve.size(); k++) {
+            const auto& p = r.curve[k];
+            out << (k ? ",\n             " : "") << "{\"spp\": " << p.spp << ", \"seconds\": " << p.seconds << ", \"rmse\": " << p.rmse
+                << ", \"relmse\": " << p.relmse << ", \"ssim\": " << p.ssim << "}";
+        }
+        out << "],\n   \"to_target\": [";
+        bool first = true;
+        for (int use_ssim = 0; use_ssim < 2; use_ssim++) {
+            for (auto target : use_ssim ? options.ssim_targets : options.relmse_targets) {
+                auto t = quality_reach(r.curve, target, use_ssim != 0, false);
+                auto n = quality_reach(r.curve, target, use_ssim != 0, true);
+                out << (first ? "" : ",\n                 ") << "{\"metric\": \"" << (use_ssim ? "ssim" : "relmse") << "\", \"target\": " << target;
+                if (t < 0) out << ", \"seconds\": null, \"spp\": null}";
+                else out << ", \"seconds\": " << t << ", \"spp\": " << n << "}";
+                first = false;
+            }
+        }
+        out << "]}" << (s + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
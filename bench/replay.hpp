@@ -0,0 +1,125 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include "utils.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "batch.hpp"
+#include "ray_capture.hpp"
+#include "scene_image.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Replays a ray capture (a batch job's "capture", see ray_capture.hpp) through one of the
+// acceleration structures: the BVH a render would use, the plain object list, or a scene
+// image written from the objects. The scene is rebuilt from the name in the capture. Each
+// repeat traces every ray once; the fastest repeat is reported. The checksum covers which
+// rays hit and at what distance, so two structures that agree on it found the same hits.
+// Media draw a random free flight for each ray; every repeat starts from the same seed,
+// so a structure reproduces its own checksum, but structures that visit media in a
+// different order may not agree on theirs.
+
+struct replay_options {
+    std::string path;
+    std::string accel;      // bvh, list or image
+    int repeat;
+};
+
+struct replay_totals {
+    uint64_t hits;
+    uint64_t checksum;      // FNV-1a over hit flags and single precision distances
+};
+
+// The world to trace against. image writes <capture>.rtsi next to the capture first.
+shared_ptr<hittable> replay_world(const replay_options& options, const std::string& scene) {
+    hittable_list objects;
+    render_settings settings;
+    shared_ptr<hittable> image_world;
+    if (!load_scene_objects(scene, objects, settings, image_world)) return nullptr;
+    if (image_world) {
+        if (options.accel != "image") {
+            std::cerr << "ERROR: " << scene << " is a scene image; replay it with --accel image.\n";
+            return nullptr;
+        }
+        return image_world;
+    }
+    if (options.accel == "bvh") return make_shared<bvh_node>(objects, settings.time0, settings.time1);
+    if (options.accel == "list") return make_shared<hittable_list>(objects);
+    if (options.accel == "image") {
+        auto image_path = options.path + ".rtsi";
+        if (!write_scene_image(image_path, objects, settings)) return nullptr;
+        return load_scene_image(image_path, settings);
+    }
+    std::cerr << "ERROR: unknown acceleration structure " << options.accel << "; expected bvh, list or image.\n";
+    return nullptr;
+}
+
+void replay_trace(const hittable& world, const std::vector<ray_record>& records, replay_totals& totals) {
+    totals.hits = 0;
+    totals.checksum = 14695981039346656037ull;
+    auto mix = [&totals](uint32_t word) {
+        for (int b = 0; b < 4; b++) {
+            totals.checksum ^= (word >> (8 * b)) & 0xff;
+            totals.checksum *= 1099511628211ull;
+        }
+    };
+    random_generator().seed(std::mt19937::default_seed);
+    hit_record rec;
+    for (const auto& record : records) {
+        ray r(point3(record.origin[0], record.origin[1], record.origin[2]),
+              vec3(record.direction[0], record.direction[1], record.direction[2]), record.time);
+        bool hit = world.hit(r, record.t_min, record.t_max, rec);
+        mix(hit ? 1 : 0);
+        if (!hit) continue;
+        totals.hits++;
+        auto t = static_cast<float>(rec.t);
+        uint32_t bits;
+        memcpy(&bits, &t, sizeof(bits));
+        mix(bits);
+    }
+}
+
+// Reports the fastest repeat in ns_per_ray.
+bool run_replay(const replay_options& options, double& ns_per_ray) {
+    std::string scene;
+    std::vector<ray_record> records;
+    if (!load_ray_capture(options.path, scene, records)) return false;
+    if (records.empty()) {
+        std::cerr << "ERROR: " << options.path << " holds no rays.\n";
+        return false;
+    }
+    uint64_t kinds[2] = {0, 0};
+    int max_bounce = 0;
+    for (const auto& record : records) {
+        kinds[record.kind == RAY_KIND_SHADOW ? 1 : 0]++;
+        max_bounce = std::max(max_bounce, static_cast<int>(record.bounce));
+    }
+    std::cout << options.path << ": " << records.size() << " rays of " << scene << " (" << kinds[0] << " path, " << kinds[1]
+              << " shadow, bounces 0-" << max_bounce << ")" << std::endl;
+
+    auto build_start = std::chrono::steady_clock::now();
+    auto world = replay_world(options, scene);
+    if (!world) return false;
+    std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start;
+
+    double best = 0;
+    replay_totals totals;
+    for (int i = 0; i < options.repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        replay_trace(*world, records, totals);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (i == 0 || elapsed.count() < best) best = elapsed.count();
+    }
+    ns_per_ray = 1e9 * best / records.size();
+    printf("%-8s built in %.3fs; %.3fs per replay, %.0f rays/s, %.1f ns/ray; %llu hits, checksum %016llx\n", options.accel.c_str(),
+           build_time.count(), best, records.size() / best, ns_per_ray, static_cast<unsigned long long>(totals.hits),
+           static_cast<unsigned long long>(totals.checksum));
+    return true;
+}
+
+#endif
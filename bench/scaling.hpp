@@ -0,0 +1,165 @@
+#ifndef SCALING_H_
+#define SCALING_H_
+
+#include "utils.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "scene_generator.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <malloc.h>
+
+// Scaling sweep over generated scenes (scene_generator.hpp). For every primitive count it
+// generates the scene, builds its BVH and traces a fixed set of rays with each thread
+// count, reporting generation and build time, heap bytes held by the scene and by its
+// BVH, and rays per second. Half of the rays are camera rays, the other half start at
+// random points in the scene in random directions, like bounces. Rays are drawn up front
+// on the calling thread; tracing only queries the shared BVH, which is read-only, and
+// hit queries on generated scenes draw no random numbers.
+
+struct scaling_options {
+    std::vector<double> counts;
+    std::vector<int> threads;
+    scene_generator_options scene;      // count is set per point
+    int rays;
+};
+
+struct scaling_point {
+    size_t count;
+    double generate_seconds;
+    double build_seconds;
+    double scene_bytes;     // Primitives and materials
+    double bvh_bytes;
+    std::vector<double> rays_per_second;    // Per thread count
+    uint64_t hits;
+};
+
+// Heap bytes in use; 0 where glibc cannot tell.
+double heap_bytes_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    auto info = mallinfo2();
+    return static_cast<double>(info.uordblks + info.hblkhd);
+#else
+    return 0;
+#endif
+}
+
+std::vector<ray> scaling_rays(const render_settings& settings, const aabb& region, int count) {
+    std::vector<ray> rays;
+    rays.reserve(count);
+    auto cam = settings.make_camera();
+    for (int k = 0; k < count; k++) {
+        if (k % 2 == 0) {
+            rays.push_back(cam.get_ray(random_double(), random_double()));
+            continue;
+        }
+        point3 origin;
+        for (int a = 0; a < 3; a++) origin.e[a] = random_double(region.min()[a], region.max()[a]);
+        rays.push_back(ray(origin, random_unit_vector(), random_double(settings.time0, settings.time1)));
+    }
+    return rays;
+}
+
+// Traces all rays over `threads` threads, each taking batches from a shared counter.
+double scaling_trace(const hittable& world, const std::vector<ray>& rays, int threads, uint64_t& hits) {
+    const size_t batch = 1024;
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> total_hits(0);
+    auto worker = [&]() {
+        hit_record rec;
+        uint64_t local_hits = 0;
+        for (;;) {
+            auto start = next.fetch_add(batch);
+            if (start >= rays.size()) break;
+            auto end = std::min(start + batch, rays.size());
+            for (auto k = start; k < end; k++) {
+                if (world.hit(rays[k], 0.0001, infinity, rec)) local_hits++;
+            }
+        }
+        total_hits += local_hits;
+    };
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) workers.push_back(std::thread(worker));
+    worker();
+    for (auto& w : workers) w.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    hits = total_hits;
+    return rays.size() / elapsed.count();
+}
+
+bool run_scaling_bench(const scaling_options& options, std::vector<scaling_point>& results) {
+    typedef std::chrono::steady_clock clock;
+    printf("%s, mix %g:%g:%g, %g moving, %d rays\n", scene_distribution_names[options.scene.distribution], options.scene.sphere_weight,
+           options.scene.rect_weight, options.scene.triangle_weight, options.scene.moving_fraction, options.rays);
+    printf("%12s %10s %10s %10s %10s", "primitives", "generate", "build", "scene MB", "bvh MB");
+    for (auto t : options.threads) printf(" %9s%-3d", "rays/s @", t);
+    printf("\n");
+    for (auto count : options.counts) {
+        scaling_point point;
+        auto generator = options.scene;
+        generator.count = static_cast<size_t>(count);
+        point.count = generator.count;
+        random_generator().seed(std::mt19937::default_seed);
+
+        auto heap_start = heap_bytes_in_use();
+        auto start = clock::now();
+        render_settings settings;
+        auto objects = generate_scene(generator, settings);
+        point.generate_seconds = std::chrono::duration<double>(clock::now() - start).count();
+        auto heap_scene = heap_bytes_in_use();
+        start = clock::now();
+        auto world = make_shared<bvh_node>(objects, settings.time0, settings.time1);
+        point.build_seconds = std::chrono::duration<double>(clock::now() - start).count();
+        point.scene_bytes = heap_scene - heap_start;
+        point.bvh_bytes = heap_bytes_in_use() - heap_scene;
+
+        auto rays = scaling_rays(settings, generated_region(generator), options.rays);
+        printf("%12zu %9.3fs %9.3fs %10.1f %10.1f", point.count, point.generate_seconds, point.build_seconds, point.scene_bytes / 1e6,
+               point.bvh_bytes / 1e6);
+        fflush(stdout);
+        for (auto t : options.threads) {
+            point.rays_per_second.push_back(scaling_trace(*world, rays, t, point.hits));
+            printf(" %12.0f", point.rays_per_second.back());
+            fflush(stdout);
+        }
+        printf("\n");
+        results.push_back(point);
+    }
+    return true;
+}
+
+bool save_scaling_results(const std::string& path, const scaling_options& options, const std::vector<scaling_point>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    out << "{\"distribution\": \"" << scene_distribution_names[options.scene.distribution] << "\", \"mix\": [" << options.scene.sphere_weight
+        << ", " << options.scene.rect_weight << ", " << options.scene.triangle_weight << "], \"moving\": " << options.scene.moving_fraction
+        << ", \"rays\": " << options.rays << ",\n \"threads\": [";
+    for (size_t t = 0; t < options.threads.size(); t++) out << (t ? ", " : "") << options.threads[t];
+    out << "],\n \"points\": [\n";
+    for (size_t k = 0; k < results.size(); k++) {
+        const auto& p = results[k];
+        out << "  {\"primitives\": " << p.count << ", \"generate_seconds\": " << p.generate_seconds << ", \"build_seconds\": " << p.build_seconds
+            << ", \"scene_bytes\": " << p.scene_bytes << ", \"bvh_bytes\": " << p.bvh_bytes << ", \"hits\": " << p.hits << ", \"rays_per_second\": [";
+        for (size_t t = 0; t < p.rays_per_second.size(); t++) out << (t ? ", " : "") << p.rays_per_second[t];
+        out << "]}" << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
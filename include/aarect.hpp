@@ -3,6 +3,7 @@
 
 #include "utils.hpp"
 #include "hittable.hpp"
+#include "render_stats.hpp"
 
 class xy_rect : public hittable {
 public:
@@ -19,6 +20,7 @@ public:
 };
 
 bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_RECT]);
     auto t = (k - r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max) return false;
     auto x = r.origin().x() + t * r.direction().x();
@@ -27,6 +29,8 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (y - y0) / (y1 - y0);
     rec.t = t;
+    rec.dpdu = vec3(x1 - x0, 0, 0);
+    rec.dpdv = vec3(0, y1 - y0, 0);
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
@@ -49,6 +53,7 @@ public:
 };
 
 bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_RECT]);
     auto t = (k - r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max) return false;
     auto x = r.origin().x() + t * r.direction().x();
@@ -57,6 +62,8 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
+    rec.dpdu = vec3(x1 - x0, 0, 0);
+    rec.dpdv = vec3(0, 0, z1 - z0);
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
@@ -79,6 +86,7 @@ public:
 };
 
 bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_RECT]);
     auto t = (k - r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max) return false;
     auto y = r.origin().y() + t * r.direction().y();
@@ -87,6 +95,8 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.u = (y - y0) / (y1 - y0);
     rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
+    rec.dpdu = vec3(0, y1 - y0, 0);
+    rec.dpdv = vec3(0, 0, z1 - z0);
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
@@ -0,0 +1,386 @@
+#ifndef BAKED_TEXTURE_H_
+#define BAKED_TEXTURE_H_
+
+#include "utils.hpp"
+#include "texture.hpp"
+#include "tiled_texture.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Procedural textures baked at load time. A bake samples its source on a lattice, either
+// over the uv square of one sphere or through a box of 3D bricks, cut into blocks of
+// baked_block_size cells a side, and lookups interpolate the lattice. Each block is
+// checked against the source at every cell centre as it is baked; blocks off by more
+// than the tolerance (those across a checker's edges, say) or holding colours outside
+// [0, 1] are not stored and stay analytic. Stored blocks go to a .bake file that later
+// loads reuse while the recipe and the source are unchanged, and rendering reads them a
+// page at a time through the shared tile cache, so every frame and job of a batch shares
+// them.
+//
+// The lattice holds the source filtered to one cell, so lookups with a finer footprint,
+// and value(), still go to the source. So do uv lookups at points off the baked sphere;
+// a rotated sphere's uvs do not match the bake, and it must not use one.
+
+enum bake_kind {
+    BAKE_UV = 0,        // width x height cells over a sphere's uv square
+    BAKE_BRICKS,        // Cells voxel across filling a box, rounded up to whole bricks
+};
+
+const int baked_block_size = 8;
+
+struct bake_recipe {
+    int32_t kind;
+    int32_t width, height;      // BAKE_UV
+    int32_t on_sphere;          // BAKE_BRICKS: only bricks the sphere's surface passes through
+    double voxel;               // BAKE_BRICKS
+    double tolerance;
+    double box_min[3], box_max[3];
+    double center[3];
+    double radius;
+};
+
+inline bake_recipe default_bake_recipe() {
+    bake_recipe r;
+    memset(&r, 0, sizeof(r));   // Recipes are compared and hashed bytewise
+    r.tolerance = 0.02;
+    return r;
+}
+
+// What the scene parser accepts, for recipes read back from elsewhere.
+inline bool valid_bake_recipe(const bake_recipe& r) {
+    if (!(r.tolerance >= 0)) return false;
+    if (r.kind == BAKE_UV) {
+        return r.width > 0 && r.height > 0 && r.width % baked_block_size == 0 && r.height % baked_block_size == 0 && r.radius > 0;
+    }
+    if (r.kind != BAKE_BRICKS || !(r.voxel > 0) || (r.on_sphere && !(r.radius > 0))) return false;
+    for (int a = 0; a < 3; a++) {
+        if (!(r.box_min[a] < r.box_max[a])) return false;
+    }
+    return true;
+}
+
+const uint32_t baked_file_magic = 0x4b425452;   // "RTBK"
+const uint32_t baked_file_version = 1;
+const int64_t baked_max_blocks = 1 << 26;
+const size_t baked_page_bytes = 1 << 20;        // Blocks go through the tile cache this many bytes at a time
+
+// Followed by one int32 slot per block, x fastest, that is -1 for blocks left analytic
+// and otherwise counts up from 0; then the stored blocks in slot order, each the RGB8
+// lattice points of its cells, x fastest.
+struct baked_file_header {
+    uint32_t magic;
+    uint32_t version;
+    bake_recipe recipe;
+    uint64_t fingerprint;       // Of the source, see baked_texture::fingerprint()
+    int32_t blocks[3];          // Along u, v and 1, or along x, y and z
+    int32_t stored;
+};
+
+class baked_texture : public texture {
+public:
+    baked_texture(shared_ptr<texture> _source, const std::string& _path, const bake_recipe& _recipe);
+    ~baked_texture() { if (fd >= 0) close(fd); }
+
+    virtual color value(double u, double v, const point3& p) const override {
+        return source->value(u, v, p);
+    }
+    virtual color sample(double u, double v, const point3& p, const texture_footprint& fp) const override;
+private:
+    void lattice_point(double x, double y, double z, double& u, double& v, point3& p) const;
+    color source_sample(double x, double y, double z) const;
+    uint64_t fingerprint() const;
+    bool block_on_sphere(int bx, int by, int bz) const;
+    bool open_bake();
+    bool bake();
+    color interpolate(const unsigned char* block, double x, double y, double z) const;
+    bool lookup(double u, double v, const point3& p, color& out) const;
+public:
+    shared_ptr<texture> source;
+    std::string path;
+    bake_recipe recipe;
+    int blocks[3];
+    int stored;
+    double cell;                // Longest world-space extent of a cell
+private:
+    std::vector<int32_t> slots;
+    uint64_t data_offset;
+    size_t block_bytes;
+    int blocks_per_page;
+    int fd;
+    uint64_t id;
+    mutable std::atomic<bool> read_failed;
+    baked_texture(const baked_texture&);
+    baked_texture& operator=(const baked_texture&);
+};
+
+baked_texture::baked_texture(shared_ptr<texture> _source, const std::string& _path, const bake_recipe& _recipe)
+    : source(_source), path(_path), recipe(_recipe), stored(0), cell(0), data_offset(0), block_bytes(0), blocks_per_page(1), fd(-1), read_failed(false) {
+    id = tile_cache::new_id();
+    const int n = baked_block_size + 1;
+    if (recipe.kind == BAKE_UV) {
+        blocks[0] = recipe.width / baked_block_size;
+        blocks[1] = recipe.height / baked_block_size;
+        blocks[2] = 1;
+        cell = std::max(2 * pi * recipe.radius / recipe.width, pi * recipe.radius / recipe.height);
+        block_bytes = static_cast<size_t>(n) * n * 3;
+    }
+    else {
+        auto brick = recipe.voxel * baked_block_size;
+        for (int a = 0; a < 3; a++) blocks[a] = std::max(1, static_cast<int>(ceil((recipe.box_max[a] - recipe.box_min[a]) / brick)));
+        cell = recipe.voxel;
+        block_bytes = static_cast<size_t>(n) * n * n * 3;
+    }
+    blocks_per_page = static_cast<int>(std::max<size_t>(1, baked_page_bytes / block_bytes));
+    if (static_cast<int64_t>(blocks[0]) * blocks[1] * blocks[2] > baked_max_blocks) {
+        std::cerr << "ERROR: texture bake needs more than " << baked_max_blocks << " blocks: " << path << ".\n";
+        return;
+    }
+    if (!open_bake() && (!bake() || !open_bake())) {
+        std::cerr << "ERROR: cannot write texture bake: " << path << ".\n";
+        return;
+    }
+    if (stored == 0) std::cerr << "WARNING: " << path << ": no block is within the bake tolerance.\n";
+}
+
+// Where lattice coordinates (x, y, z) lie, in cells from the lattice origin.
+void baked_texture::lattice_point(double x, double y, double z, double& u, double& v, point3& p) const {
+    if (recipe.kind == BAKE_UV) {
+        // Inverse of sphere::get_sphere_uv.
+        u = x / recipe.width;
+        v = y / recipe.height;
+        auto theta = v * pi;
+        auto phi = u * 2 * pi - pi;
+        vec3 n(sin(theta) * cos(phi), -cos(theta), -sin(theta) * sin(phi));
+        p = point3(recipe.center[0], recipe.center[1], recipe.center[2]) + recipe.radius * n;
+    }
+    else {
+        u = v = 0;
+        p = point3(recipe.box_min[0] + x * recipe.voxel, recipe.box_min[1] + y * recipe.voxel, recipe.box_min[2] + z * recipe.voxel);
+    }
+}
+
+// The source filtered to one cell at lattice coordinates (x, y, z).
+color baked_texture::source_sample(double x, double y, double z) const {
+    double u, v;
+    point3 p;
+    lattice_point(x, y, z, u, v, p);
+    texture_footprint fp;
+    fp.dpdx = vec3(cell, 0, 0);
+    fp.dpdy = vec3(0, cell, 0);
+    if (recipe.kind == BAKE_UV) {
+        fp.dudx = 1.0 / recipe.width;
+        fp.dvdy = 1.0 / recipe.height;
+    }
+    return source->sample(u, v, p, fp);
+}
+
+// FNV-1a over the recipe and the source at fixed points of the lattice, so that a bake
+// file made from another source, such as noise with other tables, is not reused.
+uint64_t baked_texture::fingerprint() const {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    mix(&recipe, sizeof(recipe));
+    uint32_t state = 1;
+    auto next = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / 16777216.0;
+    };
+    for (int i = 0; i < 64; i++) {
+        auto x = next() * blocks[0] * baked_block_size;
+        auto y = next() * blocks[1] * baked_block_size;
+        auto z = next() * blocks[2] * baked_block_size;
+        auto c = source_sample(x, y, recipe.kind == BAKE_UV ? 0 : z);
+        double rgb[3] = {c.x(), c.y(), c.z()};
+        mix(rgb, sizeof(rgb));
+    }
+    return hash;
+}
+
+// Whether the sphere's surface passes through brick (bx, by, bz).
+bool baked_texture::block_on_sphere(int bx, int by, int bz) const {
+    const int b[3] = {bx, by, bz};
+    double near = 0, far = 0;
+    for (int a = 0; a < 3; a++) {
+        auto lo = recipe.box_min[a] + b[a] * baked_block_size * recipe.voxel - recipe.center[a];
+        auto hi = lo + baked_block_size * recipe.voxel;
+        auto d = std::max(0.0, std::max(lo, -hi));
+        near += d * d;
+        far += std::max(lo * lo, hi * hi);
+    }
+    auto r2 = recipe.radius * recipe.radius;
+    return near <= r2 && r2 <= far;
+}
+
+// Opens the bake file if it was baked from this recipe and source and is whole.
+bool baked_texture::open_bake() {
+    int f = open(path.c_str(), O_RDONLY);
+    if (f < 0) return false;
+    baked_file_header header;
+    struct stat st;
+    bool ok = fstat(f, &st) == 0 && pread(f, &header, sizeof(header), 0) == sizeof(header) && header.magic == baked_file_magic
+              && header.version == baked_file_version && memcmp(&header.recipe, &recipe, sizeof(recipe)) == 0
+              && header.blocks[0] == blocks[0] && header.blocks[1] == blocks[1] && header.blocks[2] == blocks[2] && header.stored >= 0;
+    auto total = static_cast<size_t>(blocks[0]) * blocks[1] * blocks[2];
+    if (ok) {
+        slots.resize(total);
+        auto bytes = total * sizeof(int32_t);
+        ok = pread(f, slots.data(), bytes, sizeof(header)) == static_cast<ssize_t>(bytes);
+    }
+    int32_t next = 0;
+    for (size_t b = 0; ok && b < total; b++) {
+        if (slots[b] == next) next++;
+        else ok = slots[b] == -1;
+    }
+    auto offset = sizeof(header) + total * sizeof(int32_t);
+    ok = ok && next == header.stored && offset + static_cast<uint64_t>(next) * block_bytes <= static_cast<uint64_t>(st.st_size);
+    // Last, as it costs 64 source lookups.
+    ok = ok && header.fingerprint == fingerprint();
+    if (!ok) {
+        close(f);
+        slots.clear();
+        return false;
+    }
+    fd = f;
+    stored = header.stored;
+    data_offset = offset;
+    return true;
+}
+
+// Bakes every block to a temporary file and renames it into place.
+bool baked_texture::bake() {
+    trace_span span("bake texture", path);
+    const int n = baked_block_size + 1;
+    const int layers = recipe.kind == BAKE_UV ? 1 : n;
+    auto total = static_cast<size_t>(blocks[0]) * blocks[1] * blocks[2];
+    baked_file_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = baked_file_magic;
+    header.version = baked_file_version;
+    header.recipe = recipe;
+    header.fingerprint = fingerprint();
+    for (int a = 0; a < 3; a++) header.blocks[a] = blocks[a];
+    std::vector<int32_t> table(total, -1);
+
+    auto temp_path = temp_file_path(path);
+    FILE* f = fopen(temp_path.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(table.data(), sizeof(int32_t), total, f) == total;
+    std::vector<color> lattice(block_bytes / 3);
+    std::vector<unsigned char> block(block_bytes);
+    size_t b = 0;
+    for (int bz = 0; ok && bz < blocks[2]; bz++) {
+        for (int by = 0; ok && by < blocks[1]; by++) {
+            for (int bx = 0; ok && bx < blocks[0]; bx++, b++) {
+                if (recipe.kind == BAKE_BRICKS && recipe.on_sphere && !block_on_sphere(bx, by, bz)) continue;
+                auto x0 = bx * baked_block_size, y0 = by * baked_block_size, z0 = bz * baked_block_size;
+                bool within = true;
+                size_t k = 0;
+                for (int z = 0; z < layers; z++) {
+                    for (int y = 0; y < n; y++) {
+                        for (int x = 0; x < n; x++, k++) {
+                            auto c = source_sample(x0 + x, y0 + y, z0 + z);
+                            for (int a = 0; a < 3; a++) {
+                                within = within && c[a] >= 0 && c[a] <= 1;
+                                block[3 * k + a] = static_cast<unsigned char>(255.999 * clamp(c[a], 0.0, 1.0));
+                            }
+                        }
+                    }
+                }
+                for (int z = 0; within && z < std::max(1, layers - 1); z++) {
+                    for (int y = 0; within && y < baked_block_size; y++) {
+                        for (int x = 0; within && x < baked_block_size; x++) {
+                            auto dz = recipe.kind == BAKE_UV ? 0 : z + 0.5;
+                            auto diff = interpolate(block.data(), x + 0.5, y + 0.5, dz) - source_sample(x0 + x + 0.5, y0 + y + 0.5, z0 + dz);
+                            within = fabs(diff.x()) <= recipe.tolerance && fabs(diff.y()) <= recipe.tolerance && fabs(diff.z()) <= recipe.tolerance;
+                        }
+                    }
+                }
+                if (!within) continue;
+                table[b] = header.stored++;
+                ok = fwrite(block.data(), 1, block_bytes, f) == block_bytes;
+            }
+        }
+    }
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1
+         && fwrite(table.data(), sizeof(int32_t), total, f) == total;
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(temp_path.c_str(), path.c_str()) == 0;
+    if (!ok) remove(temp_path.c_str());
+    return ok;
+}
+
+// Interpolates a block's lattice at (x, y, z) cells from its first point.
+color baked_texture::interpolate(const unsigned char* block, double x, double y, double z) const {
+    const int n = baked_block_size + 1;
+    auto i = std::min(static_cast<int>(x), baked_block_size - 1);
+    auto j = std::min(static_cast<int>(y), baked_block_size - 1);
+    auto tx = x - i, ty = y - j;
+    auto at = [&](int a, int b, int c) {
+        auto t = block + 3 * ((static_cast<size_t>(c) * n + b) * n + a);
+        return color(t[0], t[1], t[2]);
+    };
+    auto plane = [&](int c) {
+        return (1 - ty) * ((1 - tx) * at(i, j, c) + tx * at(i + 1, j, c)) + ty * ((1 - tx) * at(i, j + 1, c) + tx * at(i + 1, j + 1, c));
+    };
+    if (recipe.kind == BAKE_UV) return (1.0 / 255.0) * plane(0);
+    auto k = std::min(static_cast<int>(z), baked_block_size - 1);
+    auto tz = z - k;
+    return (1.0 / 255.0) * ((1 - tz) * plane(k) + tz * plane(k + 1));
+}
+
+bool baked_texture::lookup(double u, double v, const point3& p, color& out) const {
+    if (fd < 0) return false;
+    double x, y, z = 0;
+    if (recipe.kind == BAKE_UV) {
+        // Other surfaces' uvs do not map to the baked sphere.
+        auto r2 = recipe.radius * recipe.radius;
+        if (fabs((p - point3(recipe.center[0], recipe.center[1], recipe.center[2])).length_squared() - r2) > 1e-6 * r2) return false;
+        x = clamp(u, 0.0, 1.0) * recipe.width;
+        y = clamp(v, 0.0, 1.0) * recipe.height;
+    }
+    else {
+        x = (p.x() - recipe.box_min[0]) / recipe.voxel;
+        y = (p.y() - recipe.box_min[1]) / recipe.voxel;
+        z = (p.z() - recipe.box_min[2]) / recipe.voxel;
+        const double size = baked_block_size;
+        if (!(x >= 0 && y >= 0 && z >= 0 && x < blocks[0] * size && y < blocks[1] * size && z < blocks[2] * size)) return false;
+    }
+    auto bx = std::min(static_cast<int>(x) / baked_block_size, blocks[0] - 1);
+    auto by = std::min(static_cast<int>(y) / baked_block_size, blocks[1] - 1);
+    auto bz = std::min(static_cast<int>(z) / baked_block_size, blocks[2] - 1);
+    auto slot = slots[(static_cast<size_t>(bz) * blocks[1] + by) * blocks[0] + bx];
+    if (slot < 0) return false;
+    // Whole pages of blocks are cached, so that a thread's pinned tiles cover more of the bake.
+    auto page = slot / blocks_per_page;
+    auto first = page * blocks_per_page;
+    auto count = std::min(blocks_per_page, stored - first);
+    auto data = tile_cache::global().pinned((id << 40) | static_cast<uint64_t>(page), fd, data_offset + static_cast<uint64_t>(first) * block_bytes,
+                                            static_cast<size_t>(count) * block_bytes);
+    if (!data) {
+        if (!read_failed.exchange(true)) std::cerr << "ERROR: cannot read texture bake: " << path << ".\n";
+        return false;
+    }
+    out = interpolate(data + static_cast<size_t>(slot - first) * block_bytes, x - bx * baked_block_size, y - by * baked_block_size, z - bz * baked_block_size);
+    return true;
+}
+
+color baked_texture::sample(double u, double v, const point3& p, const texture_footprint& fp) const {
+    auto width = std::max(fp.dpdx.length(), fp.dpdy.length());
+    color c;
+    if (width >= cell && lookup(u, v, p, c)) return c;
+    return source->sample(u, v, p, fp);
+}
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "utils.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "render_settings.hpp"
+#include "renderer.hpp"
+#include "scenes.hpp"
+#include "scene_parser.hpp"
+#include "scene_image.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Batch rendering: many frames of a few scenes without rebuilding them. A job file
+// holds one job per line:
+//
+//   job <name> <scene> [<render parameter>...] [turntable <frames>] [costmap] [capture]
+//
+// <scene> is a scene file, a scene image (*.rtsi) or builtin:<name>. The parameters
+// override the scene's own settings and camera (width, spp, lookfrom, ...).
+// turntable expands the job into frames renders orbiting lookfrom around lookat.
+// costmap also writes where the render spent its time (see write_cost_maps), and capture
+// every ray it traced, to <name>.rtrays (see ray_capture.hpp).
+// Jobs are grouped by scene; each scene is built once and its BVH and textures are
+// reused by all of its jobs, in file order.
+
+struct render_job {
+    std::string name;
+    std::string scene;
+    std::vector<render_parameter> params;
+    int frame;
+    int frames;     // 0 for a still
+    bool cost_map;
+    bool capture;
+};
+
+class job_parser : public statement_parser {
+public:
+    job_parser() : jobs(nullptr) {}
+    bool parse(const std::string& _filename, std::vector<render_job>& _jobs) {
+        jobs = &_jobs;
+        return read(_filename);
+    }
+protected:
+    virtual bool statement() override;
+private:
+    std::vector<render_job>* jobs;
+};
+
+bool job_parser::statement() {
+    if (!is("job")) return error("expected 'job'");
+    pos++;
+    render_job job;
+    job.frame = 0;
+    job.frames = 0;
+    job.cost_map = false;
+    job.capture = false;
+    if (!word(job.name) || !word(job.scene)) return false;
+    if (job.scene.compare(0, 8, "builtin:") != 0) job.scene = resolve(job.scene);
+    while (!at_end()) {
+        if (is("turntable")) {
+            pos++;
+            if (!integer(job.frames)) return false;
+            if (job.frames < 1) return error("turntable needs at least one frame");
+        }
+        else if (is("costmap")) {
+            pos++;
+            job.cost_map = true;
+        }
+        else if (is("capture")) {
+            pos++;
+            job.capture = true;
+        }
+        else if (!parameter(job.params)) {
+            return false;
+        }
+    }
+    if (job.frames == 0) {
+        jobs->push_back(job);
+        return true;
+    }
+    for (int i = 0; i < job.frames; i++) {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "_%03d", i);
+        render_job frame = job;
+        frame.name += suffix;
+        frame.frame = i;
+        jobs->push_back(frame);
+    }
+    return true;
+}
+
+// A scene ready to render: its acceleration structure plus the settings from its source.
+struct prepared_scene {
+    hittable_list world;
+    medium_lighting lighting;
+    render_settings settings;
+};
+
+// Loads scene's objects and settings, the same ones every time: the random numbers that
+// builtin scenes, textures and the BVH build draw start from the default seed. A scene
+// image has no object list; it comes back whole in image_world instead.
+bool load_scene_objects(const std::string& scene, hittable_list& objects, render_settings& settings, shared_ptr<hittable>& image_world) {
+    stat_timer timer(STAT_PHASE_LOAD);
+    trace_span span("load scene", scene);
+    random_generator().seed(std::mt19937::default_seed);
+    image_world = nullptr;
+    if (scene.compare(0, 8, "builtin:") == 0) return builtin_scene(scene.substr(8), objects, settings);
+    if (scene.size() > 5 && scene.compare(scene.size() - 5, 5, ".rtsi") == 0) {
+        image_world = load_scene_image(scene, settings);
+        return image_world != nullptr;
+    }
+    settings = render_settings();
+    return load_scene_file(scene, objects, settings);
+}
+
+bool prepare_scene(const std::string& scene, prepared_scene& out) {
+    hittable_list objects;
+    shared_ptr<hittable> image_world;
+    out.world.clear();
+    out.lighting = medium_lighting();
+    if (!load_scene_objects(scene, objects, out.settings, image_world)) return false;
+    if (image_world) {
+        out.world.add(image_world);
+        out.lighting.collect(*image_world);
+        return true;
+    }
+    stat_timer timer(STAT_PHASE_BUILD);
+    trace_span span("build bvh");
+    out.world.add(make_shared<bvh_node>(objects, out.settings.time0, out.settings.time1));
+    out.lighting.collect(objects);
+    return true;
+}
+
+// Settings of one job: the scene's, then the job's overrides, then the turntable angle.
+render_settings job_settings(const render_job& job, const render_settings& scene_settings) {
+    auto settings = scene_settings;
+    apply_render_parameters(settings, job.params);
+    if (job.frames > 0) {
+        // Rodrigues rotation of the eye offset around the up axis through lookat.
+        auto angle = 2 * pi * job.frame / job.frames;
+        auto k = unit_vector(settings.vup);
+        auto v = settings.lookfrom - settings.lookat;
+        auto rotated = v * cos(angle) + cross(k, v) * sin(angle) + k * dot(k, v) * (1 - cos(angle));
+        settings.lookfrom = settings.lookat + rotated;
+    }
+    return settings;
+}
+
+// Runs every job in job_file, writing <output_dir>/<job name>.ppm, and with stats compiled
+// in <output_dir>/stats.json for the whole batch.
+bool run_batch(const std::string& job_file, const std::string& output_dir) {
+    std::vector<render_job> jobs;
+    job_parser parser;
+    if (!parser.parse(job_file, jobs)) return false;
+
+    std::vector<std::string> scenes;
+    for (const auto& job : jobs) {
+        if (std::find(scenes.begin(), scenes.end(), job.scene) == scenes.end()) scenes.push_back(job.scene);
+    }
+
+    typedef std::chrono::steady_clock clock;
+    bool ok = true;
+    for (const auto& scene : scenes) {
+        auto build_start = clock::now();
+        prepared_scene prepared;
+        if (!prepare_scene(scene, prepared)) {
+            ok = false;
+            continue;
+        }
+        std::chrono::duration<double> build_time = clock::now() - build_start;
+        std::cout << scene << ": built in " << build_time.count() << "s" << std::endl;
+
+        for (const auto& job : jobs) {
+            if (job.scene != scene) continue;
+            auto render_start = clock::now();
+            trace_span span("render job", job.name);
+            auto settings = job_settings(job, prepared.settings);
+            auto cam = settings.make_camera();
+            frame_buffer frame(settings.image_width, settings.image_height);
+            cost_buffer cost(job.cost_map ? settings.image_width : 0, job.cost_map ? settings.image_height : 0);
+            ray_capture capture;
+            if (job.capture) {
+                if (!capture.open(output_dir + "/" + job.name + ".rtrays", scene)) {
+                    ok = false;
+                    continue;
+                }
+                capture.max_depth = settings.max_depth;
+                ray_capture::active() = &capture;
+            }
+            for (int s = 0; s < settings.samples_per_pixel; s++) {
+                render_pass(prepared.world, settings, cam, frame, &prepared.lighting, job.cost_map ? &cost : nullptr);
+            }
+            if (job.capture) {
+                ray_capture::active() = nullptr;
+                ok = capture.close() && ok;
+            }
+            ok = write_ppm(output_dir + "/" + job.name + ".ppm", frame) && ok;
+            if (job.cost_map) ok = write_cost_maps(output_dir + "/" + job.name, cost) && ok;
+            std::chrono::duration<double> render_time = clock::now() - render_start;
+            std::cout << "  " << job.name << ": " << settings.image_width << "x" << settings.image_height << ", "
+                      << settings.samples_per_pixel << " spp in " << render_time.count() << "s" << std::endl;
+        }
+    }
+    return write_render_stats(output_dir + "/stats.json") && ok;
+}
+
+#endif
@@ -2,26 +2,60 @@
 #define BOX_H_
 
 #include "utils.hpp"
-#include "aarect.hpp"
-#include "hittable_list.hpp"
+#include "hittable.hpp"
+#include "render_stats.hpp"
+
+// Slab test of a ray against the box [bmin, bmax]. Faces are numbered 2 * axis + side,
+// side 0 being the min plane and side 1 the max plane.
+inline bool box_slabs(const point3& o, const vec3& d, const point3& bmin, const point3& bmax,
+                      double& t_enter, double& t_exit, int& face_enter, int& face_exit) {
+    t_enter = -infinity;
+    t_exit = infinity;
+    face_enter = face_exit = 0;
+    for (int a = 0; a < 3; a++) {
+        auto inv_d = 1.0 / d[a];
+        auto t0 = (bmin[a] - o[a]) * inv_d;
+        auto t1 = (bmax[a] - o[a]) * inv_d;
+        int f0 = 2 * a;
+        int f1 = 2 * a + 1;
+        if (inv_d < 0) {
+            std::swap(t0, t1);
+            std::swap(f0, f1);
+        }
+        if (t0 > t_enter) {
+            t_enter = t0;
+            face_enter = f0;
+        }
+        if (t1 < t_exit) {
+            t_exit = t1;
+            face_exit = f1;
+        }
+    }
+    return t_enter <= t_exit;
+}
+
+// Fills u, v, their derivatives and the outward normal for a local-space hit point on
+// face f of [bmin, bmax], using the same uv layout as the xy/xz/yz rects.
+inline void box_face_attribs(const point3& q, const point3& bmin, const point3& bmax, int f, double& u, double& v,
+                             vec3& dpdu, vec3& dpdv, vec3& normal) {
+    auto axis = f / 2;
+    auto a = (axis == 0) ? 1 : 0;
+    auto b = (axis == 2) ? 1 : 2;
+    u = (q[a] - bmin[a]) / (bmax[a] - bmin[a]);
+    v = (q[b] - bmin[b]) / (bmax[b] - bmin[b]);
+    dpdu = dpdv = vec3(0, 0, 0);
+    dpdu[a] = bmax[a] - bmin[a];
+    dpdv[b] = bmax[b] - bmin[b];
+    normal = vec3(0, 0, 0);
+    normal[axis] = (f & 1) ? 1.0 : -1.0;
+}
 
 class box : public hittable {
 public:
     box() {}
-    box(const point3& p0, const point3& p1,  shared_ptr<material> ptr) {
-        box_min = p0;
-        box_max = p1;
-
-        sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-        sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-
-        sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-        sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-
-        sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-        sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-    }
+    box(const point3& p0, const point3& p1, shared_ptr<material> ptr) : box_min(p0), box_max(p1), mp(ptr) {}
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         output_box = aabb(box_min, box_max);
         return true;
@@ -29,11 +63,129 @@ public:
 public:
     point3 box_min;
     point3 box_max;
-    hittable_list sides;
+    shared_ptr<material> mp;
 };
 
 bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+    RT_STAT_INC(prim_tests[STAT_PRIM_BOX]);
+    double t_enter, t_exit;
+    int face_enter, face_exit;
+    if (!box_slabs(r.origin(), r.direction(), box_min, box_max, t_enter, t_exit, face_enter, face_exit)) return false;
+    auto t = t_enter;
+    auto face = face_enter;
+    if (t < t_min || t > t_max) {
+        t = t_exit;
+        face = face_exit;
+        if (t < t_min || t > t_max) return false;
+    }
+    rec.t = t;
+    rec.p = r.at(t);
+    vec3 outward_normal;
+    box_face_attribs(rec.p, box_min, box_max, face, rec.u, rec.v, rec.dpdu, rec.dpdv, outward_normal);
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mp;
+    return true;
+}
+
+bool box::hit_spans(const ray& r, ray_spans& spans) const {
+    double t_enter, t_exit;
+    int face_enter, face_exit;
+    if (!box_slabs(r.origin(), r.direction(), box_min, box_max, t_enter, t_exit, face_enter, face_exit)) return false;
+    spans.add(t_enter, t_exit);
+    return true;
+}
+
+// A box [p0, p1] given in its own frame, placed in the world by a rigid transform:
+// world = origin + x * x_axis + y * y_axis + z * z_axis. Replaces translate(rotate_y(box))
+// chains with one change of basis and one slab test.
+class oriented_box : public hittable {
+public:
+    oriented_box() {}
+    oriented_box(const point3& p0, const point3& p1, const vec3& x_axis, const vec3& y_axis, const point3& _origin, shared_ptr<material> ptr)
+        : box_min(p0), box_max(p1), origin(_origin), mp(ptr) {
+        axis[0] = unit_vector(x_axis);
+        axis[1] = unit_vector(y_axis);
+        axis[2] = cross(axis[0], axis[1]);
+    }
+    // Same placement as translate(rotate_y(box(p0, p1), angle), offset).
+    oriented_box(const point3& p0, const point3& p1, double angle, const vec3& offset, shared_ptr<material> ptr)
+        : oriented_box(p0, p1, vec3(cos(degrees_to_radians(angle)), 0, -sin(degrees_to_radians(angle))), vec3(0, 1, 0), offset, ptr) {}
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+public:
+    point3 box_min;
+    point3 box_max;
+    vec3 axis[3];
+    point3 origin;
+    shared_ptr<material> mp;
+private:
+    ray to_local(const ray& r) const {
+        auto o = r.origin() - origin;
+        auto d = r.direction();
+        return ray(point3(dot(o, axis[0]), dot(o, axis[1]), dot(o, axis[2])),
+                   vec3(dot(d, axis[0]), dot(d, axis[1]), dot(d, axis[2])), r.time());
+    }
+    vec3 to_world(const vec3& v) const {
+        return v[0] * axis[0] + v[1] * axis[1] + v[2] * axis[2];
+    }
+};
+
+bool oriented_box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_BOX]);
+    auto local_r = to_local(r);
+    double t_enter, t_exit;
+    int face_enter, face_exit;
+    if (!box_slabs(local_r.origin(), local_r.direction(), box_min, box_max, t_enter, t_exit, face_enter, face_exit)) return false;
+    auto t = t_enter;
+    auto face = face_enter;
+    if (t < t_min || t > t_max) {
+        t = t_exit;
+        face = face_exit;
+        if (t < t_min || t > t_max) return false;
+    }
+    // The transform is rigid, so t is the same in both frames.
+    vec3 local_normal, dpdu, dpdv;
+    box_face_attribs(local_r.at(t), box_min, box_max, face, rec.u, rec.v, dpdu, dpdv, local_normal);
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.dpdu = to_world(dpdu);
+    rec.dpdv = to_world(dpdv);
+    auto outward_normal = to_world(local_normal);
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mp;
+    return true;
+}
+
+bool oriented_box::hit_spans(const ray& r, ray_spans& spans) const {
+    auto local_r = to_local(r);
+    double t_enter, t_exit;
+    int face_enter, face_exit;
+    if (!box_slabs(local_r.origin(), local_r.direction(), box_min, box_max, t_enter, t_exit, face_enter, face_exit)) return false;
+    spans.add(t_enter, t_exit);
+    return true;
+}
+
+bool oriented_box::bounding_box(double time0, double time1, aabb& output_box) const {
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                auto x = i ? box_max.x() : box_min.x();
+                auto y = j ? box_max.y() : box_min.y();
+                auto z = k ? box_max.z() : box_min.z();
+                auto corner = origin + x * axis[0] + y * axis[1] + z * axis[2];
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], corner[c]);
+                    max[c] = fmax(max[c], corner[c]);
+                }
+            }
+        }
+    }
+    output_box = aabb(min, max);
+    return true;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -4,18 +4,25 @@
 #include "utils.hpp"
 #include "hittable.hpp"
 #include "hittable_list.hpp"
+#include "render_stats.hpp"
 
 class bvh_node : public hittable {
 public:
     bvh_node() {}
     bvh_node(const hittable_list& list, double time0, double time1) : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
-    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1);
+    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1) {
+        auto objects = src_objects;
+        build(objects, start, end, time0, time1);
+    }
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 public:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb box;
+private:
+    // Sorts objects[start, end) in place, so the whole tree shares one copy of the list.
+    void build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1);
 };
 
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
@@ -24,6 +31,8 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 }
 
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_PERF_REGION(PERF_REGION_BVH);
+    RT_STAT_INC(bvh_nodes);
     if (!box.hit(r, t_min, t_max)) {
         return false;
     }
@@ -34,7 +43,7 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     return hit_left || hit_right;
 }
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
+inline bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis) {
     aabb box_a;
     aabb box_b;
     if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b)) {
@@ -43,20 +52,19 @@ inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable>
     return box_a.min().e[axis] < box_b.min().e[axis];
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 0);
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 1);
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 2);
 }
 
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1) {
-    auto objects = src_objects;
+void bvh_node::build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1) {
     int axis = random_int(0, 2);
     auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
     size_t object_span = end - start;
@@ -77,8 +85,12 @@ bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t
     else {
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
         auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        auto left_node = make_shared<bvh_node>();
+        auto right_node = make_shared<bvh_node>();
+        left_node->build(objects, start, mid, time0, time1);
+        right_node->build(objects, mid, end, time0, time1);
+        left = left_node;
+        right = right_node;
     }
 
     aabb box_left, box_right;
@@ -0,0 +1,217 @@
+#ifndef BVH_INSPECT_H_
+#define BVH_INSPECT_H_
+
+#include "utils.hpp"
+#include "aabb.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "flat_bvh.hpp"
+#include "triangle_mesh.hpp"
+#include "scene_image.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Quality of a built BVH: node counts, leaf sizes, depth, SAH cost and how much sibling
+// boxes overlap. Works on bvh_node trees and on flat BVHs (triangle meshes, scene
+// images). SAH cost is the expected work of a ray through the root box, counting one
+// per box test and one per primitive test, each weighted by the chance that the ray
+// reaches the node (its surface area over the root's). Overlap is the surface area of
+// the intersection of an interior node's two child boxes over the node's own.
+//
+// A bvh_node whose children are primitives is its leaf. A one-primitive bvh_node holds it
+// as both children, and hit tests it twice; its leaf size is 1 but its cost is 2.
+
+struct bvh_report {
+    size_t interior_nodes;
+    size_t leaves;
+    size_t items;                       // Primitives over all leaves
+    std::vector<size_t> leaf_sizes;     // Leaves by primitive count
+    int max_depth;                      // Of leaves; the root is depth 0
+    double mean_leaf_depth;
+    double sah_cost;
+    double mean_overlap;                // Over interior nodes
+    double area_weighted_overlap;       // The same, weighted by node area as rays meet them
+    std::vector<std::vector<aabb>> levels;  // Node boxes by depth, up to the requested depth
+};
+
+class bvh_inspector {
+public:
+    // Keeps the boxes of the first `keep_levels` levels in the report.
+    explicit bvh_inspector(int _keep_levels)
+        : keep_levels(_keep_levels), root_area(0), depth_sum(0), overlap_sum(0), overlap_area(0), interior_area(0), cost_sum(0) {
+        report.interior_nodes = report.leaves = report.items = 0;
+        report.max_depth = 0;
+    }
+    void interior(int depth, const aabb& box, const aabb& left, const aabb& right);
+    void leaf(int depth, const aabb& box, int items, int tests);
+    // Walks world's BVH; false if it has none.
+    bool inspect(const hittable& world, double time0, double time1);
+    void inspect(const flat_bvh_node* nodes, int node, int depth);
+    // Totals up; call once the walks are done.
+    const bvh_report& finish();
+public:
+    bvh_report report;
+private:
+    void inspect(const bvh_node& node, int depth, double time0, double time1);
+    void visit(int depth, const aabb& box, double tests);
+
+    int keep_levels;
+    double root_area;
+    double depth_sum;
+    double overlap_sum;
+    double overlap_area;
+    double interior_area;
+    double cost_sum;    // Areas times tests, not yet over the root area
+};
+
+void bvh_inspector::visit(int depth, const aabb& box, double tests) {
+    auto area = aabb_area(box);
+    if (depth == 0) root_area = area;
+    cost_sum += area * tests;
+    if (depth < keep_levels) {
+        if (report.levels.size() <= static_cast<size_t>(depth)) report.levels.resize(depth + 1);
+        report.levels[depth].push_back(box);
+    }
+}
+
+void bvh_inspector::interior(int depth, const aabb& box, const aabb& left, const aabb& right) {
+    report.interior_nodes++;
+    visit(depth, box, 1);
+    point3 lo, hi;
+    for (int a = 0; a < 3; a++) {
+        lo[a] = std::max(left.min()[a], right.min()[a]);
+        hi[a] = std::min(left.max()[a], right.max()[a]);
+    }
+    auto overlap = 0.0;
+    if (lo.x() <= hi.x() && lo.y() <= hi.y() && lo.z() <= hi.z()) overlap = aabb_area(aabb(lo, hi));
+    auto area = aabb_area(box);
+    if (area > 0) overlap_sum += overlap / area;
+    overlap_area += overlap;
+    interior_area += area;
+}
+
+void bvh_inspector::leaf(int depth, const aabb& box, int items, int tests) {
+    report.leaves++;
+    report.items += items;
+    if (report.leaf_sizes.size() <= static_cast<size_t>(items)) report.leaf_sizes.resize(items + 1, 0);
+    report.leaf_sizes[items]++;
+    report.max_depth = std::max(report.max_depth, depth);
+    depth_sum += depth;
+    visit(depth, box, 1 + tests);
+}
+
+void bvh_inspector::inspect(const bvh_node& node, int depth, double time0, double time1) {
+    auto left = dynamic_cast<const bvh_node*>(node.left.get());
+    auto right = dynamic_cast<const bvh_node*>(node.right.get());
+    if (!left && !right) {
+        leaf(depth, node.box, node.left == node.right ? 1 : 2, 2);
+        return;
+    }
+    aabb left_box, right_box;
+    node.left->bounding_box(time0, time1, left_box);
+    node.right->bounding_box(time0, time1, right_box);
+    interior(depth, node.box, left_box, right_box);
+    // A primitive next to a subtree counts as a leaf of its own, tested without a box.
+    if (left) inspect(*left, depth + 1, time0, time1);
+    else leaf(depth + 1, left_box, 1, 0);
+    if (right) inspect(*right, depth + 1, time0, time1);
+    else leaf(depth + 1, right_box, 1, 0);
+}
+
+void bvh_inspector::inspect(const flat_bvh_node* nodes, int node, int depth) {
+    const auto& n = nodes[node];
+    if (n.count > 0) {
+        leaf(depth, n.box, n.count, n.count);
+        return;
+    }
+    interior(depth, n.box, nodes[node + 1].box, nodes[n.offset].box);
+    inspect(nodes, node + 1, depth + 1);
+    inspect(nodes, n.offset, depth + 1);
+}
+
+bool bvh_inspector::inspect(const hittable& world, double time0, double time1) {
+    if (auto node = dynamic_cast<const bvh_node*>(&world)) {
+        inspect(*node, 0, time0, time1);
+        return true;
+    }
+    if (auto mesh = dynamic_cast<const triangle_mesh*>(&world)) {
+        if (mesh->nodes.empty()) return false;
+        inspect(mesh->nodes.data(), 0, 0);
+        return true;
+    }
+    if (auto scene = dynamic_cast<const mapped_scene*>(&world)) {
+        if (scene->bvh_node_count() == 0) return false;
+        inspect(scene->bvh_nodes(), 0, 0);
+        return true;
+    }
+    auto list = dynamic_cast<const hittable_list*>(&world);
+    if (list && list->objects.size() == 1) return inspect(*list->objects[0], time0, time1);
+    std::cerr << "ERROR: no BVH to inspect.\n";
+    return false;
+}
+
+const bvh_report& bvh_inspector::finish() {
+    report.mean_leaf_depth = report.leaves > 0 ? depth_sum / report.leaves : 0;
+    report.sah_cost = root_area > 0 ? cost_sum / root_area : 0;
+    report.mean_overlap = report.interior_nodes > 0 ? overlap_sum / report.interior_nodes : 0;
+    report.area_weighted_overlap = interior_area > 0 ? overlap_area / interior_area : 0;
+    return report;
+}
+
+void print_bvh_report(const std::string& name, const bvh_report& r) {
+    printf("%s\n", name.c_str());
+    printf("  nodes %zu interior, %zu leaves, %zu primitives\n", r.interior_nodes, r.leaves, r.items);
+    printf("  depth max %d, mean %.2f\n", r.max_depth, r.mean_leaf_depth);
+    printf("  SAH cost %.2f\n", r.sah_cost);
+    printf("  sibling overlap mean %.4f, area weighted %.4f\n", r.mean_overlap, r.area_weighted_overlap);
+    printf("  leaf sizes");
+    for (size_t k = 0; k < r.leaf_sizes.size(); k++) {
+        if (r.leaf_sizes[k] > 0) printf(" %zu:%zu", k, r.leaf_sizes[k]);
+    }
+    printf("\n");
+}
+
+void write_bvh_report_json(std::ostream& out, const std::string& name, const bvh_report& r) {
+    out << "{\"name\": \"" << name << "\", \"interior_nodes\": " << r.interior_nodes << ", \"leaves\": " << r.leaves << ", \"primitives\": " << r.items
+        << ", \"max_depth\": " << r.max_depth << ", \"mean_leaf_depth\": " << r.mean_leaf_depth << ", \"sah_cost\": " << r.sah_cost
+        << ", \"mean_overlap\": " << r.mean_overlap << ", \"area_weighted_overlap\": " << r.area_weighted_overlap << ", \"leaf_sizes\": {";
+    bool first = true;
+    for (size_t k = 0; k < r.leaf_sizes.size(); k++) {
+        if (r.leaf_sizes[k] == 0) continue;
+        out << (first ? "" : ", ") << "\"" << k << "\": " << r.leaf_sizes[k];
+        first = false;
+    }
+    out << "}}";
+}
+
+// Writes the kept node boxes as an OBJ wireframe, one group per level.
+bool write_bvh_levels_obj(const std::string& path, const bvh_report& r) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    static const int edges[12][2] = {{0, 1}, {2, 3}, {4, 5}, {6, 7}, {0, 2}, {1, 3}, {4, 6}, {5, 7}, {0, 4}, {1, 5}, {2, 6}, {3, 7}};
+    size_t vertex = 1;
+    for (size_t level = 0; level < r.levels.size(); level++) {
+        out << "g level_" << level << "\n";
+        for (const auto& box : r.levels[level]) {
+            for (int c = 0; c < 8; c++) {
+                out << "v " << (c & 1 ? box.max() : box.min()).x() << " " << (c & 2 ? box.max() : box.min()).y() << " "
+                    << (c & 4 ? box.max() : box.min()).z() << "\n";
+            }
+            for (int e = 0; e < 12; e++) out << "l " << vertex + edges[e][0] << " " << vertex + edges[e][1] << "\n";
+            vertex += 8;
+        }
+    }
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
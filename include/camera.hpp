@@ -42,6 +42,20 @@ public:
             return ray(point3(p.x(), p.y(), 0), vec3(0, 0, -1));
         }
     }
+
+    // Same as get_ray, plus differentials towards (s + ds, t) and (s, t + dt).
+    ray get_ray(double s, double t, double ds, double dt) const {
+        if (type != PROJECTION_ORTHO) return get_ray(s, t);
+        vec3 rd = len_radius * random_in_unit_disc();
+        vec3 offset = u * rd.x() + v * rd.y();
+        auto target = lower_left_corner + s * horizontal + t * vertical;
+        ray r(origin + offset, target - origin - offset, random_double(time0, time1));
+        r.has_differentials = true;
+        r.rx_origin = r.ry_origin = r.orig;
+        r.rx_direction = r.dir + ds * horizontal;
+        r.ry_direction = r.dir + dt * vertical;
+        return r;
+    }
 private:
     point3 origin;
     point3 lower_left_corner;
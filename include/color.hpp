@@ -23,7 +23,7 @@ void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
         << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
 }
 
-std::vector <double> get_color(color pixel_color, int samples_per_pixel) {
+color get_color(color pixel_color, int samples_per_pixel) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -33,8 +33,7 @@ std::vector <double> get_color(color pixel_color, int samples_per_pixel) {
     g = sqrt(g * scale);
     b = sqrt(b * scale);
 
-    std::vector <double> res{r, g, b};
-    return res;
+    return color(r, g, b);
 }
 
 #endif // COLOR_H_
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "utils.hpp"
 #include "hittable.hpp"
+#include "render_stats.hpp"
 #include "material.hpp"
 #include "texture.hpp"
 
@@ -20,31 +21,50 @@ public:
     double neg_inv_density;
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    const bool enable_debug = false;
-    hit_record rec1, rec2;
-    if (!boundary->hit(r, -infinity, infinity, rec1)) return false;
-    if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2)) return false;
-    if (enable_debug) std::cerr << "\tt_min=" << rec1.t << ", t_max=" << rec2.t << "\n";
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-    if (rec1.t >= rec2.t) return false;
-    if (rec1.t < 0) rec1.t = 0;
+// Samples where a flight through a homogeneous medium collides, within the parts of
+// spans inside [t_min, t_max]. Exponential flights are memoryless, so one distance is
+// drawn and spent across the intervals in order.
+inline bool sample_free_flight(const ray_spans& spans, const ray& r, double t_min, double t_max, double neg_inv_density, double& t) {
+    double t_enter[ray_spans::capacity], t_exit[ray_spans::capacity];
+    int count = 0;
+    for (int i = 0; i < spans.count; i++) {
+        t_enter[count] = fmax(spans.enter[i], t_min);
+        t_exit[count] = fmin(spans.exit[i], t_max);
+        if (t_enter[count] >= t_exit[count]) continue;
+        if (t_enter[count] < 0) t_enter[count] = 0;
+        count++;
+    }
+    if (count == 0) return false;
 
     const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
-
-    if (hit_distance > distance_inside_boundary) return false;
+    auto hit_distance = neg_inv_density * log(random_double());
+    for (int i = 0; i < count; i++) {
+        const auto distance_inside_boundary = (t_exit[i] - t_enter[i]) * ray_length;
+        if (hit_distance <= distance_inside_boundary) {
+            t = t_enter[i] + hit_distance / ray_length;
+            return true;
+        }
+        hit_distance -= distance_inside_boundary;
+    }
+    return false;
+}
 
-    rec.t = rec1.t + hit_distance / ray_length;
+// The boundary reports all of its entry/exit intervals in one query.
+bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_MEDIUM]);
+    const bool enable_debug = false;
+    ray_spans spans;
+    if (!boundary->hit_spans(r, spans)) return false;
+    if (enable_debug) std::cerr << "\tt_min=" << spans.enter[0] << ", t_max=" << spans.exit[spans.count - 1] << "\n";
+    if (!sample_free_flight(spans, r, t_min, t_max, neg_inv_density, rec.t)) return false;
     rec.p = r.at(rec.t);
 
     if (enable_debug) {
-        std::cerr << "hit_distance = " << hit_distance << "\n" << "rec.t = " << rec.t << ", rec.p" << rec.p << "\n";
+        std::cerr << "rec.t = " << rec.t << ", rec.p" << rec.p << "\n";
     }
 
     rec.normal = vec3(1, 0, 0);
+    rec.dpdu = rec.dpdv = vec3(0, 0, 0);
     rec.front_face = true;
     rec.mat_ptr = phase_function;
     return true;
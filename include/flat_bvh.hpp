@@ -0,0 +1,214 @@
+#ifndef FLAT_BVH_H_
+#define FLAT_BVH_H_
+
+#include "utils.hpp"
+#include "aabb.hpp"
+#include "render_stats.hpp"
+#include <vector>
+
+// Pointer-free BVH stored as a node array in depth-first order. Used where the items
+// are not hittables (mesh triangles, scene image primitives) or the tree has to be
+// written to disk as is.
+struct flat_bvh_node {
+    aabb box;
+    int offset;     // First entry of the item index for leaves, right child for interior nodes (left child is the next node)
+    int count;      // Items in the leaf, 0 for interior nodes
+    int axis;       // Split axis of interior nodes
+};
+
+const int flat_bvh_max_depth = 60;
+
+inline double aabb_area(const aabb& b) {
+    auto d = b.max() - b.min();
+    return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+// Binned SAH split of index[start, end). Returns the index of the new node.
+int flat_bvh_build_node(const std::vector<aabb>& boxes, const std::vector<point3>& centroids, std::vector<int>& index,
+                        std::vector<flat_bvh_node>& nodes, int start, int end, int depth, int max_leaf_size) {
+    const int bin_count = 16;
+    auto node_index = static_cast<int>(nodes.size());
+    nodes.push_back(flat_bvh_node());
+
+    point3 bmin = boxes[index[start]].minimum;
+    point3 bmax = boxes[index[start]].maximum;
+    point3 cmin = centroids[index[start]];
+    point3 cmax = cmin;
+    for (int i = start + 1; i < end; i++) {
+        auto t = index[i];
+        for (int a = 0; a < 3; a++) {
+            bmin[a] = std::min(bmin[a], boxes[t].minimum[a]);
+            bmax[a] = std::max(bmax[a], boxes[t].maximum[a]);
+            cmin[a] = std::min(cmin[a], centroids[t][a]);
+            cmax[a] = std::max(cmax[a], centroids[t][a]);
+        }
+    }
+    aabb bounds(bmin, bmax);
+    nodes[node_index].box = bounds;
+    nodes[node_index].offset = start;
+    nodes[node_index].count = end - start;
+    nodes[node_index].axis = 0;
+
+    auto count = end - start;
+    if (count <= max_leaf_size || depth >= flat_bvh_max_depth) return node_index;
+
+    int best_axis = -1;
+    int best_bin = 0;
+    auto best_cost = infinity;
+    for (int a = 0; a < 3; a++) {
+        auto extent = cmax[a] - cmin[a];
+        if (extent <= 0) continue;
+        // Bin bounds are kept as raw min/max arrays; building aabbs here dominates build time.
+        double bin_lo[bin_count][3], bin_hi[bin_count][3];
+        int bin_n[bin_count] = {0};
+        for (int b = 0; b < bin_count; b++) {
+            for (int c = 0; c < 3; c++) {
+                bin_lo[b][c] = infinity;
+                bin_hi[b][c] = -infinity;
+            }
+        }
+        auto scale = bin_count / extent;
+        for (int i = start; i < end; i++) {
+            auto t = index[i];
+            auto b = static_cast<int>((centroids[t][a] - cmin[a]) * scale);
+            if (b >= bin_count) b = bin_count - 1;
+            for (int c = 0; c < 3; c++) {
+                bin_lo[b][c] = std::min(bin_lo[b][c], boxes[t].minimum[c]);
+                bin_hi[b][c] = std::max(bin_hi[b][c], boxes[t].maximum[c]);
+            }
+            bin_n[b]++;
+        }
+        // Sweep from the right to get the area/count of every suffix, then from the left.
+        double right_area[bin_count];
+        int right_n[bin_count];
+        double lo[3], hi[3];
+        int acc_n = 0;
+        for (int c = 0; c < 3; c++) {
+            lo[c] = infinity;
+            hi[c] = -infinity;
+        }
+        for (int b = bin_count - 1; b > 0; b--) {
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], bin_lo[b][c]);
+                hi[c] = std::max(hi[c], bin_hi[b][c]);
+            }
+            acc_n += bin_n[b];
+            right_area[b] = acc_n ? aabb_area(aabb(point3(lo[0], lo[1], lo[2]), point3(hi[0], hi[1], hi[2]))) : 0;
+            right_n[b] = acc_n;
+        }
+        acc_n = 0;
+        for (int c = 0; c < 3; c++) {
+            lo[c] = infinity;
+            hi[c] = -infinity;
+        }
+        for (int b = 0; b < bin_count - 1; b++) {
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], bin_lo[b][c]);
+                hi[c] = std::max(hi[c], bin_hi[b][c]);
+            }
+            acc_n += bin_n[b];
+            if (acc_n == 0 || right_n[b + 1] == 0) continue;
+            auto cost = acc_n * aabb_area(aabb(point3(lo[0], lo[1], lo[2]), point3(hi[0], hi[1], hi[2]))) + right_n[b + 1] * right_area[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis < 0) {
+        // All centroids coincide; split in the middle to keep leaves small.
+        mid = start + count / 2;
+    }
+    else if (best_cost >= count * aabb_area(bounds) && count <= 4 * max_leaf_size) {
+        return node_index;
+    }
+    else {
+        auto extent = cmax[best_axis] - cmin[best_axis];
+        auto lo = cmin[best_axis];
+        auto split = std::partition(index.begin() + start, index.begin() + end, [&](int t) {
+            auto b = static_cast<int>(bin_count * (centroids[t][best_axis] - lo) / extent);
+            if (b >= bin_count) b = bin_count - 1;
+            return b <= best_bin;
+        });
+        mid = static_cast<int>(split - index.begin());
+        if (mid == start || mid == end) mid = start + count / 2;
+    }
+
+    nodes[node_index].count = 0;
+    nodes[node_index].axis = best_axis < 0 ? 0 : best_axis;
+    flat_bvh_build_node(boxes, centroids, index, nodes, start, mid, depth + 1, max_leaf_size);
+    auto right = flat_bvh_build_node(boxes, centroids, index, nodes, mid, end, depth + 1, max_leaf_size);
+    nodes[node_index].offset = right;
+    return node_index;
+}
+
+// Builds nodes over items with the given bounds. index receives the leaf order of the items.
+void build_flat_bvh(const std::vector<aabb>& boxes, std::vector<int>& index, std::vector<flat_bvh_node>& nodes, int max_leaf_size = 4) {
+    nodes.clear();
+    index.clear();
+    auto n = static_cast<int>(boxes.size());
+    if (n == 0) return;
+    std::vector<point3> centroids(n);
+    index.resize(n);
+    for (int i = 0; i < n; i++) {
+        centroids[i] = 0.5 * (boxes[i].minimum + boxes[i].maximum);
+        index[i] = i;
+    }
+    nodes.reserve(2 * n / max_leaf_size + 1);
+    flat_bvh_build_node(boxes, centroids, index, nodes, 0, n, 0, max_leaf_size);
+}
+
+// Walks the nodes front to back and calls hit_item(item, t_max) for every item in a leaf
+// the ray reaches. hit_item returns true on a hit closer than t_max and lowers t_max.
+template <typename item_fn>
+bool traverse_flat_bvh(const flat_bvh_node* nodes, const int* index, const ray& r, double t_min, double& t_max, item_fn& hit_item) {
+    RT_PERF_REGION(PERF_REGION_BVH);
+    const auto o = r.origin();
+    const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    const bool dir_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+    int stack[flat_bvh_max_depth + 4];
+    int sp = 0;
+    int node_index = 0;
+    bool hit_anything = false;
+    while (true) {
+        RT_STAT_INC(bvh_nodes);
+        const auto& node = nodes[node_index];
+        auto t0 = t_min;
+        auto t1 = t_max;
+        for (int a = 0; a < 3 && t0 <= t1; a++) {
+            auto t_near = (node.box.minimum[a] - o[a]) * inv_dir[a];
+            auto t_far = (node.box.maximum[a] - o[a]) * inv_dir[a];
+            if (dir_neg[a]) std::swap(t_near, t_far);
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
+        }
+        if (t0 <= t1) {
+            if (node.count > 0) {
+                for (int i = 0; i < node.count; i++) {
+                    if (hit_item(index[node.offset + i], t_max)) hit_anything = true;
+                }
+            }
+            else {
+                // Visit the child on the near side of the split first.
+                if (dir_neg[node.axis]) {
+                    stack[sp++] = node_index + 1;
+                    node_index = node.offset;
+                }
+                else {
+                    stack[sp++] = node.offset;
+                    node_index = node_index + 1;
+                }
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        node_index = stack[--sp];
+    }
+    return hit_anything;
+}
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef HETEROGENEOUS_MEDIUM_H_
+#define HETEROGENEOUS_MEDIUM_H_
+
+#include "utils.hpp"
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "render_stats.hpp"
+#include "trace.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Spatially varying density. Values are relative; the medium using a field scales them.
+class density_field {
+public:
+    virtual ~density_field() {}
+    virtual double density(const point3& p) const = 0;
+    // An upper bound of density() over the box, for majorants.
+    virtual double max_density(const aabb& box) const = 0;
+    // Density is zero outside of this box.
+    virtual aabb bounds() const = 0;
+    // Majorant grid resolution along the longest axis that suits the field.
+    virtual int majorant_cells() const { return 16; }
+};
+
+// Densities at the vertices of an nx x ny x nz lattice spanning a box, trilinearly
+// interpolated in between.
+class density_grid : public density_field {
+public:
+    density_grid(int _nx, int _ny, int _nz, const aabb& _box)
+        : nx(_nx), ny(_ny), nz(_nz), box(_box), values(static_cast<size_t>(_nx) * _ny * _nz, 0.0f) {}
+
+    float& at(int i, int j, int k) { return values[(static_cast<size_t>(k) * ny + j) * nx + i]; }
+    float at(int i, int j, int k) const { return values[(static_cast<size_t>(k) * ny + j) * nx + i]; }
+    // World position of vertex (i, j, k).
+    point3 vertex(int i, int j, int k) const {
+        auto size = box.max() - box.min();
+        return box.min() + vec3(size.x() * i / (nx - 1), size.y() * j / (ny - 1), size.z() * k / (nz - 1));
+    }
+
+    virtual double density(const point3& p) const override;
+    virtual double max_density(const aabb& region) const override;
+    virtual aabb bounds() const override { return box; }
+public:
+    int nx, ny, nz;
+    aabb box;
+    std::vector<float> values;  // x fastest
+};
+
+double density_grid::density(const point3& p) const {
+    double g[3];
+    const int n[3] = {nx, ny, nz};
+    int c[3];
+    for (int a = 0; a < 3; a++) {
+        g[a] = (p[a] - box.min()[a]) / (box.max()[a] - box.min()[a]) * (n[a] - 1);
+        if (!(g[a] >= 0 && g[a] <= n[a] - 1)) return 0;
+        c[a] = std::min(static_cast<int>(g[a]), n[a] - 2);
+        g[a] -= c[a];
+    }
+    auto lerp = [](double a, double b, double t) { return a + t * (b - a); };
+    auto x00 = lerp(at(c[0], c[1], c[2]), at(c[0] + 1, c[1], c[2]), g[0]);
+    auto x10 = lerp(at(c[0], c[1] + 1, c[2]), at(c[0] + 1, c[1] + 1, c[2]), g[0]);
+    auto x01 = lerp(at(c[0], c[1], c[2] + 1), at(c[0] + 1, c[1], c[2] + 1), g[0]);
+    auto x11 = lerp(at(c[0], c[1] + 1, c[2] + 1), at(c[0] + 1, c[1] + 1, c[2] + 1), g[0]);
+    return lerp(lerp(x00, x10, g[1]), lerp(x01, x11, g[1]), g[2]);
+}
+
+// Trilinear weights are convex, so the largest vertex touching the region bounds it.
+double density_grid::max_density(const aabb& region) const {
+    const int n[3] = {nx, ny, nz};
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        auto scale = (n[a] - 1) / (box.max()[a] - box.min()[a]);
+        lo[a] = std::max(0, static_cast<int>(floor((region.min()[a] - box.min()[a]) * scale)));
+        hi[a] = std::min(n[a] - 1, static_cast<int>(ceil((region.max()[a] - box.min()[a]) * scale)));
+        if (lo[a] > hi[a]) return 0;
+    }
+    float result = 0;
+    for (int k = lo[2]; k <= hi[2]; k++) {
+        for (int j = lo[1]; j <= hi[1]; j++) {
+            for (int i = lo[0]; i <= hi[0]; i++) {
+                result = std::max(result, at(i, j, k));
+            }
+        }
+    }
+    return result;
+}
+
+// Density grid files (.rtdg): this header, then nx * ny * nz floats, x fastest.
+const uint32_t density_grid_magic = 0x47445452;    // "RTDG"
+const uint32_t density_grid_version = 1;
+
+struct density_grid_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t nx, ny, nz;
+    int32_t pad;
+    double min[3];
+    double max[3];
+};
+
+shared_ptr<density_grid> load_density_grid(const std::string& filename) {
+    trace_span span("load volume", filename);
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        std::cerr << "ERROR: cannot open density grid " << filename << ".\n";
+        return nullptr;
+    }
+    density_grid_header header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == density_grid_magic && header.version == density_grid_version
+              && header.nx >= 2 && header.ny >= 2 && header.nz >= 2;
+    shared_ptr<density_grid> grid;
+    if (ok) {
+        grid = make_shared<density_grid>(header.nx, header.ny, header.nz,
+                                         aabb(point3(header.min[0], header.min[1], header.min[2]), point3(header.max[0], header.max[1], header.max[2])));
+        ok = fread(grid->values.data(), sizeof(float), grid->values.size(), f) == grid->values.size();
+    }
+    fclose(f);
+    if (!ok) {
+        std::cerr << "ERROR: bad density grid " << filename << ".\n";
+        return nullptr;
+    }
+    return grid;
+}
+
+bool write_density_grid(const std::string& filename, const density_grid& grid) {
+    density_grid_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = density_grid_magic;
+    header.version = density_grid_version;
+    header.nx = grid.nx;
+    header.ny = grid.ny;
+    header.nz = grid.nz;
+    for (int a = 0; a < 3; a++) {
+        header.min[a] = grid.box.min()[a];
+        header.max[a] = grid.box.max()[a];
+    }
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        std::cerr << "ERROR: cannot write " << filename << ".\n";
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(grid.values.data(), sizeof(float), grid.values.size(), f) == grid.values.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) std::cerr << "ERROR: cannot write " << filename << ".\n";
+    return ok;
+}
+
+// A medium whose density varies through space. Free flights are sampled by delta
+// tracking against a coarse grid of majorants: inside each majorant cell tentative
+// collisions are drawn at the cell's bound and accepted with probability
+// density / bound, and cells whose bound is zero are stepped over in one go. This is
+// unbiased for any majorant that really bounds the density.
+class heterogeneous_medium : public hittable {
+public:
+    heterogeneous_medium(shared_ptr<density_field> f, double scale, shared_ptr<texture> a, int majorant_cells=0);
+    heterogeneous_medium(shared_ptr<density_field> f, double scale, color c, int majorant_cells=0)
+        : heterogeneous_medium(f, scale, make_shared<solid_color>(c), majorant_cells) {}
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return true;
+    }
+public:
+    shared_ptr<density_field> field;
+    double density_scale;
+    shared_ptr<material> phase_function;
+    aabb box;
+    int cells[3];
+    vec3 cell_size;
+    std::vector<double> majorants;  // Scaled density bound per cell, x fastest
+};
+
+// The longest side of the field's box gets majorant_cells cells (0 lets the field
+// choose), the others as many as keep them roughly cubic.
+heterogeneous_medium::heterogeneous_medium(shared_ptr<density_field> f, double scale, shared_ptr<texture> a, int majorant_cells)
+    : field(f), density_scale(scale), phase_function(make_shared<isotropic>(a)), box(f->bounds()) {
+    if (majorant_cells <= 0) majorant_cells = field->majorant_cells();
+    auto size = box.max() - box.min();
+    auto longest = std::max(size.x(), std::max(size.y(), size.z()));
+    for (int axis = 0; axis < 3; axis++) {
+        cells[axis] = std::max(1, static_cast<int>(ceil(majorant_cells * size[axis] / longest - 1e-9)));
+    }
+    cell_size = vec3(size.x() / cells[0], size.y() / cells[1], size.z() / cells[2]);
+    majorants.resize(static_cast<size_t>(cells[0]) * cells[1] * cells[2]);
+    for (int k = 0; k < cells[2]; k++) {
+        for (int j = 0; j < cells[1]; j++) {
+            for (int i = 0; i < cells[0]; i++) {
+                auto lo = box.min() + vec3(i * cell_size.x(), j * cell_size.y(), k * cell_size.z());
+                majorants[(static_cast<size_t>(k) * cells[1] + j) * cells[0] + i] = scale * field->max_density(aabb(lo, lo + cell_size));
+            }
+        }
+    }
+}
+
+bool heterogeneous_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_MEDIUM]);
+    // Clip the ray to the field's box.
+    double t0 = std::max(t_min, 0.0), t1 = t_max;
+    for (int a = 0; a < 3; a++) {
+        auto inv = 1.0 / r.direction()[a];
+        auto ta = (box.min()[a] - r.origin()[a]) * inv;
+        auto tb = (box.max()[a] - r.origin()[a]) * inv;
+        if (inv < 0) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    if (t0 >= t1) return false;
+
+    // Walk the majorant cells along the ray (Amanatides-Woo).
+    auto p = r.at(t0);
+    int cell[3], step[3];
+    double t_next[3], t_delta[3];
+    for (int a = 0; a < 3; a++) {
+        cell[a] = std::min(std::max(static_cast<int>(floor((p[a] - box.min()[a]) / cell_size[a])), 0), cells[a] - 1);
+        auto d = r.direction()[a];
+        if (d == 0) {
+            step[a] = 0;
+            t_next[a] = infinity;
+            t_delta[a] = infinity;
+            continue;
+        }
+        step[a] = d > 0 ? 1 : -1;
+        auto boundary = box.min()[a] + (cell[a] + (d > 0 ? 1 : 0)) * cell_size[a];
+        t_next[a] = (boundary - r.origin()[a]) / d;
+        t_delta[a] = cell_size[a] / fabs(d);
+    }
+
+    const auto ray_length = r.direction().length();
+    auto t = t0;
+    for (;;) {
+        int axis = (t_next[0] < t_next[1]) ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        auto t_cell_end = std::min(t_next[axis], t1);
+        auto majorant = majorants[(static_cast<size_t>(cell[2]) * cells[1] + cell[1]) * cells[0] + cell[0]];
+        if (majorant > 0) {
+            // Exponential flights are memoryless, so restarting at each cell is exact.
+            for (;;) {
+                t -= log(1 - random_double()) / (majorant * ray_length);
+                if (t >= t_cell_end) break;
+                if (random_double() * majorant < density_scale * field->density(r.at(t))) {
+                    rec.t = t;
+                    rec.p = r.at(t);
+                    rec.normal = vec3(1, 0, 0);
+                    rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+                    rec.front_face = true;
+                    rec.mat_ptr = phase_function;
+                    return true;
+                }
+            }
+        }
+        t = t_cell_end;
+        if (t >= t1) return false;
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= cells[axis]) return false;
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+#endif
@@ -14,6 +14,8 @@ struct hit_record {
     double t;       // Hit time
     double u;
     double v;       // Texture coordinates
+    vec3 dpdu;      // Derivatives of p along u and v, zero where the surface has none
+    vec3 dpdv;
 
     bool front_face;
 
@@ -23,16 +25,76 @@ struct hit_record {
     }
 };
 
+// The intervals of a ray's whole line (t may be negative) that lie inside a closed
+// boundary, sorted and disjoint.
+struct ray_spans {
+    static const int capacity = 8;
+    int count;
+    double enter[capacity];
+    double exit[capacity];
+
+    ray_spans() : count(0) {}
+    // Adds [t0, t1], merging it with the intervals it overlaps. Once full, the nearest
+    // interval is widened instead, which can only over-cover.
+    void add(double t0, double t1);
+};
+
+void ray_spans::add(double t0, double t1) {
+    int first = 0;
+    while (first < count && exit[first] < t0) first++;
+    int last = first;
+    while (last < count && enter[last] <= t1) {
+        t0 = fmin(t0, enter[last]);
+        t1 = fmax(t1, exit[last]);
+        last++;
+    }
+    if (last == first) {
+        if (count == capacity) {
+            first = std::min(first, count - 1);
+            enter[first] = fmin(enter[first], t0);
+            exit[first] = fmax(exit[first], t1);
+            return;
+        }
+        for (int i = count; i > first; i--) {
+            enter[i] = enter[i - 1];
+            exit[i] = exit[i - 1];
+        }
+        count++;
+    }
+    else {
+        for (int i = last; i < count; i++) {
+            enter[i - (last - first - 1)] = enter[i];
+            exit[i - (last - first - 1)] = exit[i];
+        }
+        count -= last - first - 1;
+    }
+    enter[first] = t0;
+    exit[first] = t1;
+}
+
 class hittable {
 public:
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+    // Adds where the ray is inside this closed boundary to spans, in one traversal where
+    // the shape allows it; returns whether it added anything. The fallback pairs the
+    // first two hits, so it assumes a convex boundary.
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const {
+        hit_record rec1, rec2;
+        if (!hit(r, -infinity, infinity, rec1)) return false;
+        if (!hit(r, rec1.t + 0.0001, infinity, rec2)) return false;
+        spans.add(rec1.t, rec2.t);
+        return true;
+    }
 };
 
 class translate : public hittable {
 public:
     translate(shared_ptr<hittable> p, const vec3& displacement) : ptr(p), offset(displacement) {}
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override {
+        return ptr->hit_spans(ray(r.origin() - offset, r.direction(), r.time()), spans);
+    }
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 public:
     shared_ptr<hittable> ptr;
@@ -62,7 +124,7 @@ public:
         hasbox = ptr->bounding_box(0, 1, bbox);
 
         point3 min(infinity, infinity, infinity);
-        point3 max(-infinity, infinity, -infinity);
+        point3 max(-infinity, -infinity, -infinity);
 
         for (int i = 0; i < 2; i++) {
             for (int j = 0; j < 2; j++) {
@@ -85,6 +147,9 @@ public:
     }
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override {
+        return ptr->hit_spans(to_local(r), spans);
+    }
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         output_box = bbox;
         return hasbox;
@@ -95,18 +160,21 @@ public:
     double cos_theta;
     bool hasbox;
     aabb bbox;
+private:
+    // hittable rotate, ray counter rotate
+    ray to_local(const ray& r) const {
+        auto origin = r.origin();
+        auto direction = r.direction();
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2]; //  cos(-theta) * r.origin()[0] + sin(-theta) * r.origin()[2]
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2]; // -sin(-theta) * r.origin()[0] + cos(-theta) * r.origin()[2]
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+        return ray(origin, direction, r.time());
+    }
 };
 
 bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    // hittable rotate, ray counter rotate
-    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2]; //  cos(-theta) * r.origin()[0] + sin(-theta) * r.origin()[2]
-    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2]; // -sin(-theta) * r.origin()[0] + cos(-theta) * r.origin()[2]
-    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-    ray rotated_r(origin, direction, r.time());
+    auto rotated_r = to_local(r);
     if (!ptr->hit(rotated_r, t_min, t_max, rec)) return false;
     auto p = rec.p;
     auto normal = rec.normal;
@@ -115,6 +183,12 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
     normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
     normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+    auto dpdu = rec.dpdu;
+    auto dpdv = rec.dpdv;
+    rec.dpdu[0] = cos_theta * dpdu[0] + sin_theta * dpdu[2];
+    rec.dpdu[2] = -sin_theta * dpdu[0] + cos_theta * dpdu[2];
+    rec.dpdv[0] = cos_theta * dpdv[0] + sin_theta * dpdv[2];
+    rec.dpdv[2] = -sin_theta * dpdv[0] + cos_theta * dpdv[2];
 
     rec.p = p;
     rec.set_face_normal(rotated_r, normal);
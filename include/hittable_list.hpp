@@ -15,6 +15,8 @@ public:
     void clear() { objects.clear(); }
     void add(shared_ptr<hittable> object) { objects.push_back(object); }
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    // The union of the objects' spans.
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 public:
     std::vector<shared_ptr<hittable>> objects;
@@ -34,6 +36,14 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
     return hit_anything;
 }
 
+bool hittable_list::hit_spans(const ray& r, ray_spans& spans) const {
+    bool added = false;
+    for (const auto& object : objects) {
+        if (object->hit_spans(r, spans)) added = true;
+    }
+    return added;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
     if (objects.empty()) return false;
     aabb tmp_box;
@@ -4,9 +4,78 @@
 #include "utils.hpp"
 #include "hittable.hpp"
 #include "texture.hpp"
+#include "texture_program.hpp"
 
 struct hit_record;
 
+// Where the differential rays of r cross the plane tangent to the surface at rec.
+inline bool differential_hits(const ray& r, const hit_record& rec, point3& px, point3& py) {
+    if (!r.has_differentials) return false;
+    auto d = dot(rec.normal, rec.p);
+    auto nx = dot(rec.normal, r.rx_direction);
+    auto ny = dot(rec.normal, r.ry_direction);
+    if (fabs(nx) < 1e-12 || fabs(ny) < 1e-12) return false;
+    px = r.rx_origin + ((d - dot(rec.normal, r.rx_origin)) / nx) * r.rx_direction;
+    py = r.ry_origin + ((d - dot(rec.normal, r.ry_origin)) / ny) * r.ry_direction;
+    return true;
+}
+
+// Footprint cone angle given to diffusely scattered rays, which lose their differentials.
+const double diffuse_spread = 0.1;
+
+// Texture footprint of the pixel that r belongs to, at its hit rec. Rays without
+// differentials get a round footprint from their spread and the distance travelled.
+texture_footprint hit_footprint(const ray& r, const hit_record& rec) {
+    texture_footprint fp;
+    point3 px, py;
+    if (differential_hits(r, rec, px, py)) {
+        fp.dpdx = px - rec.p;
+        fp.dpdy = py - rec.p;
+    }
+    else if (r.spread > 0 && !rec.dpdu.near_zero()) {
+        auto width = r.spread * rec.t * r.direction().length();
+        auto tangent = unit_vector(rec.dpdu);
+        fp.dpdx = width * tangent;
+        fp.dpdy = width * cross(rec.normal, tangent);
+    }
+    else {
+        return fp;
+    }
+
+    // Solve dp = dpdu * du + dpdv * dv in the two coordinates the surface projects onto best.
+    auto n = cross(rec.dpdu, rec.dpdv);
+    int a = 0, b = 1;
+    if (fabs(n.x()) > fabs(n.y()) && fabs(n.x()) > fabs(n.z())) a = 2;
+    else if (fabs(n.y()) > fabs(n.z())) b = 2;
+    auto det = rec.dpdu[a] * rec.dpdv[b] - rec.dpdv[a] * rec.dpdu[b];
+    if (fabs(det) < 1e-12) return fp;
+    fp.dudx = (rec.dpdv[b] * fp.dpdx[a] - rec.dpdv[a] * fp.dpdx[b]) / det;
+    fp.dvdx = (rec.dpdu[a] * fp.dpdx[b] - rec.dpdu[b] * fp.dpdx[a]) / det;
+    fp.dudy = (rec.dpdv[b] * fp.dpdy[a] - rec.dpdv[a] * fp.dpdy[b]) / det;
+    fp.dvdy = (rec.dpdu[a] * fp.dpdy[b] - rec.dpdu[b] * fp.dpdy[a]) / det;
+    return fp;
+}
+
+// Carries r_in's differentials over a mirror (refraction_ratio 0) or refractive bounce,
+// treating the surface as locally flat. Diffuse bounces drop them.
+void scatter_differentials(const ray& r_in, const hit_record& rec, double refraction_ratio, ray& scattered) {
+    point3 px, py;
+    if (!differential_hits(r_in, rec, px, py)) return;
+    auto dx = unit_vector(r_in.rx_direction);
+    auto dy = unit_vector(r_in.ry_direction);
+    scattered.rx_origin = px;
+    scattered.ry_origin = py;
+    if (refraction_ratio == 0) {
+        scattered.rx_direction = reflect(dx, rec.normal);
+        scattered.ry_direction = reflect(dy, rec.normal);
+    }
+    else {
+        scattered.rx_direction = refract(dx, rec.normal, refraction_ratio);
+        scattered.ry_direction = refract(dy, rec.normal, refraction_ratio);
+    }
+    scattered.has_differentials = true;
+}
+
 class material {
 public:
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
@@ -17,8 +86,8 @@ public:
 
 class lambertian : public material {
 public:
-    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
-    lambertian(shared_ptr<texture> a) : albedo(a) {}
+    lambertian(const color& a) : albedo(make_shared<solid_color>(a)), albedo_program(albedo.get()) {}
+    lambertian(shared_ptr<texture> a) : albedo(a), albedo_program(albedo.get()) {}
     
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
         auto scatter_direction = rec.normal + random_in_hemisphere(rec.normal);
@@ -26,11 +95,15 @@ public:
             scatter_direction = rec.normal;
         }
         scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        scattered.spread = diffuse_spread;
+        // Constant albedos need no footprint.
+        if (albedo_program.constant()) attenuation = albedo_program.constant_value();
+        else attenuation = albedo_program.sample(rec.u, rec.v, rec.p, hit_footprint(r_in, rec));
         return true;
     }
 public:
     shared_ptr<texture> albedo;
+    texture_program albedo_program;
 };
 
 class metal : public material {
@@ -40,6 +113,7 @@ public:
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+        scatter_differentials(r_in, rec, 0, scattered);
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -61,7 +135,8 @@ public:
         double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
+        bool reflected = cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double();
+        if (reflected) {
             direction = reflect(unit_direction, rec.normal);
         }
         else {
@@ -69,6 +144,7 @@ public:
         }
 
         scattered = ray(rec.p, direction, r_in.time());
+        scatter_differentials(r_in, rec, reflected ? 0 : refraction_ratio, scattered);
         return true;
     }
 public:
@@ -84,32 +160,34 @@ private:
 
 class diffuse_light : public material {
 public:
-    diffuse_light(shared_ptr<texture> a) : emit(a) {}
-    diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+    diffuse_light(shared_ptr<texture> a) : emit(a), emit_program(emit.get()) {}
+    diffuse_light(color c) : emit(make_shared<solid_color>(c)), emit_program(emit.get()) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
         return false;
     }
 
     virtual color emitted(double u, double v, const point3& p) const override {
-        return emit->value(u, v, p);
+        return emit_program.value(u, v, p);
     }
 public:
     shared_ptr<texture> emit;
+    texture_program emit_program;
 };
 
 class isotropic : public material {
 public:
-    isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-    isotropic(shared_ptr<texture> a) : albedo(a) {}
+    isotropic(color c) : albedo(make_shared<solid_color>(c)), albedo_program(albedo.get()) {}
+    isotropic(shared_ptr<texture> a) : albedo(a), albedo_program(albedo.get()) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
         scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        attenuation = albedo_program.value(rec.u, rec.v, rec.p);
         return true;
     }
 public:
     shared_ptr<texture> albedo;
+    texture_program albedo_program;
 };
 
 #endif
\ No newline at end of file
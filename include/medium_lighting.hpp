@@ -0,0 +1,285 @@
+#ifndef MEDIUM_LIGHTING_H_
+#define MEDIUM_LIGHTING_H_
+
+#include "utils.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "aarect.hpp"
+#include "constant_medium.hpp"
+#include "scene_image.hpp"
+#include "material.hpp"
+#include "render_stats.hpp"
+#include "ray_capture.hpp"
+#include <vector>
+
+// Light-aware distance sampling in homogeneous media. Along each ray through a
+// constant_medium, a second scattering point is drawn equiangularly towards a point on
+// an area light and connected to it by a shadow ray. The balance heuristic combines it
+// with the medium's own free-flight sampling: the connection is weighed against the
+// chance that free flight and phase sampling find the same light, and light that free
+// flight finds after scattering is weighed the other way. Lights are the rects of the
+// scene list carrying a diffuse_light, outside of any transform. Scene images are
+// searched the same way, so a scene renders alike from its file and from its image.
+
+struct rect_light {
+    int axis;           // Normal axis; the rect spans axes a and b
+    int a, b;
+    double a0, a1, b0, b1, k;
+    shared_ptr<material> mat;
+
+    double area() const { return (a1 - a0) * (b1 - b0); }
+    point3 sample() const {
+        point3 p;
+        p[axis] = k;
+        p[a] = a0 + random_double() * (a1 - a0);
+        p[b] = b0 + random_double() * (b1 - b0);
+        return p;
+    }
+    bool contains(const point3& p) const {
+        return fabs(p[axis] - k) < 1e-6 * (1 + fabs(k)) && p[a] >= a0 && p[a] <= a1 && p[b] >= b0 && p[b] <= b1;
+    }
+};
+
+struct lit_medium {
+    shared_ptr<hittable> boundary;
+    const material* phase_function;     // What hit records of its scattering events carry
+    const isotropic* phase;
+    double density;
+};
+
+// A scattering event in a lit medium, kept so that the next bounce can weigh the light it finds.
+struct medium_vertex {
+    const lit_medium* medium;
+    ray r;
+    double distance;    // From r's origin, in world units
+};
+
+class medium_lighting {
+public:
+    medium_lighting() {}
+    explicit medium_lighting(const hittable& world) { collect(world); }
+    void collect(const hittable& world);
+    bool empty() const { return lights.empty() || media.empty(); }
+
+    // Light that the lit media along r scatter towards its origin, from one weighted
+    // equiangular connection per medium crossed. t_first is where r's own closest hit
+    // stopped it (surface or scattering event), infinity if nothing did.
+    color in_scattering(const ray& r, const hittable& world, double t_first) const;
+    // Whether rec is a scattering event in a lit medium, filling vertex if so.
+    bool medium_event(const ray& r, const hit_record& rec, medium_vertex& vertex) const;
+    // The weight of light found at rec by the ray scattered at vertex.
+    double emission_weight(const medium_vertex& vertex, const hit_record& rec) const;
+public:
+    std::vector<rect_light> lights;
+    std::vector<lit_medium> media;
+private:
+    void collect_image(const mapped_scene& scene);
+    void add_medium(const shared_ptr<hittable>& boundary, const shared_ptr<material>& phase_function, double neg_inv_density);
+    void add_light(const rect_light& light);
+
+    static const int max_segments = ray_spans::capacity;
+    // Where r is inside the medium past the ray epsilon, as distances from r's origin.
+    static int segments(const lit_medium& m, const ray& r, double* start, double* end);
+    // Densities of reaching distance s of segment `segment` and then light point y, for
+    // free flight with phase sampling (pdf_free) and for the equiangular connection
+    // (pdf_light), both per unit distance and solid angle.
+    void pdfs(const lit_medium& m, const ray& r, const double* start, const double* end, int count, int segment, double s,
+              const rect_light& light, const point3& y, double& pdf_free, double& pdf_light) const;
+};
+
+void medium_lighting::collect(const hittable& world) {
+    auto h = &world;
+    if (auto list = dynamic_cast<const hittable_list*>(h)) {
+        for (const auto& object : list->objects) collect(*object);
+        return;
+    }
+    if (auto node = dynamic_cast<const bvh_node*>(h)) {
+        collect(*node->left);
+        if (node->right != node->left) collect(*node->right);
+        return;
+    }
+    if (auto scene = dynamic_cast<const mapped_scene*>(h)) {
+        collect_image(*scene);
+        return;
+    }
+    if (auto medium = dynamic_cast<const constant_medium*>(h)) {
+        add_medium(medium->boundary, medium->phase_function, medium->neg_inv_density);
+        return;
+    }
+    rect_light light;
+    if (auto rect = dynamic_cast<const xy_rect*>(h)) {
+        light.axis = 2, light.a = 0, light.b = 1;
+        light.a0 = rect->x0, light.a1 = rect->x1, light.b0 = rect->y0, light.b1 = rect->y1, light.k = rect->k;
+        light.mat = rect->mp;
+    }
+    else if (auto rect = dynamic_cast<const xz_rect*>(h)) {
+        light.axis = 1, light.a = 0, light.b = 2;
+        light.a0 = rect->x0, light.a1 = rect->x1, light.b0 = rect->z0, light.b1 = rect->z1, light.k = rect->k;
+        light.mat = rect->mp;
+    }
+    else if (auto rect = dynamic_cast<const yz_rect*>(h)) {
+        light.axis = 0, light.a = 1, light.b = 2;
+        light.a0 = rect->y0, light.a1 = rect->y1, light.b0 = rect->z0, light.b1 = rect->z1, light.k = rect->k;
+        light.mat = rect->mp;
+    }
+    else {
+        return;
+    }
+    add_light(light);
+}
+
+// The prims the BVH reaches play the part of the scene list; medium boundaries come after
+// them. Rects with a transform are skipped, as rects under translate or rotate_y are.
+void medium_lighting::collect_image(const mapped_scene& scene) {
+    const auto* prims = scene.primitives();
+    for (uint64_t i = 0; i < scene.bvh_prim_count(); i++) {
+        const auto& p = prims[i];
+        const auto& mat = scene.materials[p.material];
+        if (p.kind == PRIM_MEDIUM) {
+            add_medium(make_shared<mapped_medium_boundary>(&scene, &p), mat, p.d[0]);
+            continue;
+        }
+        if ((p.kind != PRIM_XY_RECT && p.kind != PRIM_XZ_RECT && p.kind != PRIM_YZ_RECT) || p.xform >= 0) continue;
+        // Same axis layouts as the rect classes; d: a0, a1, b0, b1, k.
+        rect_light light;
+        light.axis = p.kind == PRIM_XY_RECT ? 2 : p.kind == PRIM_XZ_RECT ? 1 : 0;
+        light.a = p.kind == PRIM_YZ_RECT ? 1 : 0;
+        light.b = p.kind == PRIM_XY_RECT ? 1 : 2;
+        light.a0 = p.d[0], light.a1 = p.d[1], light.b0 = p.d[2], light.b1 = p.d[3], light.k = p.d[4];
+        light.mat = mat;
+        add_light(light);
+    }
+}
+
+void medium_lighting::add_medium(const shared_ptr<hittable>& boundary, const shared_ptr<material>& phase_function, double neg_inv_density) {
+    auto phase = dynamic_cast<const isotropic*>(phase_function.get());
+    // Black media only absorb; free flight already handles them.
+    if (!phase || (phase->albedo_program.constant() && phase->albedo_program.constant_value().length_squared() == 0)) return;
+    lit_medium m;
+    m.boundary = boundary;
+    m.phase_function = phase_function.get();
+    m.phase = phase;
+    m.density = -1 / neg_inv_density;
+    media.push_back(m);
+}
+
+void medium_lighting::add_light(const rect_light& light) {
+    if (dynamic_cast<const diffuse_light*>(light.mat.get()) && light.area() > 0) lights.push_back(light);
+}
+
+int medium_lighting::segments(const lit_medium& m, const ray& r, double* start, double* end) {
+    ray_spans spans;
+    if (!m.boundary->hit_spans(r, spans)) return 0;
+    const auto ray_length = r.direction().length();
+    int count = 0;
+    for (int i = 0; i < spans.count; i++) {
+        auto t0 = fmax(spans.enter[i], 0.0001);
+        if (t0 >= spans.exit[i]) continue;
+        start[count] = t0 * ray_length;
+        end[count] = spans.exit[i] * ray_length;
+        count++;
+    }
+    return count;
+}
+
+// Equiangular sampling picks s with density proportional to 1 / (h^2 + (s - foot)^2),
+// h being the light point's distance from the ray and foot the distance to its foot.
+static double equiangular_pdf(double s, double s0, double s1, double foot, double h) {
+    auto theta0 = atan((s0 - foot) / h), theta1 = atan((s1 - foot) / h);
+    return h / ((theta1 - theta0) * (h * h + (s - foot) * (s - foot)));
+}
+
+void medium_lighting::pdfs(const lit_medium& m, const ray& r, const double* start, const double* end, int count, int segment, double s,
+                           const rect_light& light, const point3& y, double& pdf_free, double& pdf_light) const {
+    // Free flight spends its exponential distance across the segments in order.
+    double inside = 0;
+    for (int i = 0; i < segment; i++) inside += end[i] - start[i];
+    inside += s - start[segment];
+    pdf_free = m.density * exp(-m.density * inside) / (4 * pi);
+
+    auto w = unit_vector(r.direction());
+    auto to_y = y - r.origin();
+    auto foot = dot(to_y, w);
+    auto h = (to_y - foot * w).length();
+    auto x = r.origin() + s * w;
+    auto dist2 = (y - x).length_squared();
+    auto cos_light = fabs((y - x)[light.axis]) / sqrt(dist2);
+    if (h < 1e-9 || cos_light < 1e-9) {
+        pdf_light = 0;
+        return;
+    }
+    pdf_light = equiangular_pdf(s, start[segment], end[segment], foot, h) / count / (lights.size() * light.area()) * dist2 / cos_light;
+}
+
+color medium_lighting::in_scattering(const ray& r, const hittable& world, double t_first) const {
+    color result(0, 0, 0);
+    const auto ray_length = r.direction().length();
+    for (const auto& m : media) {
+        double start[max_segments], end[max_segments];
+        int count = segments(m, r, start, end);
+        if (count == 0) continue;
+        int segment = std::min(static_cast<int>(random_double() * count), count - 1);
+        const auto& light = lights[std::min(static_cast<size_t>(random_double() * lights.size()), lights.size() - 1)];
+        auto y = light.sample();
+
+        auto w = r.direction() / ray_length;
+        auto to_y = y - r.origin();
+        auto foot = dot(to_y, w);
+        auto h = (to_y - foot * w).length();
+        if (h < 1e-9) continue;
+        auto theta0 = atan((start[segment] - foot) / h), theta1 = atan((end[segment] - foot) / h);
+        auto s = foot + h * tan(theta0 + random_double() * (theta1 - theta0));
+        s = fmin(fmax(s, start[segment]), end[segment]);
+
+        // Reaching s and then the light each count only if nothing stops the ray first,
+        // media stopping it with their own transmittance. r's closest hit is one such
+        // trial along r already, so only the shadow ray is traced.
+        auto t = s / ray_length;
+        if (t_first <= t) continue;
+        auto x = r.at(t);
+        hit_record blocker;
+        ray shadow(x, y - x, r.time());
+        RT_STAT_INC(rays[STAT_RAY_SHADOW]);
+        if (auto capture = ray_capture::active()) capture->record_shadow(shadow, 0.0001, 1 + 1e-4);
+        if (!world.hit(shadow, 0.0001, 1 + 1e-4, blocker) || blocker.t < 1 - 1e-4 || blocker.mat_ptr != light.mat) continue;
+
+        double pdf_free, pdf_light;
+        pdfs(m, r, start, end, count, segment, s, light, y, pdf_free, pdf_light);
+        if (pdf_light <= 0) continue;
+        auto emitted = blocker.mat_ptr->emitted(blocker.u, blocker.v, blocker.p);
+        auto albedo = m.phase->albedo_program.value(0, 0, x);
+        // density * phase * Le over pdf_light, weighted by pdf_light / (pdf_free + pdf_light)
+        result += albedo * emitted * (m.density / (4 * pi) / (pdf_free + pdf_light));
+    }
+    return result;
+}
+
+bool medium_lighting::medium_event(const ray& r, const hit_record& rec, medium_vertex& vertex) const {
+    for (const auto& m : media) {
+        if (rec.mat_ptr.get() != m.phase_function) continue;
+        vertex.medium = &m;
+        vertex.r = r;
+        vertex.distance = rec.t * r.direction().length();
+        return true;
+    }
+    return false;
+}
+
+double medium_lighting::emission_weight(const medium_vertex& vertex, const hit_record& rec) const {
+    const rect_light* light = nullptr;
+    for (const auto& l : lights) {
+        if (rec.mat_ptr == l.mat && l.contains(rec.p)) light = &l;
+    }
+    if (!light) return 1;
+    double start[max_segments], end[max_segments];
+    int count = segments(*vertex.medium, vertex.r, start, end);
+    int segment = 0;
+    while (segment < count && vertex.distance > end[segment]) segment++;
+    if (segment == count) return 1;
+    double pdf_free, pdf_light;
+    pdfs(*vertex.medium, vertex.r, start, end, count, segment, fmax(vertex.distance, start[segment]), *light, rec.p, pdf_free, pdf_light);
+    return pdf_free / (pdf_free + pdf_light);
+}
+
+#endif
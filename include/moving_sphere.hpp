@@ -3,6 +3,8 @@
 
 #include "utils.hpp"
 #include "hittable.hpp"
+#include "sphere.hpp"
+#include "render_stats.hpp"
 
 class moving_sphere : public hittable {
 public:
@@ -11,6 +13,12 @@ public:
     center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m) {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override {
+        double t_enter, t_exit;
+        if (!sphere_span(center(r.time()), radius, r, t_enter, t_exit)) return false;
+        spans.add(t_enter, t_exit);
+        return true;
+    }
     virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override;
     point3 center(double time) const;
 public:
@@ -25,6 +33,7 @@ point3 moving_sphere::center(double time) const {
 }
 
 bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_MOVING_SPHERE]);
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -44,6 +53,7 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
+    rec.dpdu = rec.dpdv = vec3(0, 0, 0);
     rec.mat_ptr = mat_ptr;
 
     return true;
@@ -0,0 +1,264 @@
+#ifndef OBJ_LOADER_H_
+#define OBJ_LOADER_H_
+
+#include "utils.hpp"
+#include "triangle_mesh.hpp"
+#include "trace.hpp"
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Wavefront OBJ reader for v/vt/vn/f records. Polygons are fan-triangulated; groups,
+// smoothing and usemtl are ignored since a triangle_mesh carries a single material.
+// The file is split at line boundaries and the pieces are parsed in parallel.
+
+// One face corner. Indices are 0-based; relative (negative) OBJ indices are resolved
+// against the chunk's own vertex counts and flagged so they can be rebased on merge.
+struct obj_corner {
+    int p, t, n;
+    unsigned char rel;      // Bit 0: p, bit 1: t, bit 2: n
+};
+
+struct obj_chunk {
+    std::vector<point3> positions;
+    std::vector<vec3> normals;
+    std::vector<mesh_uv> uvs;
+    std::vector<obj_corner> corners;    // Three per triangle
+    int bad_lines = 0;
+};
+
+inline const char* obj_skip_space(const char* s, const char* end) {
+    while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) s++;
+    return s;
+}
+
+inline bool obj_parse_int(const char*& s, const char* end, int& out) {
+    bool neg = false;
+    if (s < end && (*s == '-' || *s == '+')) neg = (*s++ == '-');
+    if (s >= end || *s < '0' || *s > '9') return false;
+    int value = 0;
+    while (s < end && *s >= '0' && *s <= '9') value = value * 10 + (*s++ - '0');
+    out = neg ? -value : value;
+    return true;
+}
+
+// Plain decimal/scientific parser; much faster than strtod and locale independent.
+inline bool obj_parse_double(const char*& s, const char* end, double& out) {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    s = obj_skip_space(s, end);
+    bool neg = false;
+    if (s < end && (*s == '-' || *s == '+')) neg = (*s++ == '-');
+    double mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    while (s < end && *s >= '0' && *s <= '9') {
+        mantissa = mantissa * 10 + (*s++ - '0');
+        digits++;
+    }
+    if (s < end && *s == '.') {
+        s++;
+        while (s < end && *s >= '0' && *s <= '9') {
+            mantissa = mantissa * 10 + (*s++ - '0');
+            exponent--;
+            digits++;
+        }
+    }
+    if (digits == 0) return false;
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        s++;
+        int e;
+        if (!obj_parse_int(s, end, e)) return false;
+        exponent += e;
+    }
+    if (exponent < 0) {
+        mantissa = (-exponent <= 22) ? mantissa / pow10[-exponent] : mantissa * pow(10.0, exponent);
+    }
+    else if (exponent > 0) {
+        mantissa = (exponent <= 22) ? mantissa * pow10[exponent] : mantissa * pow(10.0, exponent);
+    }
+    out = neg ? -mantissa : mantissa;
+    return true;
+}
+
+// Converts a 1-based (or negative, relative) OBJ index against `count` entries seen so far.
+inline bool obj_resolve_index(int idx, int count, int& out, unsigned char& rel, unsigned char bit) {
+    if (idx > 0) {
+        out = idx - 1;
+        return true;
+    }
+    if (idx < 0) {
+        out = count + idx;
+        rel |= bit;
+        return true;
+    }
+    return false;
+}
+
+// Parses `v`, `v/t`, `v//n` or `v/t/n`.
+inline bool obj_parse_corner(const char*& s, const char* end, const obj_chunk& chunk, obj_corner& c) {
+    int idx;
+    c.t = c.n = -1;
+    c.rel = 0;
+    if (!obj_parse_int(s, end, idx) || !obj_resolve_index(idx, static_cast<int>(chunk.positions.size()), c.p, c.rel, 1)) return false;
+    if (s < end && *s == '/') {
+        s++;
+        if (s < end && *s != '/') {
+            if (!obj_parse_int(s, end, idx) || !obj_resolve_index(idx, static_cast<int>(chunk.uvs.size()), c.t, c.rel, 2)) return false;
+        }
+        if (s < end && *s == '/') {
+            s++;
+            if (!obj_parse_int(s, end, idx) || !obj_resolve_index(idx, static_cast<int>(chunk.normals.size()), c.n, c.rel, 4)) return false;
+        }
+    }
+    return true;
+}
+
+void obj_parse_chunk(const char* begin, const char* end, obj_chunk& chunk) {
+    trace_span span("parse obj chunk");
+    std::vector<obj_corner> polygon;
+    const char* s = begin;
+    while (s < end) {
+        const char* line_end = s;
+        while (line_end < end && *line_end != '\n') line_end++;
+        s = obj_skip_space(s, line_end);
+        bool ok = true;
+        if (s + 1 < line_end && s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            s += 1;
+            double x, y, z;
+            ok = obj_parse_double(s, line_end, x) && obj_parse_double(s, line_end, y) && obj_parse_double(s, line_end, z);
+            if (ok) chunk.positions.push_back(point3(x, y, z));
+        }
+        else if (s + 2 < line_end && s[0] == 'v' && s[1] == 'n') {
+            s += 2;
+            double x, y, z;
+            ok = obj_parse_double(s, line_end, x) && obj_parse_double(s, line_end, y) && obj_parse_double(s, line_end, z);
+            if (ok) chunk.normals.push_back(vec3(x, y, z));
+        }
+        else if (s + 2 < line_end && s[0] == 'v' && s[1] == 't') {
+            s += 2;
+            mesh_uv uv;
+            ok = obj_parse_double(s, line_end, uv.u);
+            if (ok && !obj_parse_double(s, line_end, uv.v)) uv.v = 0;
+            if (ok) chunk.uvs.push_back(uv);
+        }
+        else if (s + 1 < line_end && s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            s += 1;
+            polygon.clear();
+            while (ok) {
+                s = obj_skip_space(s, line_end);
+                if (s >= line_end) break;
+                obj_corner c;
+                ok = obj_parse_corner(s, line_end, chunk, c);
+                if (ok) polygon.push_back(c);
+            }
+            ok = ok && polygon.size() >= 3;
+            if (ok) {
+                for (size_t i = 1; i + 1 < polygon.size(); i++) {
+                    chunk.corners.push_back(polygon[0]);
+                    chunk.corners.push_back(polygon[i]);
+                    chunk.corners.push_back(polygon[i + 1]);
+                }
+            }
+        }
+        if (!ok) chunk.bad_lines++;
+        s = line_end + 1;
+    }
+}
+
+// Loads `filename` into `mesh`. threads <= 0 uses all hardware threads.
+bool load_obj(const std::string& filename, mesh_data& mesh, int threads = 0) {
+    trace_span span("load obj", filename);
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        std::cerr << "ERROR: OBJ file not found: " << filename << ".\n";
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    auto size = static_cast<size_t>(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    std::vector<char> text(size);
+    if (size > 0 && fread(text.data(), 1, size, f) != size) {
+        fclose(f);
+        std::cerr << "ERROR: failed to read OBJ file: " << filename << ".\n";
+        return false;
+    }
+    fclose(f);
+
+    const size_t min_chunk_size = 1 << 18;
+    if (threads <= 0) threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads <= 0) threads = 1;
+    auto chunk_count = static_cast<int>(std::min<size_t>(threads, size / min_chunk_size + 1));
+
+    // Chunk boundaries fall just after a newline so no record is split.
+    const char* data = text.data();
+    std::vector<const char*> bounds(chunk_count + 1);
+    bounds[0] = data;
+    bounds[chunk_count] = data + size;
+    for (int i = 1; i < chunk_count; i++) {
+        const char* p = std::max(bounds[i - 1], data + size * i / chunk_count);
+        while (p > data && p < data + size && p[-1] != '\n') p++;
+        bounds[i] = p;
+    }
+
+    std::vector<obj_chunk> chunks(chunk_count);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < chunk_count; i++) {
+        workers.push_back(std::thread(obj_parse_chunk, bounds[i], bounds[i + 1], std::ref(chunks[i])));
+    }
+    obj_parse_chunk(bounds[0], bounds[1], chunks[0]);
+    for (auto& w : workers) w.join();
+
+    size_t np = 0, nn = 0, nt = 0, nc = 0;
+    int bad_lines = 0;
+    for (const auto& c : chunks) {
+        np += c.positions.size();
+        nn += c.normals.size();
+        nt += c.uvs.size();
+        nc += c.corners.size();
+        bad_lines += c.bad_lines;
+    }
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.uvs.clear();
+    mesh.triangles.clear();
+    mesh.positions.reserve(np);
+    mesh.normals.reserve(nn);
+    mesh.uvs.reserve(nt);
+    mesh.triangles.reserve(nc / 3);
+
+    int bad_faces = 0;
+    for (const auto& c : chunks) {
+        auto base_p = static_cast<int>(mesh.positions.size());
+        auto base_t = static_cast<int>(mesh.uvs.size());
+        auto base_n = static_cast<int>(mesh.normals.size());
+        mesh.positions.insert(mesh.positions.end(), c.positions.begin(), c.positions.end());
+        mesh.uvs.insert(mesh.uvs.end(), c.uvs.begin(), c.uvs.end());
+        mesh.normals.insert(mesh.normals.end(), c.normals.begin(), c.normals.end());
+        for (size_t i = 0; i < c.corners.size(); i += 3) {
+            mesh_triangle tri;
+            bool ok = true;
+            for (int k = 0; k < 3; k++) {
+                const auto& corner = c.corners[i + k];
+                tri.p[k] = corner.p + ((corner.rel & 1) ? base_p : 0);
+                tri.t[k] = corner.t < 0 && !(corner.rel & 2) ? -1 : corner.t + ((corner.rel & 2) ? base_t : 0);
+                tri.n[k] = corner.n < 0 && !(corner.rel & 4) ? -1 : corner.n + ((corner.rel & 4) ? base_n : 0);
+                // Absolute indices may point at vertices defined later in the file, so range checks wait until np/nt/nn are known.
+                ok = ok && tri.p[k] >= 0 && tri.p[k] < static_cast<int>(np)
+                        && tri.t[k] >= -1 && tri.t[k] < static_cast<int>(nt)
+                        && tri.n[k] >= -1 && tri.n[k] < static_cast<int>(nn);
+            }
+            if (ok) mesh.triangles.push_back(tri);
+            else bad_faces++;
+        }
+    }
+
+    if (bad_lines > 0 || bad_faces > 0) {
+        std::cerr << "WARNING: " << filename << ": skipped " << bad_lines << " malformed lines and " << bad_faces << " faces with bad indices.\n";
+    }
+    return true;
+}
+
+#endif
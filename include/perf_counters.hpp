@@ -0,0 +1,241 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#ifdef RT_ENABLE_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters (cycles, instructions, cache and branch misses) for a few hot regions,
+// compiled in with RT_ENABLE_PERF_COUNTERS (Linux only; implies RT_ENABLE_STATS). Each
+// thread opens its own perf_event_open group the first time it enters a region and reads
+// it on the way in and out. Only the outermost entry of a region counts, so recursive
+// traversal is measured once per query; regions nest inclusively. A read is a system
+// call, so the cost of one is measured per thread and taken off for every read made
+// inside a region, its own and those of regions nested in it. Without the option
+// RT_PERF_REGION expands to nothing.
+//
+// Taking off the cost of the reads does not undo the cache and branch predictor state
+// the system calls disturb, which swamps a region as short as one primitive test. Such
+// regions use RT_PERF_PRIMITIVE_REGION and are only counted when RT_ENABLE_PERF_PRIMITIVES
+// is defined as well; otherwise their cost shows up in the BVH region around them.
+
+enum perf_region_id {
+    PERF_REGION_RENDER = 0,     // Whole camera paths
+    PERF_REGION_BVH,            // bvh_node::hit and flat BVH traversal
+    PERF_REGION_SPHERE,         // sphere::hit, with RT_ENABLE_PERF_PRIMITIVES only
+    PERF_REGION_SCATTER,        // material::scatter
+    PERF_REGION_TURBULENCE,     // perlin::turb_batch
+    PERF_REGION_NUM
+};
+
+enum perf_counter_id {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_NUM
+};
+
+struct perf_region_totals {
+    uint64_t calls;
+    uint64_t counts[PERF_COUNTER_NUM];
+};
+
+#ifdef RT_ENABLE_PERF_COUNTERS
+class perf_counters {
+public:
+    // The calling thread's counters, opened on first use.
+    static perf_counters& local() {
+        static thread_local perf_counters* counters = nullptr;
+        if (!counters) counters = register_thread();
+        return *counters;
+    }
+    // Region totals summed over all threads; false if no thread could open its counters.
+    static bool merged(perf_region_totals* totals, std::string& error);
+
+    void enter(perf_region_id region);
+    void leave(perf_region_id region);
+private:
+    perf_counters();
+    static perf_counters* register_thread();
+    static std::mutex& registry_lock() {
+        static std::mutex lock;
+        return lock;
+    }
+    static std::vector<perf_counters*>& registry() {
+        static std::vector<perf_counters*> threads;
+        return threads;
+    }
+    bool read_counts(uint64_t* counts);
+    void calibrate();
+
+    int group;                          // Leader fd, -1 if unavailable
+    int slot[PERF_COUNTER_NUM];         // Position in a group read, -1 if the event is missing
+    int slots;
+    std::string error;
+    int depth[PERF_REGION_NUM];
+    uint64_t start[PERF_REGION_NUM][PERF_COUNTER_NUM];
+    uint64_t start_reads[PERF_REGION_NUM];
+    uint64_t reads;
+    uint64_t overhead[PERF_COUNTER_NUM];    // Per read
+    perf_region_totals totals[PERF_REGION_NUM];
+};
+
+perf_counters::perf_counters() : group(-1), slots(0), reads(0) {
+    memset(depth, 0, sizeof(depth));
+    memset(overhead, 0, sizeof(overhead));
+    memset(totals, 0, sizeof(totals));
+    static const uint64_t configs[PERF_COUNTER_NUM] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) {
+        slot[c] = -1;
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        auto fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+        if (fd < 0) {
+            // Cycles lead the group; without them there is nothing to attach the rest to.
+            if (c == PERF_CYCLES) {
+                error = std::string("perf_event_open: ") + strerror(errno);
+                return;
+            }
+            continue;
+        }
+        if (group < 0) group = fd;
+        slot[c] = slots++;
+    }
+    calibrate();
+}
+
+bool perf_counters::read_counts(uint64_t* counts) {
+    reads++;
+    uint64_t buffer[1 + PERF_COUNTER_NUM];
+    if (read(group, buffer, sizeof(buffer)) < static_cast<ssize_t>((1 + slots) * sizeof(uint64_t))) return false;
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) counts[c] = slot[c] >= 0 ? buffer[1 + slot[c]] : 0;
+    return true;
+}
+
+// What one read adds to the counts between the reads around it.
+void perf_counters::calibrate() {
+    const int rounds = 1000;
+    uint64_t before[PERF_COUNTER_NUM], after[PERF_COUNTER_NUM];
+    uint64_t sum[PERF_COUNTER_NUM] = {0};
+    for (int i = 0; i < rounds; i++) {
+        if (!read_counts(before) || !read_counts(after)) return;
+        for (int c = 0; c < PERF_COUNTER_NUM; c++) sum[c] += after[c] - before[c];
+    }
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) overhead[c] = sum[c] / rounds;
+}
+
+perf_counters* perf_counters::register_thread() {
+    auto counters = new perf_counters();
+    std::lock_guard<std::mutex> guard(registry_lock());
+    registry().push_back(counters);
+    return counters;
+}
+
+inline void perf_counters::enter(perf_region_id region) {
+    if (depth[region]++ > 0 || group < 0) return;
+    if (!read_counts(start[region])) memset(start[region], 0, sizeof(start[region]));
+    start_reads[region] = reads;
+}
+
+inline void perf_counters::leave(perf_region_id region) {
+    if (--depth[region] > 0) return;
+    auto& t = totals[region];
+    t.calls++;
+    if (group < 0) return;
+    auto nested_reads = reads - start_reads[region];
+    uint64_t now[PERF_COUNTER_NUM];
+    if (!read_counts(now)) return;
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) {
+        auto delta = now[c] - start[region][c];
+        auto cost = (1 + nested_reads) * overhead[c];
+        t.counts[c] += delta > cost ? delta - cost : 0;
+    }
+}
+
+bool perf_counters::merged(perf_region_totals* out, std::string& error) {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    memset(out, 0, sizeof(perf_region_totals) * PERF_REGION_NUM);
+    bool available = false;
+    error = "no region was entered";
+    for (auto counters : registry()) {
+        if (counters->group >= 0) available = true;
+        else error = counters->error;
+        for (int r = 0; r < PERF_REGION_NUM; r++) {
+            out[r].calls += counters->totals[r].calls;
+            for (int c = 0; c < PERF_COUNTER_NUM; c++) out[r].counts[c] += counters->totals[r].counts[c];
+        }
+    }
+    return available;
+}
+
+// Counts the rest of the enclosing scope as `region`.
+class perf_region {
+public:
+    explicit perf_region(perf_region_id _region) : region(_region) { perf_counters::local().enter(region); }
+    ~perf_region() { perf_counters::local().leave(region); }
+private:
+    perf_region_id region;
+};
+
+#define RT_PERF_REGION(region) perf_region perf_region_scope_(region)
+#else
+#define RT_PERF_REGION(region) ((void)0)
+#endif
+
+#if defined(RT_ENABLE_PERF_COUNTERS) && defined(RT_ENABLE_PERF_PRIMITIVES)
+#define RT_PERF_PRIMITIVE_REGION(region) RT_PERF_REGION(region)
+#else
+#define RT_PERF_PRIMITIVE_REGION(region) ((void)0)
+#endif
+
+// Writes the "perf_counters" member of the stats JSON: per-region totals, plus misses and
+// instructions per ray (all paths) and instructions per primitive test (BVH region).
+void write_perf_counters_json(std::ostream& out, uint64_t rays, uint64_t prim_tests) {
+#ifdef RT_ENABLE_PERF_COUNTERS
+    static const char* region_names[PERF_REGION_NUM] = {"render", "bvh_traversal", "sphere_hit", "scatter", "turbulence"};
+    static const char* counter_names[PERF_COUNTER_NUM] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+    perf_region_totals totals[PERF_REGION_NUM];
+    std::string error;
+    if (!perf_counters::merged(totals, error)) {
+        out << "  \"perf_counters\": {\"available\": false, \"error\": \"" << error << "\"},\n";
+        return;
+    }
+    auto per = [](uint64_t a, uint64_t b) { return b > 0 ? static_cast<double>(a) / b : 0.0; };
+    const auto& render = totals[PERF_REGION_RENDER];
+    out << "  \"perf_counters\": {\"available\": true,\n";
+    out << "    \"cache_misses_per_ray\": " << per(render.counts[PERF_CACHE_MISSES], rays)
+        << ", \"branch_misses_per_ray\": " << per(render.counts[PERF_BRANCH_MISSES], rays)
+        << ", \"instructions_per_ray\": " << per(render.counts[PERF_INSTRUCTIONS], rays)
+        << ", \"instructions_per_intersection\": " << per(totals[PERF_REGION_BVH].counts[PERF_INSTRUCTIONS], prim_tests) << ",\n";
+    out << "    \"regions\": {\n";
+    for (int r = 0; r < PERF_REGION_NUM; r++) {
+        const auto& t = totals[r];
+        out << "      \"" << region_names[r] << "\": {\"calls\": " << t.calls;
+        for (int c = 0; c < PERF_COUNTER_NUM; c++) out << ", \"" << counter_names[c] << "\": " << t.counts[c];
+        out << ", \"ipc\": " << per(t.counts[PERF_INSTRUCTIONS], t.counts[PERF_CYCLES])
+            << ", \"instructions_per_call\": " << per(t.counts[PERF_INSTRUCTIONS], t.calls) << "}" << (r + 1 < PERF_REGION_NUM ? ",\n" : "\n");
+    }
+    out << "    }},\n";
+#else
+    (void)out, (void)rays, (void)prim_tests;
+#endif
+}
+
+#endif
@@ -2,9 +2,15 @@
 #define PERLIN_H_
 
 #include "utils.hpp"
+#include "perf_counters.hpp"
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 class perlin {
 public:
-    perlin() {
+    perlin() : owns_tables(true) {
         ranvec = new vec3[point_count];
         for (int i = 0; i < point_count; i++) {
             ranvec[i] = unit_vector(vec3::random(-1, 1));
@@ -12,8 +18,15 @@ public:
         perm_x = perlin_generate_perm();
         perm_y = perlin_generate_perm();
         perm_z = perlin_generate_perm();
+        build_gradients();
+    }
+    // Uses tables owned by someone else, e.g. a mapped scene image.
+    perlin(const vec3* _ranvec, const int* _perm_x, const int* _perm_y, const int* _perm_z) : owns_tables(false),
+        ranvec(const_cast<vec3*>(_ranvec)), perm_x(const_cast<int*>(_perm_x)), perm_y(const_cast<int*>(_perm_y)), perm_z(const_cast<int*>(_perm_z)) {
+        build_gradients();
     }
     ~perlin() {
+        if (!owns_tables) return;
         delete[] ranvec;
         delete[] perm_x;
         delete[] perm_y;
@@ -38,25 +51,59 @@ public:
     }
 
     double turb(const point3& p, int depth=15) const {
-        auto accum = 0.0;
-        auto tmp_p = p;
-        auto weight = 1.0;
+        double result;
+        turb_batch(&p, &result, 1, depth);
+        return result;
+    }
 
-        for (int i = 0; i < depth; i++) {
-            accum += weight * noise(tmp_p);
-            weight *= 0.5;
-            tmp_p *= 2;
-        }
+    // turb() filtered over a lookup footprint width across: octaves finer than the
+    // footprint average out, so they are dropped, the last kept one fading out.
+    double turb(const point3& p, double width, int depth) const {
+        double result;
+        turb_batch(&p, &result, 1, depth, &width);
+        return result;
+    }
 
-        return fabs(accum);
+    // Octaves worth evaluating for a footprint width across; fractional where the last
+    // one fades. Octave o has cells 2^-o across and is kept while they are at least an
+    // eighth of the footprint: turb feeds a sin, so octaves just below the footprint
+    // still shift the pixel's average. Width 0 means unknown and keeps all of them.
+    static double turb_octaves(double width, int depth) {
+        if (width <= 0) return depth;
+        return clamp(4 - log2(width), 0.0, static_cast<double>(depth));
     }
-private:
+
+    // turb() at n points, filtered by widths if given. All octaves of all points go
+    // through lattice_noise together.
+    void turb_batch(const point3* p, double* out, int n, int depth=15, const double* widths=nullptr) const;
+
+    // Noise at lattice cells (i, j, k) and in-cell offsets (u, v, w), n at a time, with
+    // float gradients. The AVX2 path gives the same bits as the scalar one.
+    void lattice_noise(const int* i, const int* j, const int* k, const float* u, const float* v, const float* w, float* out, int n) const;
+public:
     static const int point_count = 256;
+    bool owns_tables;
     vec3* ranvec;
     int* perm_x;
     int* perm_y;
     int* perm_z;
-    
+    float grad_x[point_count];  // ranvec as float columns, for gathers
+    float grad_y[point_count];
+    float grad_z[point_count];
+private:
+    static const int lattice_chunk = 256;
+
+    void build_gradients() {
+        for (int i = 0; i < point_count; i++) {
+            grad_x[i] = static_cast<float>(ranvec[i].x());
+            grad_y[i] = static_cast<float>(ranvec[i].y());
+            grad_z[i] = static_cast<float>(ranvec[i].z());
+        }
+    }
+
+    perlin(const perlin&);
+    perlin& operator =(const perlin&);
+
     static int* perlin_generate_perm() {
         auto p = new int[point_count];
         for (int i = 0; i < point_count; i++) {
@@ -92,4 +139,131 @@ private:
     }
 };
 
+void perlin::lattice_noise(const int* i, const int* j, const int* k, const float* u, const float* v, const float* w, float* out, int n) const {
+    int first = 0;
+#ifdef __AVX2__
+    const __m256i mask = _mm256_set1_epi32(point_count - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256 one_f = _mm256_set1_ps(1.0f);
+    const __m256 two_f = _mm256_set1_ps(2.0f);
+    const __m256 three_f = _mm256_set1_ps(3.0f);
+    auto corner8 = [this](__m256i h, __m256 x, __m256 y, __m256 z) {
+        auto d = _mm256_mul_ps(_mm256_i32gather_ps(grad_x, h, 4), x);
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_i32gather_ps(grad_y, h, 4), y));
+        return _mm256_add_ps(d, _mm256_mul_ps(_mm256_i32gather_ps(grad_z, h, 4), z));
+    };
+    auto lerp8 = [](__m256 t, __m256 a, __m256 b) {
+        return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+    };
+    auto fade8 = [&](__m256 t) {
+        return _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(three_f, _mm256_mul_ps(two_f, t)));
+    };
+    for (; first + 8 <= n; first += 8) {
+        auto ii = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(i + first));
+        auto jj = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(j + first));
+        auto kk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(k + first));
+        auto x0 = _mm256_i32gather_epi32(perm_x, _mm256_and_si256(ii, mask), 4);
+        auto x1 = _mm256_i32gather_epi32(perm_x, _mm256_and_si256(_mm256_add_epi32(ii, one), mask), 4);
+        auto y0 = _mm256_i32gather_epi32(perm_y, _mm256_and_si256(jj, mask), 4);
+        auto y1 = _mm256_i32gather_epi32(perm_y, _mm256_and_si256(_mm256_add_epi32(jj, one), mask), 4);
+        auto z0 = _mm256_i32gather_epi32(perm_z, _mm256_and_si256(kk, mask), 4);
+        auto z1 = _mm256_i32gather_epi32(perm_z, _mm256_and_si256(_mm256_add_epi32(kk, one), mask), 4);
+        auto fu = _mm256_loadu_ps(u + first);
+        auto fv = _mm256_loadu_ps(v + first);
+        auto fw = _mm256_loadu_ps(w + first);
+        auto gu = _mm256_sub_ps(fu, one_f);
+        auto gv = _mm256_sub_ps(fv, one_f);
+        auto gw = _mm256_sub_ps(fw, one_f);
+        auto xy00 = _mm256_xor_si256(x0, y0), xy10 = _mm256_xor_si256(x1, y0);
+        auto xy01 = _mm256_xor_si256(x0, y1), xy11 = _mm256_xor_si256(x1, y1);
+        auto n000 = corner8(_mm256_xor_si256(xy00, z0), fu, fv, fw);
+        auto n100 = corner8(_mm256_xor_si256(xy10, z0), gu, fv, fw);
+        auto n010 = corner8(_mm256_xor_si256(xy01, z0), fu, gv, fw);
+        auto n110 = corner8(_mm256_xor_si256(xy11, z0), gu, gv, fw);
+        auto n001 = corner8(_mm256_xor_si256(xy00, z1), fu, fv, gw);
+        auto n101 = corner8(_mm256_xor_si256(xy10, z1), gu, fv, gw);
+        auto n011 = corner8(_mm256_xor_si256(xy01, z1), fu, gv, gw);
+        auto n111 = corner8(_mm256_xor_si256(xy11, z1), gu, gv, gw);
+        auto uu = fade8(fu), vv = fade8(fv), ww = fade8(fw);
+        auto nxy0 = lerp8(vv, lerp8(uu, n000, n100), lerp8(uu, n010, n110));
+        auto nxy1 = lerp8(vv, lerp8(uu, n001, n101), lerp8(uu, n011, n111));
+        _mm256_storeu_ps(out + first, lerp8(ww, nxy0, nxy1));
+    }
+#endif
+    auto corner = [this](int h, float x, float y, float z) {
+        auto d = grad_x[h] * x;
+        d = d + grad_y[h] * y;
+        return d + grad_z[h] * z;
+    };
+    auto lerp = [](float t, float a, float b) { return a + t * (b - a); };
+    auto fade = [](float t) { return (t * t) * (3.0f - 2.0f * t); };
+    for (int q = first; q < n; q++) {
+        const int m = point_count - 1;
+        auto x0 = perm_x[i[q] & m], x1 = perm_x[(i[q] + 1) & m];
+        auto y0 = perm_y[j[q] & m], y1 = perm_y[(j[q] + 1) & m];
+        auto z0 = perm_z[k[q] & m], z1 = perm_z[(k[q] + 1) & m];
+        auto fu = u[q], fv = v[q], fw = w[q];
+        auto gu = fu - 1.0f, gv = fv - 1.0f, gw = fw - 1.0f;
+        auto uu = fade(fu), vv = fade(fv), ww = fade(fw);
+        auto nxy0 = lerp(vv, lerp(uu, corner(x0 ^ y0 ^ z0, fu, fv, fw), corner(x1 ^ y0 ^ z0, gu, fv, fw)),
+                             lerp(uu, corner(x0 ^ y1 ^ z0, fu, gv, fw), corner(x1 ^ y1 ^ z0, gu, gv, fw)));
+        auto nxy1 = lerp(vv, lerp(uu, corner(x0 ^ y0 ^ z1, fu, fv, gw), corner(x1 ^ y0 ^ z1, gu, fv, gw)),
+                             lerp(uu, corner(x0 ^ y1 ^ z1, fu, gv, gw), corner(x1 ^ y1 ^ z1, gu, gv, gw)));
+        out[q] = lerp(ww, nxy0, nxy1);
+    }
+}
+
+void perlin::turb_batch(const point3* p, double* out, int n, int depth, const double* widths) const {
+    RT_PERF_REGION(PERF_REGION_TURBULENCE);
+    depth = std::min(depth, static_cast<int>(lattice_chunk));
+    if (depth <= 0) {
+        std::fill(out, out + n, 0.0);
+        return;
+    }
+    int ci[lattice_chunk], cj[lattice_chunk], ck[lattice_chunk];
+    float cu[lattice_chunk], cv[lattice_chunk], cw[lattice_chunk], noise_out[lattice_chunk];
+    int octaves[lattice_chunk];
+    double last_weight[lattice_chunk];
+    const int per_chunk = lattice_chunk / depth;
+    for (int first = 0; first < n; first += per_chunk) {
+        const int count = std::min(per_chunk, n - first);
+        int m = 0;
+        for (int q = 0; q < count; q++) {
+            octaves[q] = depth;
+            last_weight[q] = 1;
+            if (widths) {
+                auto f = turb_octaves(widths[first + q], depth);
+                octaves[q] = static_cast<int>(ceil(f));
+                if (octaves[q] > f) last_weight[q] = f - (octaves[q] - 1);
+            }
+            // Split cell and offset in double: octave coordinates outgrow float's mantissa.
+            auto x = p[first + q].x(), y = p[first + q].y(), z = p[first + q].z();
+            for (int o = 0; o < octaves[q]; o++, m++) {
+                auto fx = floor(x), fy = floor(y), fz = floor(z);
+                ci[m] = static_cast<int>(fx);
+                cj[m] = static_cast<int>(fy);
+                ck[m] = static_cast<int>(fz);
+                cu[m] = static_cast<float>(x - fx);
+                cv[m] = static_cast<float>(y - fy);
+                cw[m] = static_cast<float>(z - fz);
+                x *= 2;
+                y *= 2;
+                z *= 2;
+            }
+        }
+        lattice_noise(ci, cj, ck, cu, cv, cw, noise_out, m);
+        m = 0;
+        for (int q = 0; q < count; q++) {
+            auto accum = 0.0;
+            auto weight = 1.0;
+            for (int o = 0; o < octaves[q]; o++, m++) {
+                if (o == octaves[q] - 1) weight *= last_weight[q];
+                accum += weight * noise_out[m];
+                weight *= 0.5;
+            }
+            out[first + q] = fabs(accum);
+        }
+    }
+}
+
 #endif
\ No newline at end of file
@@ -5,8 +5,8 @@
 
 class ray {
 public:
-    ray() {}
-    ray(const point3& origin, const point3& direction, double time=0.0) : orig(origin), dir(direction), tm(time) {}
+    ray() : has_differentials(false), spread(0) {}
+    ray(const point3& origin, const point3& direction, double time=0.0) : orig(origin), dir(direction), tm(time), has_differentials(false), spread(0) {}
     point3 origin() const { return orig; }
     vec3 direction() const { return dir; } 
     double time() const { return tm; }
@@ -18,6 +18,13 @@ public:
     point3 orig;
     vec3 dir;
     double tm;  // This is ray launch time stamp, just to determine the moving status of objects, nothing to do with tmin/tmax
+
+    // Rays through the neighbouring pixels in x and y, used to size texture lookups.
+    bool has_differentials;
+    point3 rx_origin, ry_origin;
+    vec3 rx_direction, ry_direction;
+    // Otherwise, how fast the footprint widens per unit of travel (a cone's angle); 0 if unknown.
+    double spread;
 };
 
 #endif // RAY_H_
\ No newline at end of file
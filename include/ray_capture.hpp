@@ -0,0 +1,173 @@
+#ifndef RAY_CAPTURE_H_
+#define RAY_CAPTURE_H_
+
+#include "utils.hpp"
+#include "hittable.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Ray capture: every ray a render sends to world.hit, written to a compact binary log
+// (.rtrays) so that the same workload can be replayed through other acceleration
+// structures. The log names its scene, so a replay can rebuild it. Rays are stored in
+// single precision; a replay traces exactly the stored rays.
+
+enum ray_kind {
+    RAY_KIND_PATH = 0,      // Camera rays and bounces
+    RAY_KIND_SHADOW
+};
+
+struct ray_record {
+    float origin[3];
+    float direction[3];
+    float time;
+    float t_min;
+    float t_max;
+    uint16_t bounce;        // 0 for camera rays; shadow rays carry the bounce they leave from
+    uint8_t kind;
+    uint8_t pad;
+};
+
+const uint32_t ray_capture_magic = 0x59525452;     // "RTRY"
+const uint32_t ray_capture_version = 1;
+const int ray_capture_scene_size = 512;
+
+struct ray_capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t pad;
+    uint64_t count;
+    char scene[ray_capture_scene_size];    // As given to prepare_scene, NUL terminated
+};
+
+class ray_capture {
+public:
+    ray_capture() : max_depth(0), file(nullptr), count(0), failed(false) {}
+    ~ray_capture() { close(); }
+    bool open(const std::string& path, const std::string& scene);
+    // Flushes and finishes the header. Returns false if anything failed to write.
+    bool close();
+
+    // The capture rays go to, if any.
+    static ray_capture*& active() {
+        static ray_capture* capture = nullptr;
+        return capture;
+    }
+    // A path segment with `depth` bounces left, as ray_color counts them.
+    void record_path(const ray& r, double t_min, double t_max, int depth) {
+        last_bounce() = max_depth - depth;
+        record(r, t_min, t_max, RAY_KIND_PATH);
+    }
+    void record_shadow(const ray& r, double t_min, double t_max) { record(r, t_min, t_max, RAY_KIND_SHADOW); }
+public:
+    int max_depth;      // Of the render being captured
+private:
+    // Of the calling thread's latest path ray, for the shadow rays that leave from it.
+    static int& last_bounce() {
+        static thread_local int bounce = 0;
+        return bounce;
+    }
+    void record(const ray& r, double t_min, double t_max, ray_kind kind);
+    bool flush();
+
+    static const size_t buffer_size = 1 << 14;
+    std::mutex lock;
+    FILE* file;
+    std::string path;
+    std::vector<ray_record> buffer;
+    uint64_t count;
+    bool failed;
+};
+
+bool ray_capture::open(const std::string& _path, const std::string& scene) {
+    close();
+    path = _path;
+    if (scene.size() >= static_cast<size_t>(ray_capture_scene_size)) {
+        std::cerr << "ERROR: scene name too long to capture: " << scene << ".\n";
+        return false;
+    }
+    file = fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    ray_capture_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ray_capture_magic;
+    header.version = ray_capture_version;
+    header.record_size = sizeof(ray_record);
+    strncpy(header.scene, scene.c_str(), sizeof(header.scene) - 1);
+    failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    count = 0;
+    buffer.reserve(buffer_size);
+    return !failed;
+}
+
+void ray_capture::record(const ray& r, double t_min, double t_max, ray_kind kind) {
+    ray_record rec;
+    for (int a = 0; a < 3; a++) {
+        rec.origin[a] = static_cast<float>(r.origin()[a]);
+        rec.direction[a] = static_cast<float>(r.direction()[a]);
+    }
+    rec.time = static_cast<float>(r.time());
+    rec.t_min = static_cast<float>(t_min);
+    rec.t_max = static_cast<float>(t_max);
+    rec.bounce = static_cast<uint16_t>(std::max(last_bounce(), 0));
+    rec.kind = static_cast<uint8_t>(kind);
+    rec.pad = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    buffer.push_back(rec);
+    if (buffer.size() >= buffer_size) flush();
+}
+
+bool ray_capture::flush() {
+    if (!file || buffer.empty()) return true;
+    if (fwrite(buffer.data(), sizeof(ray_record), buffer.size(), file) != buffer.size()) failed = true;
+    count += buffer.size();
+    buffer.clear();
+    return !failed;
+}
+
+bool ray_capture::close() {
+    if (!file) return true;
+    flush();
+    // Now that the count is known, finish the header.
+    uint64_t final_count = count;
+    if (fseek(file, offsetof(ray_capture_header, count), SEEK_SET) != 0 || fwrite(&final_count, sizeof(final_count), 1, file) != 1) failed = true;
+    if (fclose(file) != 0) failed = true;
+    file = nullptr;
+    if (failed) std::cerr << "ERROR: cannot write " << path << ".\n";
+    return !failed;
+}
+
+// Reads a whole capture.
+bool load_ray_capture(const std::string& path, std::string& scene, std::vector<ray_record>& records) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        std::cerr << "ERROR: cannot open ray capture " << path << ".\n";
+        return false;
+    }
+    ray_capture_header header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == ray_capture_magic && header.version == ray_capture_version
+              && header.record_size == sizeof(ray_record) && memchr(header.scene, 0, sizeof(header.scene));
+    if (ok) {
+        records.resize(header.count);
+        ok = fread(records.data(), sizeof(ray_record), records.size(), f) == records.size();
+    }
+    fclose(f);
+    if (!ok) {
+        std::cerr << "ERROR: bad ray capture " << path << ".\n";
+        return false;
+    }
+    scene = header.scene;
+    return true;
+}
+
+#endif
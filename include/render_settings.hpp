@@ -0,0 +1,80 @@
+#ifndef RENDER_SETTINGS_H_
+#define RENDER_SETTINGS_H_
+
+#include "utils.hpp"
+#include "camera.hpp"
+#include <string>
+#include <vector>
+
+// Everything besides the world that a frame needs. Kept as plain data so a scene
+// image can store it verbatim.
+struct render_settings {
+    double aspect_ratio;
+    int image_width;
+    int image_height;
+    int samples_per_pixel;
+    int max_depth;
+    color background;
+
+    point3 lookfrom;
+    point3 lookat;
+    vec3 vup;
+    double vfov;
+    double aperture;
+    double dist_to_focus;
+    double time0;
+    double time1;
+
+    render_settings() : aspect_ratio(16.0 / 9.0), image_width(1920), image_height(1080), samples_per_pixel(200), max_depth(50),
+        background(0, 0, 0), vup(0, 1, 0), vfov(40.0), aperture(0.0), dist_to_focus(10.0), time0(0.0), time1(1.0) {}
+
+    void set_image_width(int width) {
+        image_width = width;
+        image_height = static_cast<int>(image_width / aspect_ratio);
+    }
+
+    camera make_camera() const {
+        return camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, time0, time1);
+    }
+};
+
+// A named override such as "width 800" or "lookfrom 0 0 -10", as written in scene and job files.
+struct render_parameter {
+    std::string name;
+    double value[3];
+};
+
+// Number of values `name` takes, or 0 if it is not a render parameter.
+int render_parameter_size(const std::string& name) {
+    if (name == "lookfrom" || name == "lookat" || name == "vup" || name == "background") return 3;
+    if (name == "time") return 2;
+    if (name == "width" || name == "height" || name == "aspect" || name == "spp" || name == "depth"
+        || name == "vfov" || name == "aperture" || name == "focus") return 1;
+    return 0;
+}
+
+// Applies params in order. The image height follows the aspect ratio unless it is given
+// explicitly, in which case the aspect ratio follows width/height instead.
+void apply_render_parameters(render_settings& settings, const std::vector<render_parameter>& params) {
+    bool has_width = false, has_height = false, has_aspect = false;
+    for (const auto& p : params) {
+        auto v = p.value;
+        if (p.name == "width") { settings.image_width = static_cast<int>(v[0]); has_width = true; }
+        else if (p.name == "height") { settings.image_height = static_cast<int>(v[0]); has_height = true; }
+        else if (p.name == "aspect") { settings.aspect_ratio = v[0]; has_aspect = true; }
+        else if (p.name == "spp") settings.samples_per_pixel = static_cast<int>(v[0]);
+        else if (p.name == "depth") settings.max_depth = static_cast<int>(v[0]);
+        else if (p.name == "background") settings.background = color(v[0], v[1], v[2]);
+        else if (p.name == "lookfrom") settings.lookfrom = point3(v[0], v[1], v[2]);
+        else if (p.name == "lookat") settings.lookat = point3(v[0], v[1], v[2]);
+        else if (p.name == "vup") settings.vup = vec3(v[0], v[1], v[2]);
+        else if (p.name == "vfov") settings.vfov = v[0];
+        else if (p.name == "aperture") settings.aperture = v[0];
+        else if (p.name == "focus") settings.dist_to_focus = v[0];
+        else if (p.name == "time") { settings.time0 = v[0]; settings.time1 = v[1]; }
+    }
+    if (has_height && !has_aspect) settings.aspect_ratio = static_cast<double>(settings.image_width) / settings.image_height;
+    else if (!has_height && (has_width || has_aspect)) settings.image_height = static_cast<int>(settings.image_width / settings.aspect_ratio);
+}
+
+#endif
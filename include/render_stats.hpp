@@ -0,0 +1,369 @@
+#ifndef RENDER_STATS_H_
+#define RENDER_STATS_H_
+
+#include "trace.hpp"
+#include "perf_counters.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Render statistics, compiled in with RT_ENABLE_STATS (cmake -DRT_ENABLE_STATS=ON) and
+// free otherwise. Every thread counts into its own block without locks or atomics; the
+// blocks are summed when the stats are written, once the threads are done. Such builds
+// also replace the global operator new to count allocations per phase.
+
+enum stat_ray {
+    STAT_RAY_CAMERA = 0,
+    STAT_RAY_PATH,              // Every path segment traced, camera rays included
+    STAT_RAY_SHADOW,
+    STAT_RAY_NUM
+};
+
+enum stat_prim {
+    STAT_PRIM_SPHERE = 0,
+    STAT_PRIM_MOVING_SPHERE,
+    STAT_PRIM_RECT,
+    STAT_PRIM_BOX,
+    STAT_PRIM_TRIANGLE,
+    STAT_PRIM_MEDIUM,
+    STAT_PRIM_NUM
+};
+
+enum stat_material {
+    STAT_MAT_LAMBERTIAN = 0,
+    STAT_MAT_METAL,
+    STAT_MAT_DIELECTRIC,
+    STAT_MAT_DIFFUSE_LIGHT,
+    STAT_MAT_ISOTROPIC,
+    STAT_MAT_OTHER,
+    STAT_MAT_NUM
+};
+
+enum stat_phase {
+    STAT_PHASE_LOAD = 0,        // Parsing, builtin scene setup, scene image mapping
+    STAT_PHASE_BUILD,           // Acceleration structures
+    STAT_PHASE_RENDER,
+    STAT_PHASE_OUTPUT,          // Writing images
+    STAT_PHASE_NUM
+};
+
+const int stat_max_path = 64;   // Longer paths share the last histogram bucket
+
+// What to do about allocations inside a sample pass after the first one of a frame.
+enum stat_alloc_strictness {
+    STAT_ALLOC_ALLOW = 0,
+    STAT_ALLOC_WARN,            // Report the count after each pass
+    STAT_ALLOC_FAIL             // Abort at the allocation, for a stack trace
+};
+
+struct render_stats {
+    uint64_t rays[STAT_RAY_NUM];
+    uint64_t bvh_nodes;
+    uint64_t prim_tests[STAT_PRIM_NUM];
+    uint64_t material_hits[STAT_MAT_NUM];
+    uint64_t path_lengths[stat_max_path + 1];   // Segments per camera path
+    double phase_seconds[STAT_PHASE_NUM];
+    uint64_t allocations[STAT_PHASE_NUM + 1];   // The last entry is outside of any phase
+    uint64_t allocated_bytes[STAT_PHASE_NUM + 1];
+    uint64_t passes;
+    uint64_t strict_allocations;                // Made while allocations were forbidden
+    int phase;                                  // Of the innermost stat_timer running
+    bool forbid_allocations;
+
+    render_stats() : phase(STAT_PHASE_NUM), forbid_allocations(false) { clear(); }
+    void clear() {
+        memset(rays, 0, sizeof(rays));
+        bvh_nodes = 0;
+        memset(prim_tests, 0, sizeof(prim_tests));
+        memset(material_hits, 0, sizeof(material_hits));
+        memset(path_lengths, 0, sizeof(path_lengths));
+        for (int i = 0; i < STAT_PHASE_NUM; i++) phase_seconds[i] = 0;
+        memset(allocations, 0, sizeof(allocations));
+        memset(allocated_bytes, 0, sizeof(allocated_bytes));
+        passes = 0;
+        strict_allocations = 0;
+    }
+    void add(const render_stats& o);
+
+    // The calling thread's block.
+    static render_stats& local() {
+        auto& block = slot();
+        if (!block) block = register_block();
+        return *block;
+    }
+    // The calling thread's block if it has one. Never allocates.
+    static render_stats* peek() { return slot(); }
+    static stat_alloc_strictness& alloc_strictness() {
+        static stat_alloc_strictness strictness = STAT_ALLOC_ALLOW;
+        return strictness;
+    }
+    // The sum over all threads.
+    static render_stats merged();
+    // Zeroes every thread's block. Only call while no other thread is counting.
+    static void reset();
+    static size_t thread_count();
+private:
+    static render_stats*& slot() {
+        static thread_local render_stats* block = nullptr;
+        return block;
+    }
+    static std::mutex& registry_lock() {
+        static std::mutex lock;
+        return lock;
+    }
+    // Blocks live until exit, so counts of finished threads still get merged.
+    static std::vector<render_stats*>& registry() {
+        static std::vector<render_stats*> blocks;
+        return blocks;
+    }
+    static render_stats* register_block() {
+        std::lock_guard<std::mutex> guard(registry_lock());
+        registry().push_back(new render_stats());
+        return registry().back();
+    }
+};
+
+void render_stats::add(const render_stats& o) {
+    for (int i = 0; i < STAT_RAY_NUM; i++) rays[i] += o.rays[i];
+    bvh_nodes += o.bvh_nodes;
+    for (int i = 0; i < STAT_PRIM_NUM; i++) prim_tests[i] += o.prim_tests[i];
+    for (int i = 0; i < STAT_MAT_NUM; i++) material_hits[i] += o.material_hits[i];
+    for (int i = 0; i <= stat_max_path; i++) path_lengths[i] += o.path_lengths[i];
+    for (int i = 0; i < STAT_PHASE_NUM; i++) phase_seconds[i] += o.phase_seconds[i];
+    for (int i = 0; i <= STAT_PHASE_NUM; i++) {
+        allocations[i] += o.allocations[i];
+        allocated_bytes[i] += o.allocated_bytes[i];
+    }
+    passes += o.passes;
+    strict_allocations += o.strict_allocations;
+}
+
+render_stats render_stats::merged() {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    render_stats total;
+    for (auto block : registry()) total.add(*block);
+    return total;
+}
+
+void render_stats::reset() {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    for (auto block : registry()) block->clear();
+}
+
+size_t render_stats::thread_count() {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    return registry().size();
+}
+
+#ifdef RT_ENABLE_STATS
+const bool render_stats_enabled = true;
+#define RT_STAT_INC(counter) (++render_stats::local().counter)
+#else
+const bool render_stats_enabled = false;
+#define RT_STAT_INC(counter) ((void)0)
+#endif
+
+// Adds the time until it goes out of scope to a phase, and counts allocations meanwhile
+// towards it.
+class stat_timer {
+public:
+#ifdef RT_ENABLE_STATS
+    explicit stat_timer(stat_phase _phase) : phase(_phase), outer(render_stats::local().phase), start(std::chrono::steady_clock::now()) {
+        render_stats::local().phase = phase;
+    }
+    ~stat_timer() {
+        auto& s = render_stats::local();
+        s.phase_seconds[phase] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        s.phase = outer;
+    }
+private:
+    stat_phase phase;
+    int outer;
+    std::chrono::steady_clock::time_point start;
+#else
+    explicit stat_timer(stat_phase) {}
+#endif
+};
+
+// Path segments the calling thread has traced so far; the difference around one camera
+// sample is its path length.
+inline uint64_t stat_path_mark() {
+#ifdef RT_ENABLE_STATS
+    return render_stats::local().rays[STAT_RAY_PATH];
+#else
+    return 0;
+#endif
+}
+
+inline void stat_path_end(uint64_t mark) {
+#ifdef RT_ENABLE_STATS
+    auto length = render_stats::local().rays[STAT_RAY_PATH] - mark;
+    render_stats::local().path_lengths[length < stat_max_path ? length : stat_max_path]++;
+#else
+    (void)mark;
+#endif
+}
+
+#ifdef RT_ENABLE_STATS
+inline void stat_allocation(size_t size) {
+    auto s = render_stats::peek();
+    if (!s) return;
+    s->allocations[s->phase]++;
+    s->allocated_bytes[s->phase] += size;
+    if (!s->forbid_allocations) return;
+    s->strict_allocations++;
+    if (render_stats::alloc_strictness() == STAT_ALLOC_FAIL) {
+        // No iostreams here: they may allocate.
+        static const char message[] = "ERROR: allocation inside a sample pass.\n";
+        if (write(2, message, sizeof(message) - 1) < 0) {}
+        abort();
+    }
+}
+
+// Kept out of line: where GCC can see them calling malloc and free, it warns that every
+// new expression is paired with a mismatched free.
+__attribute__((noinline)) void* operator new(size_t size) {
+    stat_allocation(size);
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void* operator new[](size_t size) {
+    stat_allocation(size);
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    stat_allocation(size);
+    return malloc(size ? size : 1);
+}
+__attribute__((noinline)) void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    stat_allocation(size);
+    return malloc(size ? size : 1);
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+#endif
+
+// Marks a sample pass. Past the first pass of a frame, when strictness asks for it,
+// allocations are forbidden until it goes out of scope.
+class stat_pass_scope {
+public:
+#ifdef RT_ENABLE_STATS
+    explicit stat_pass_scope(bool warmed_up) : strict(warmed_up && render_stats::alloc_strictness() != STAT_ALLOC_ALLOW) {
+        auto& s = render_stats::local();
+        s.passes++;
+        before = s.strict_allocations;
+        s.forbid_allocations = strict;
+    }
+    ~stat_pass_scope() {
+        auto& s = render_stats::local();
+        s.forbid_allocations = false;
+        if (strict && s.strict_allocations > before) {
+            std::cerr << "WARNING: " << s.strict_allocations - before << " allocations in a sample pass.\n";
+        }
+    }
+private:
+    bool strict;
+    uint64_t before;
+#else
+    explicit stat_pass_scope(bool) {}
+#endif
+};
+
+// Lets the enclosing scope allocate inside a strict sample pass, for caches that fill
+// on demand by design. The allocations still count.
+class stat_allocations_allowed {
+public:
+#ifdef RT_ENABLE_STATS
+    stat_allocations_allowed() : outer(render_stats::local().forbid_allocations) { render_stats::local().forbid_allocations = false; }
+    ~stat_allocations_allowed() { render_stats::local().forbid_allocations = outer; }
+private:
+    bool outer;
+#else
+    stat_allocations_allowed() {}
+#endif
+};
+
+// BVH nodes visited and primitives tested by the calling thread so far, zero unless stats
+// are compiled in.
+inline void stat_work_mark(uint64_t& bvh_nodes, uint64_t& prim_tests) {
+#ifdef RT_ENABLE_STATS
+    const auto& s = render_stats::local();
+    bvh_nodes = s.bvh_nodes;
+    prim_tests = 0;
+    for (int i = 0; i < STAT_PRIM_NUM; i++) prim_tests += s.prim_tests[i];
+#else
+    bvh_nodes = prim_tests = 0;
+#endif
+}
+
+// Writes the merged counters as JSON. Does nothing unless stats are compiled in.
+bool write_render_stats(const std::string& path) {
+    if (!render_stats_enabled) return true;
+    trace_span span("write stats");
+    auto s = render_stats::merged();
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    static const char* prim_names[STAT_PRIM_NUM] = {"sphere", "moving_sphere", "rect", "box", "triangle", "medium"};
+    static const char* material_names[STAT_MAT_NUM] = {"lambertian", "metal", "dielectric", "diffuse_light", "isotropic", "other"};
+    static const char* phase_names[STAT_PHASE_NUM] = {"load", "build", "render", "output"};
+
+    auto render_seconds = s.phase_seconds[STAT_PHASE_RENDER];
+    auto total_rays = s.rays[STAT_RAY_PATH] + s.rays[STAT_RAY_SHADOW];
+    out << "{\n";
+    out << "  \"threads\": " << render_stats::thread_count() << ",\n";
+    out << "  \"rays\": {\"camera\": " << s.rays[STAT_RAY_CAMERA] << ", \"bounce\": " << s.rays[STAT_RAY_PATH] - s.rays[STAT_RAY_CAMERA]
+        << ", \"shadow\": " << s.rays[STAT_RAY_SHADOW] << ", \"total\": " << total_rays << "},\n";
+    out << "  \"rays_per_second\": " << (render_seconds > 0 ? total_rays / render_seconds : 0.0) << ",\n";
+    out << "  \"bvh_nodes_visited\": " << s.bvh_nodes << ",\n";
+    out << "  \"primitive_tests\": {";
+    uint64_t prim_tests = 0;
+    for (int i = 0; i < STAT_PRIM_NUM; i++) {
+        out << (i ? ", " : "") << '"' << prim_names[i] << "\": " << s.prim_tests[i];
+        prim_tests += s.prim_tests[i];
+    }
+    out << "},\n";
+    write_perf_counters_json(out, total_rays, prim_tests);
+    out << "  \"material_hits\": {";
+    for (int i = 0; i < STAT_MAT_NUM; i++) out << (i ? ", " : "") << '"' << material_names[i] << "\": " << s.material_hits[i];
+    out << "},\n";
+    // Index n counts paths of n segments; the last entry also holds longer ones.
+    out << "  \"path_lengths\": [";
+    for (int i = 0; i <= stat_max_path; i++) out << (i ? ", " : "") << s.path_lengths[i];
+    out << "],\n";
+    out << "  \"phase_seconds\": {";
+    for (int i = 0; i < STAT_PHASE_NUM; i++) out << (i ? ", " : "") << '"' << phase_names[i] << "\": " << s.phase_seconds[i];
+    out << "},\n";
+    out << "  \"allocations\": {";
+    for (int i = 0; i <= STAT_PHASE_NUM; i++) {
+        out << (i ? ", " : "") << '"' << (i < STAT_PHASE_NUM ? phase_names[i] : "other") << "\": {\"count\": " << s.allocations[i]
+            << ", \"bytes\": " << s.allocated_bytes[i] << "}";
+    }
+    out << "},\n";
+    out << "  \"sample_passes\": " << s.passes << ",\n";
+    out << "  \"allocations_per_pass\": " << (s.passes > 0 ? static_cast<double>(s.allocations[STAT_PHASE_RENDER]) / s.passes : 0.0) << ",\n";
+    out << "  \"strict_allocations\": " << s.strict_allocations << "\n";
+    out << "}\n";
+    if (!out) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef RENDERER_H_
+#define RENDERER_H_
+
+#include "utils.hpp"
+#include "color.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "medium_lighting.hpp"
+#include "render_stats.hpp"
+#include "ray_capture.hpp"
+#include "trace.hpp"
+#include "camera.hpp"
+#include "render_settings.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef RT_ENABLE_STATS
+inline int material_stat(const material* m) {
+    if (dynamic_cast<const lambertian*>(m)) return STAT_MAT_LAMBERTIAN;
+    if (dynamic_cast<const metal*>(m)) return STAT_MAT_METAL;
+    if (dynamic_cast<const dielectric*>(m)) return STAT_MAT_DIELECTRIC;
+    if (dynamic_cast<const diffuse_light*>(m)) return STAT_MAT_DIFFUSE_LIGHT;
+    if (dynamic_cast<const isotropic*>(m)) return STAT_MAT_ISOTROPIC;
+    return STAT_MAT_OTHER;
+}
+#endif
+
+// lighting, when given, adds equiangular connections to lights from homogeneous media;
+// from is the medium scattering event r left, if any.
+color ray_color(const ray& r, const color& background, const hittable& world, int depth,
+                const medium_lighting* lighting = nullptr, const medium_vertex* from = nullptr) {
+    hit_record rec;
+    if (depth <= 0) return color(0, 0, 0);
+    RT_STAT_INC(rays[STAT_RAY_PATH]);
+    if (auto capture = ray_capture::active()) capture->record_path(r, 0.0001, infinity, depth);
+    bool hit_anything = world.hit(r, 0.0001, infinity, rec);
+    // A connection needs a bounce left, so that free flight could have found the same light.
+    color in_scattered(0, 0, 0);
+    if (lighting && depth > 1) in_scattered = lighting->in_scattering(r, world, hit_anything ? rec.t : infinity);
+    if (!hit_anything) return in_scattered + background;
+    RT_STAT_INC(material_hits[material_stat(rec.mat_ptr.get())]);
+    ray scattered;
+    color attenuation;
+    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (from && emitted.length_squared() > 0) emitted *= lighting->emission_weight(*from, rec);
+    bool scatters;
+    {
+        RT_PERF_REGION(PERF_REGION_SCATTER);
+        scatters = rec.mat_ptr->scatter(r, rec, attenuation, scattered);
+    }
+    if (!scatters) {
+        return in_scattered + emitted;
+    }
+    medium_vertex vertex;
+    auto next = (lighting && lighting->medium_event(r, rec, vertex)) ? &vertex : nullptr;
+    return in_scattered + emitted + attenuation * ray_color(scattered, background, world, depth - 1, lighting, next);
+}
+
+// Per-pixel sample sums of one frame. Row 0 is the bottom of the image, as in the camera.
+struct frame_buffer {
+    int width;
+    int height;
+    int samples;
+    std::vector<color> sum;
+
+    frame_buffer(int w, int h) : width(w), height(h), samples(0), sum(static_cast<size_t>(w) * h, color(0, 0, 0)) {}
+    color& at(int i, int j) { return sum[static_cast<size_t>(j) * width + i]; }
+    const color& at(int i, int j) const { return sum[static_cast<size_t>(j) * width + i]; }
+};
+
+// Per-pixel sums of what the samples cost: wall time, and with stats compiled in BVH
+// nodes visited and primitives tested. Same layout as frame_buffer.
+struct cost_buffer {
+    enum channel { NANOSECONDS = 0, BVH_NODES, PRIM_TESTS, CHANNELS };
+
+    int width;
+    int height;
+    int samples;
+    std::vector<double> sum;    // CHANNELS values per pixel
+
+    cost_buffer(int w, int h) : width(w), height(h), samples(0), sum(static_cast<size_t>(w) * h * CHANNELS, 0.0) {}
+    double* at(int i, int j) { return &sum[(static_cast<size_t>(j) * width + i) * CHANNELS]; }
+    const double* at(int i, int j) const { return &sum[(static_cast<size_t>(j) * width + i) * CHANNELS]; }
+};
+
+// Adds one jittered sample to every pixel, and its cost to cost when given.
+void render_pass(const hittable& world, const render_settings& settings, const camera& cam, frame_buffer& frame,
+                 const medium_lighting* lighting = nullptr, cost_buffer* cost = nullptr) {
+    typedef std::chrono::steady_clock clock;
+    stat_timer timer(STAT_PHASE_RENDER);
+    trace_span span("sample pass", trace::enabled() ? std::to_string(frame.samples) : std::string());
+    stat_pass_scope pass(frame.samples > 0);
+    if (lighting && lighting->empty()) lighting = nullptr;
+    for (int j = frame.height - 1; j >= 0; j--) {
+        for (int i = 0; i < frame.width; i++) {
+            clock::time_point start;
+            uint64_t nodes = 0, tests = 0;
+            if (cost) {
+                stat_work_mark(nodes, tests);
+                start = clock::now();
+            }
+            auto u = (i + random_double()) / (frame.width - 1);
+            auto v = (j + random_double()) / (frame.height - 1);
+            ray r = cam.get_ray(u, v, 1.0 / (frame.width - 1), 1.0 / (frame.height - 1));
+            RT_STAT_INC(rays[STAT_RAY_CAMERA]);
+            auto mark = stat_path_mark();
+            {
+                RT_PERF_REGION(PERF_REGION_RENDER);
+                frame.at(i, j) += ray_color(r, settings.background, world, settings.max_depth, lighting);
+            }
+            stat_path_end(mark);
+            if (cost) {
+                auto pixel = cost->at(i, j);
+                pixel[cost_buffer::NANOSECONDS] += std::chrono::duration<double, std::nano>(clock::now() - start).count();
+                uint64_t nodes_after, tests_after;
+                stat_work_mark(nodes_after, tests_after);
+                pixel[cost_buffer::BVH_NODES] += nodes_after - nodes;
+                pixel[cost_buffer::PRIM_TESTS] += tests_after - tests;
+            }
+        }
+    }
+    frame.samples++;
+    if (cost) cost->samples++;
+}
+
+// Writes the gamma corrected average of the samples so far as a plain PPM.
+bool write_ppm(const std::string& path, const frame_buffer& frame) {
+    stat_timer timer(STAT_PHASE_OUTPUT);
+    std::ostringstream text;
+    {
+        trace_span span("tone map");
+        text << "P3\n" << frame.width << ' ' << frame.height << "\n255\n";
+        for (int j = frame.height - 1; j >= 0; j--) {
+            for (int i = 0; i < frame.width; i++) {
+                auto pc = get_color(frame.at(i, j), frame.samples);
+                text << static_cast<int>(256 * clamp(pc[0], 0.0, 0.999)) << ' '
+                     << static_cast<int>(256 * clamp(pc[1], 0.0, 0.999)) << ' '
+                     << static_cast<int>(256 * clamp(pc[2], 0.0, 0.999)) << '\n';
+            }
+        }
+    }
+    trace_span span("write image", path);
+    std::ofstream fout(path, std::ios::out);
+    if (!fout) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    fout << text.str();
+    return true;
+}
+
+// PFM images: three floats per pixel, bottom row first as in frame_buffer. Written in
+// the machine's byte order, which must be little endian.
+bool write_pfm(const std::string& path, int width, int height, const std::vector<float>& rgb) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+    bool ok = fwrite(rgb.data(), sizeof(float), rgb.size(), f) == rgb.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) std::cerr << "ERROR: cannot write " << path << ".\n";
+    return ok;
+}
+
+bool read_pfm(const std::string& path, int& width, int& height, std::vector<float>& rgb) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        std::cerr << "ERROR: cannot open " << path << ".\n";
+        return false;
+    }
+    char magic[3] = {0};
+    double scale = 0;
+    bool ok = fscanf(f, "%2s %d %d %lf", magic, &width, &height, &scale) == 4 && strcmp(magic, "PF") == 0
+              && width > 0 && height > 0 && scale != 0 && fgetc(f) != EOF;
+    if (ok) {
+        rgb.resize(static_cast<size_t>(width) * height * 3);
+        ok = fread(rgb.data(), sizeof(float), rgb.size(), f) == rgb.size();
+    }
+    fclose(f);
+    if (!ok) {
+        std::cerr << "ERROR: bad PFM image " << path << ".\n";
+        return false;
+    }
+    // A positive scale marks big endian data.
+    if (scale > 0) {
+        for (auto& v : rgb) {
+            unsigned char* b = reinterpret_cast<unsigned char*>(&v);
+            std::swap(b[0], b[3]);
+            std::swap(b[1], b[2]);
+        }
+    }
+    return true;
+}
+
+// Maps t in [0, 1] through black, purple, red and yellow to white, so that brightness
+// follows cost.
+inline color heat_color(double t) {
+    static const color stops[] = {color(0, 0, 0), color(0.3, 0.05, 0.5), color(0.85, 0.15, 0.2), color(1, 0.7, 0), color(1, 1, 1)};
+    const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+    t = clamp(t, 0.0, 1.0) * last;
+    int k = std::min(static_cast<int>(t), last - 1);
+    return stops[k] + (t - k) * (stops[k + 1] - stops[k]);
+}
+
+// Writes one channel of cost, averaged per sample, in false color. The scale tops out at
+// the 99th percentile so that a few outliers don't wash out the rest.
+bool write_heatmap(const std::string& path, const cost_buffer& cost, int channel) {
+    std::vector<double> values(static_cast<size_t>(cost.width) * cost.height);
+    for (size_t p = 0; p < values.size(); p++) values[p] = cost.sum[p * cost_buffer::CHANNELS + channel] / std::max(cost.samples, 1);
+    auto sorted = values;
+    auto top = sorted.begin() + static_cast<size_t>(0.99 * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), top, sorted.end());
+    auto scale = *top > 0 ? *top : *std::max_element(sorted.begin(), sorted.end());
+
+    std::ofstream fout(path, std::ios::out);
+    if (!fout) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    fout << "P3\n" << cost.width << ' ' << cost.height << "\n255\n";
+    for (int j = cost.height - 1; j >= 0; j--) {
+        for (int i = 0; i < cost.width; i++) {
+            auto c = heat_color(scale > 0 ? values[static_cast<size_t>(j) * cost.width + i] / scale : 0);
+            fout << static_cast<int>(255.999 * c[0]) << ' ' << static_cast<int>(255.999 * c[1]) << ' ' << static_cast<int>(255.999 * c[2]) << '\n';
+        }
+    }
+    return true;
+}
+
+// Writes <base>_cost.pfm, the per-sample average of every channel as raw floats (red,
+// green and blue hold nanoseconds, BVH nodes and primitive tests), and <base>_cost_time.ppm, plus with stats compiled in
+// <base>_cost_nodes.ppm and <base>_cost_tests.ppm.
+bool write_cost_maps(const std::string& base, const cost_buffer& cost) {
+    stat_timer timer(STAT_PHASE_OUTPUT);
+    trace_span span("write cost maps", base);
+    std::vector<float> averages(cost.sum.size());
+    for (size_t k = 0; k < averages.size(); k++) averages[k] = static_cast<float>(cost.sum[k] / std::max(cost.samples, 1));
+    if (!write_pfm(base + "_cost.pfm", cost.width, cost.height, averages)) return false;
+    bool ok = write_heatmap(base + "_cost_time.ppm", cost, cost_buffer::NANOSECONDS);
+    if (render_stats_enabled) {
+        ok = write_heatmap(base + "_cost_nodes.ppm", cost, cost_buffer::BVH_NODES) && ok;
+        ok = write_heatmap(base + "_cost_tests.ppm", cost, cost_buffer::PRIM_TESTS) && ok;
+    }
+    return ok;
+}
+
+#endif
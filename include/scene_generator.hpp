@@ -0,0 +1,205 @@
+#ifndef SCENE_GENERATOR_H_
+#define SCENE_GENERATOR_H_
+
+#include "utils.hpp"
+#include "aabb.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "aarect.hpp"
+#include "triangle_mesh.hpp"
+#include "material.hpp"
+#include "render_settings.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Synthetic scenes of any size, for scaling benchmarks. Primitives of radius 0.25 are
+// placed at about one per unit volume, so that the cost of a ray depends on the structure
+// rather than on the density as the count grows:
+//
+//   uniform   spread evenly over a cube
+//   clustered gathered into dense clumps of about 1000, which are spread over a cube
+//   ground    one layer on a plane, plus a ground sphere much larger than the rest, as
+//             in random_scene
+//
+// The primitives are a weighted mix of spheres, axis-aligned rects and triangles; the
+// triangles all go into one triangle_mesh, with its own BVH. A fraction of the spheres
+// moves over the shutter interval. Materials come from a small shared palette, so memory
+// is that of the geometry and its BVH. Uses random_double(), so seed random_generator()
+// first for a repeatable scene.
+
+enum scene_distribution {
+    SCENE_UNIFORM = 0,
+    SCENE_CLUSTERED,
+    SCENE_GROUND
+};
+
+struct scene_generator_options {
+    size_t count;
+    scene_distribution distribution;
+    double sphere_weight;
+    double rect_weight;
+    double triangle_weight;
+    double moving_fraction;     // Of the spheres
+
+    scene_generator_options()
+        : count(1000), distribution(SCENE_UNIFORM), sphere_weight(1), rect_weight(0), triangle_weight(0), moving_fraction(0) {}
+};
+
+const char* const scene_distribution_names[] = {"uniform", "clustered", "ground"};
+
+bool parse_scene_distribution(const std::string& name, scene_distribution& distribution) {
+    for (int d = SCENE_UNIFORM; d <= SCENE_GROUND; d++) {
+        if (name == scene_distribution_names[d]) {
+            distribution = static_cast<scene_distribution>(d);
+            return true;
+        }
+    }
+    std::cerr << "ERROR: unknown distribution " << name << "; expected uniform, clustered or ground.\n";
+    return false;
+}
+
+// Reads "count=100000,distribution=clustered,mix=2:1:1,moving=0.1", any subset in any
+// order; mix weighs spheres, rects and triangles. Counts accept exponents, as in 1e6.
+bool parse_scene_generator_options(const std::string& spec, scene_generator_options& options) {
+    size_t start = 0;
+    while (start < spec.size()) {
+        auto comma = spec.find(',', start);
+        auto item = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        start = comma == std::string::npos ? spec.size() : comma + 1;
+        auto equals = item.find('=');
+        auto key = item.substr(0, equals);
+        auto value = equals == std::string::npos ? std::string() : item.substr(equals + 1);
+        if (key == "count") {
+            auto count = atof(value.c_str());
+            if (count < 1) {
+                std::cerr << "ERROR: scene count must be at least 1.\n";
+                return false;
+            }
+            options.count = static_cast<size_t>(count);
+        }
+        else if (key == "distribution") {
+            if (!parse_scene_distribution(value, options.distribution)) return false;
+        }
+        else if (key == "mix") {
+            double w[3] = {0, 0, 0};
+            if (sscanf(value.c_str(), "%lf:%lf:%lf", &w[0], &w[1], &w[2]) < 1 || w[0] < 0 || w[1] < 0 || w[2] < 0 || w[0] + w[1] + w[2] <= 0) {
+                std::cerr << "ERROR: mix needs non-negative sphere:rect:triangle weights, not " << value << ".\n";
+                return false;
+            }
+            options.sphere_weight = w[0];
+            options.rect_weight = w[1];
+            options.triangle_weight = w[2];
+        }
+        else if (key == "moving") {
+            options.moving_fraction = clamp(atof(value.c_str()), 0.0, 1.0);
+        }
+        else if (!key.empty()) {
+            std::cerr << "ERROR: unknown scene generator option " << key << ".\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+const double generated_radius = 0.25;
+
+// The region the primitives are spread over; clumps spill a little past it.
+aabb generated_region(const scene_generator_options& options) {
+    auto n = static_cast<double>(options.count);
+    if (options.distribution == SCENE_GROUND) {
+        auto half = sqrt(n) / 2;
+        return aabb(point3(-half, 0, -half), point3(half, 2 * generated_radius, half));
+    }
+    auto half = cbrt(n) / 2;
+    return aabb(point3(-half, -half, -half), point3(half, half, half));
+}
+
+// A standard normal variate (Box-Muller).
+inline double random_normal() {
+    auto u = 1 - random_double();
+    return sqrt(-2 * log(u)) * cos(2 * pi * random_double());
+}
+
+hittable_list generate_scene(const scene_generator_options& options, render_settings& settings) {
+    const double radius = generated_radius;
+    hittable_list world;
+    world.objects.reserve(options.count + 2);
+    std::vector<shared_ptr<material>> palette;
+    for (int m = 0; m < 8; m++) palette.push_back(make_shared<lambertian>(color::random(0.2, 0.9)));
+
+    auto half = generated_region(options).max().x();
+    auto side = 2 * half;
+    std::vector<point3> clusters;
+    if (options.distribution == SCENE_CLUSTERED) {
+        auto count = std::max<size_t>(1, options.count / 1000);
+        for (size_t c = 0; c < count; c++) clusters.push_back(point3(random_double(-half, half), random_double(-half, half), random_double(-half, half)));
+    }
+    // Gaussian clumps, dense at the core.
+    const double cluster_sigma = 2;
+
+    auto mesh = make_shared<mesh_data>();
+    auto total = options.sphere_weight + options.rect_weight + options.triangle_weight;
+    for (size_t k = 0; k < options.count; k++) {
+        point3 p;
+        if (options.distribution == SCENE_UNIFORM) {
+            p = point3(random_double(-half, half), random_double(-half, half), random_double(-half, half));
+        }
+        else if (options.distribution == SCENE_CLUSTERED) {
+            auto& center = clusters[std::min(static_cast<size_t>(random_double() * clusters.size()), clusters.size() - 1)];
+            p = center + cluster_sigma * vec3(random_normal(), random_normal(), random_normal());
+        }
+        else {
+            p = point3(random_double(-half, half), radius, random_double(-half, half));
+        }
+        auto& mat = palette[static_cast<size_t>(random_double() * palette.size())];
+
+        auto pick = random_double() * total;
+        if (pick < options.sphere_weight) {
+            if (random_double() < options.moving_fraction) {
+                world.add(make_shared<moving_sphere>(p, p + vec3(0, random_double(0, 2 * radius), 0), 0.0, 1.0, radius, mat));
+            }
+            else {
+                world.add(make_shared<sphere>(p, radius, mat));
+            }
+        }
+        else if (pick < options.sphere_weight + options.rect_weight) {
+            auto a = p - vec3(radius, radius, radius), b = p + vec3(radius, radius, radius);
+            auto axis = random_int(0, 2);
+            if (axis == 0) world.add(make_shared<xy_rect>(a.x(), b.x(), a.y(), b.y(), p.z(), mat));
+            else if (axis == 1) world.add(make_shared<xz_rect>(a.x(), b.x(), a.z(), b.z(), p.y(), mat));
+            else world.add(make_shared<yz_rect>(a.y(), b.y(), a.z(), b.z(), p.x(), mat));
+        }
+        else {
+            mesh_triangle tri;
+            for (int v = 0; v < 3; v++) {
+                tri.p[v] = static_cast<int>(mesh->positions.size());
+                tri.n[v] = tri.t[v] = -1;
+                mesh->positions.push_back(p + 2 * radius * random_in_unit_sphere());
+            }
+            mesh->triangles.push_back(tri);
+        }
+    }
+    if (!mesh->triangles.empty()) world.add(make_shared<triangle_mesh>(mesh, palette[0]));
+
+    settings = render_settings();
+    settings.background = color(0.70, 0.80, 1.00);
+    settings.time0 = 0;
+    settings.time1 = 1;
+    settings.vfov = 40.0;
+    settings.lookat = point3(0, 0, 0);
+    if (options.distribution == SCENE_GROUND) {
+        // Large enough to look flat under the whole layer.
+        auto ground_radius = std::max(1000.0, 100 * side);
+        world.add(make_shared<sphere>(point3(0, -ground_radius, 0), ground_radius, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+        settings.lookfrom = point3(0.75 * side + 2, 0.1 * side + 2, 0.2 * side + 2);
+    }
+    else {
+        settings.lookfrom = point3(1.2 * side + 2, 0.5 * side + 2, 0.8 * side + 2);
+    }
+    return world;
+}
+
+#endif
@@ -0,0 +1,1109 @@
+#ifndef SCENE_IMAGE_H_
+#define SCENE_IMAGE_H_
+
+#include "utils.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "bvh.hpp"
+#include "triangle_mesh.hpp"
+#include "constant_medium.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include "tiled_texture.hpp"
+#include "baked_texture.hpp"
+#include "flat_bvh.hpp"
+#include "render_settings.hpp"
+#include "render_stats.hpp"
+#include "trace.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary scene image: the flattened world, its materials, decoded textures and a
+// prebuilt BVH, laid out so the file can be mmapped and traced in place. Every
+// reference is an index into a section, so nothing is parsed or fixed up after
+// mapping, and processes rendering the same image share its pages.
+
+const uint32_t scene_image_magic = 0x49535452;     // "RTSI"
+const uint32_t scene_image_version = 2;
+const uint64_t scene_image_alignment = 64;
+
+enum packed_section_id {
+    SECTION_NODES = 0,      // flat_bvh_node
+    SECTION_INDEX,          // int32_t, leaf order of the BVH primitives
+    SECTION_PRIMS,          // packed_prim; BVH primitives first, then medium boundaries
+    SECTION_XFORMS,         // packed_xform
+    SECTION_TRI_ATTRIBS,    // packed_tri_attrib
+    SECTION_MATERIALS,      // packed_material
+    SECTION_TEXTURES,       // packed_texture
+    SECTION_BLOB,           // Raw bytes: texels, noise tables
+    SECTION_NUM,
+};
+
+struct packed_section {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t element_size;
+};
+
+struct packed_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t settings_size;
+    uint32_t bvh_prims;     // Primitives reachable through the BVH
+    uint64_t file_size;
+    render_settings settings;
+    packed_section sections[SECTION_NUM];
+};
+
+enum packed_prim_kind {
+    PRIM_SPHERE = 0,        // d: center, radius
+    PRIM_MOVING_SPHERE,     // d: center0, center1, time0, time1, radius
+    PRIM_XY_RECT,           // d: a0, a1, b0, b1, k
+    PRIM_XZ_RECT,
+    PRIM_YZ_RECT,
+    PRIM_BOX,               // d: min, max in the frame of xform
+    PRIM_TRIANGLE,          // d: p0, p1, p2; first: tri attrib or -1
+    PRIM_MEDIUM,            // d: neg_inv_density; first, count: boundary prims
+};
+
+struct packed_prim {
+    int32_t kind;
+    int32_t material;
+    int32_t xform;          // -1 for identity
+    int32_t first;
+    int32_t count;
+    int32_t pad;
+    double d[12];
+};
+
+// world = r * local + t. Only rigid transforms occur (translate, rotate_y, oriented_box).
+struct packed_xform {
+    double r[9];
+    double t[3];
+};
+
+struct packed_tri_attrib {
+    vec3 n[3];
+    mesh_uv uv[3];
+    int32_t has_normals;
+    int32_t has_uvs;
+};
+
+enum packed_material_kind {
+    MAT_LAMBERTIAN = 0,     // texture
+    MAT_METAL,              // d: albedo, fuzz
+    MAT_DIELECTRIC,         // d: ir, r, g, b
+    MAT_DIFFUSE_LIGHT,      // texture
+    MAT_ISOTROPIC,          // texture
+};
+
+struct packed_material {
+    int32_t kind;
+    int32_t texture;
+    double d[4];
+};
+
+enum packed_texture_kind {
+    TEX_SOLID = 0,          // d: color
+    TEX_CHECKER,            // a: even, b: odd
+    TEX_NOISE,              // d[0]: scale; blob: ranvec, perm_x, perm_y, perm_z
+    TEX_IMAGE,              // a: width, b: height; blob: RGB8 texels of every MIP level, finest first
+    TEX_TILED,              // a: path length; blob: path of the .tiles file
+    TEX_BAKED,              // a: source, b: path length; blob: bake_recipe, then the path of the .bake file
+};
+
+struct packed_texture {
+    int32_t kind;
+    int32_t a;
+    int32_t b;
+    int32_t pad;
+    double d[3];
+    uint64_t blob;
+};
+
+inline packed_xform xform_identity() {
+    packed_xform x;
+    for (int i = 0; i < 9; i++) x.r[i] = (i % 4 == 0) ? 1.0 : 0.0;
+    x.t[0] = x.t[1] = x.t[2] = 0;
+    return x;
+}
+
+inline vec3 xform_vector(const packed_xform& x, const vec3& v) {
+    return vec3(x.r[0] * v[0] + x.r[1] * v[1] + x.r[2] * v[2],
+                x.r[3] * v[0] + x.r[4] * v[1] + x.r[5] * v[2],
+                x.r[6] * v[0] + x.r[7] * v[1] + x.r[8] * v[2]);
+}
+
+inline vec3 xform_vector_inverse(const packed_xform& x, const vec3& v) {
+    return vec3(x.r[0] * v[0] + x.r[3] * v[1] + x.r[6] * v[2],
+                x.r[1] * v[0] + x.r[4] * v[1] + x.r[7] * v[2],
+                x.r[2] * v[0] + x.r[5] * v[1] + x.r[8] * v[2]);
+}
+
+inline point3 xform_point(const packed_xform& x, const point3& p) {
+    return xform_vector(x, p) + vec3(x.t[0], x.t[1], x.t[2]);
+}
+
+// a after b.
+inline packed_xform xform_compose(const packed_xform& a, const packed_xform& b) {
+    packed_xform x;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            x.r[3 * i + j] = a.r[3 * i] * b.r[j] + a.r[3 * i + 1] * b.r[3 + j] + a.r[3 * i + 2] * b.r[6 + j];
+        }
+    }
+    auto t = xform_point(a, vec3(b.t[0], b.t[1], b.t[2]));
+    x.t[0] = t[0];
+    x.t[1] = t[1];
+    x.t[2] = t[2];
+    return x;
+}
+
+inline aabb xform_box(const packed_xform& x, const aabb& box) {
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+    for (int i = 0; i < 8; i++) {
+        point3 corner((i & 1) ? box.max().x() : box.min().x(), (i & 2) ? box.max().y() : box.min().y(), (i & 4) ? box.max().z() : box.min().z());
+        auto p = xform_point(x, corner);
+        for (int c = 0; c < 3; c++) {
+            min[c] = fmin(min[c], p[c]);
+            max[c] = fmax(max[c], p[c]);
+        }
+    }
+    return aabb(min, max);
+}
+
+inline uint64_t image_align(uint64_t n) {
+    return (n + scene_image_alignment - 1) / scene_image_alignment * scene_image_alignment;
+}
+
+class scene_image_writer {
+public:
+    bool write(const std::string& filename, const hittable_list& world, const render_settings& settings);
+private:
+    bool flatten(const shared_ptr<hittable>& object, int xform, bool boundary);
+    bool add_prim(packed_prim prim, const aabb& local_box, bool boundary);
+    int add_xform(int parent, const packed_xform& x);
+    int add_material(const shared_ptr<material>& m);
+    int add_texture(const shared_ptr<texture>& t);
+    uint64_t add_blob(const void* data, size_t size);
+private:
+    std::vector<packed_prim> prims;
+    std::vector<aabb> prim_boxes;
+    std::vector<packed_prim> boundary_prims;
+    std::vector<packed_xform> xforms;
+    std::vector<packed_tri_attrib> tri_attribs;
+    std::vector<packed_material> materials;
+    std::vector<packed_texture> textures;
+    std::vector<unsigned char> blob;
+    std::map<const material*, int> material_ids;
+    std::map<const texture*, int> texture_ids;
+};
+
+int scene_image_writer::add_xform(int parent, const packed_xform& x) {
+    xforms.push_back(parent < 0 ? x : xform_compose(xforms[parent], x));
+    return static_cast<int>(xforms.size()) - 1;
+}
+
+uint64_t scene_image_writer::add_blob(const void* data, size_t size) {
+    uint64_t offset = image_align(blob.size());
+    blob.resize(offset + size);
+    if (size > 0) memcpy(&blob[offset], data, size);
+    return offset;
+}
+
+int scene_image_writer::add_texture(const shared_ptr<texture>& t) {
+    auto found = texture_ids.find(t.get());
+    if (found != texture_ids.end()) return found->second;
+
+    packed_texture p;
+    memset(&p, 0, sizeof(p));
+    if (dynamic_cast<const solid_color*>(t.get())) {
+        auto c = t->value(0, 0, point3());
+        p.kind = TEX_SOLID;
+        p.d[0] = c.x();
+        p.d[1] = c.y();
+        p.d[2] = c.z();
+    }
+    else if (auto checker = dynamic_cast<const checker_texture*>(t.get())) {
+        // Children first so the loader can resolve them in one forward pass.
+        auto even = add_texture(checker->even);
+        auto odd = add_texture(checker->odd);
+        if (even < 0 || odd < 0) return -1;
+        p.kind = TEX_CHECKER;
+        p.a = even;
+        p.b = odd;
+    }
+    else if (auto noise = dynamic_cast<const noise_texture*>(t.get())) {
+        const auto n = perlin::point_count;
+        p.kind = TEX_NOISE;
+        p.d[0] = noise->scale;
+        p.blob = add_blob(noise->noise.ranvec, n * sizeof(vec3));
+        add_blob(noise->noise.perm_x, n * sizeof(int));
+        add_blob(noise->noise.perm_y, n * sizeof(int));
+        add_blob(noise->noise.perm_z, n * sizeof(int));
+    }
+    else if (auto image = dynamic_cast<const image_texture*>(t.get())) {
+        p.kind = TEX_IMAGE;
+        p.a = image->data ? image->width : 0;
+        p.b = image->data ? image->height : 0;
+        p.blob = add_blob(image->data, static_cast<size_t>(p.a) * p.b * image_texture::bytes_per_pixel);
+        if (image->levels.size() > 1) {
+            // The coarser levels follow level 0 directly so the loader can find them.
+            auto mips = image->levels[1].data;
+            blob.insert(blob.end(), mips, mips + image_texture::mip_chain_size(p.a, p.b));
+        }
+    }
+    else if (auto tiled = dynamic_cast<const tiled_image_texture*>(t.get())) {
+        // Tiles stay out of core; only the path goes into the image.
+        p.kind = TEX_TILED;
+        p.a = static_cast<int32_t>(tiled->tiles_path.size());
+        p.blob = add_blob(tiled->tiles_path.data(), tiled->tiles_path.size());
+    }
+    else if (auto baked = dynamic_cast<const baked_texture*>(t.get())) {
+        // The blocks stay in the .bake file, which the loader rebakes if it is gone.
+        auto source = add_texture(baked->source);
+        if (source < 0) return -1;
+        p.kind = TEX_BAKED;
+        p.a = source;
+        p.b = static_cast<int32_t>(baked->path.size());
+        p.blob = add_blob(&baked->recipe, sizeof(bake_recipe));
+        blob.insert(blob.end(), baked->path.begin(), baked->path.end());
+    }
+    else {
+        std::cerr << "ERROR: scene image: unsupported texture type.\n";
+        return -1;
+    }
+    textures.push_back(p);
+    auto id = static_cast<int>(textures.size()) - 1;
+    texture_ids[t.get()] = id;
+    return id;
+}
+
+int scene_image_writer::add_material(const shared_ptr<material>& m) {
+    auto found = material_ids.find(m.get());
+    if (found != material_ids.end()) return found->second;
+
+    packed_material p;
+    memset(&p, 0, sizeof(p));
+    p.texture = -1;
+    if (auto lambert = dynamic_cast<const lambertian*>(m.get())) {
+        p.kind = MAT_LAMBERTIAN;
+        p.texture = add_texture(lambert->albedo);
+    }
+    else if (auto mt = dynamic_cast<const metal*>(m.get())) {
+        p.kind = MAT_METAL;
+        p.d[0] = mt->albedo.x();
+        p.d[1] = mt->albedo.y();
+        p.d[2] = mt->albedo.z();
+        p.d[3] = mt->fuzz;
+    }
+    else if (auto glass = dynamic_cast<const dielectric*>(m.get())) {
+        p.kind = MAT_DIELECTRIC;
+        p.d[0] = glass->ir;
+        p.d[1] = glass->r;
+        p.d[2] = glass->g;
+        p.d[3] = glass->b;
+    }
+    else if (auto light = dynamic_cast<const diffuse_light*>(m.get())) {
+        p.kind = MAT_DIFFUSE_LIGHT;
+        p.texture = add_texture(light->emit);
+    }
+    else if (auto iso = dynamic_cast<const isotropic*>(m.get())) {
+        p.kind = MAT_ISOTROPIC;
+        p.texture = add_texture(iso->albedo);
+    }
+    else {
+        std::cerr << "ERROR: scene image: unsupported material type.\n";
+        return -1;
+    }
+    if ((p.kind == MAT_LAMBERTIAN || p.kind == MAT_DIFFUSE_LIGHT || p.kind == MAT_ISOTROPIC) && p.texture < 0) return -1;
+    materials.push_back(p);
+    auto id = static_cast<int>(materials.size()) - 1;
+    material_ids[m.get()] = id;
+    return id;
+}
+
+bool scene_image_writer::add_prim(packed_prim prim, const aabb& local_box, bool boundary) {
+    if (boundary) {
+        boundary_prims.push_back(prim);
+    }
+    else {
+        prims.push_back(prim);
+        prim_boxes.push_back(prim.xform < 0 ? local_box : xform_box(xforms[prim.xform], local_box));
+    }
+    return true;
+}
+
+bool scene_image_writer::flatten(const shared_ptr<hittable>& object, int xform, bool boundary) {
+    const hittable* h = object.get();
+    packed_prim p;
+    memset(&p, 0, sizeof(p));
+    p.xform = xform;
+    p.first = -1;
+    aabb bounds;
+
+    if (auto list = dynamic_cast<const hittable_list*>(h)) {
+        for (const auto& child : list->objects) {
+            if (!flatten(child, xform, boundary)) return false;
+        }
+        return true;
+    }
+    if (auto node = dynamic_cast<const bvh_node*>(h)) {
+        // The image carries its own BVH; only the leaves matter.
+        if (!flatten(node->left, xform, boundary)) return false;
+        return node->right == node->left || flatten(node->right, xform, boundary);
+    }
+    if (auto moved = dynamic_cast<const translate*>(h)) {
+        auto x = xform_identity();
+        x.t[0] = moved->offset.x();
+        x.t[1] = moved->offset.y();
+        x.t[2] = moved->offset.z();
+        return flatten(moved->ptr, add_xform(xform, x), boundary);
+    }
+    if (auto rotated = dynamic_cast<const rotate_y*>(h)) {
+        auto x = xform_identity();
+        x.r[0] = rotated->cos_theta;
+        x.r[2] = rotated->sin_theta;
+        x.r[6] = -rotated->sin_theta;
+        x.r[8] = rotated->cos_theta;
+        return flatten(rotated->ptr, add_xform(xform, x), boundary);
+    }
+    if (auto medium = dynamic_cast<const constant_medium*>(h)) {
+        if (boundary) {
+            std::cerr << "ERROR: scene image: nested media are not supported.\n";
+            return false;
+        }
+        p.kind = PRIM_MEDIUM;
+        p.material = add_material(medium->phase_function);
+        p.d[0] = medium->neg_inv_density;
+        p.first = static_cast<int32_t>(boundary_prims.size());
+        if (p.material < 0 || !flatten(medium->boundary, xform, true)) return false;
+        p.count = static_cast<int32_t>(boundary_prims.size()) - p.first;
+        // The medium box is stored in world space already.
+        if (!medium->bounding_box(0, 1, bounds)) return false;
+        p.xform = -1;
+        if (xform >= 0) bounds = xform_box(xforms[xform], bounds);
+        return add_prim(p, bounds, false);
+    }
+    if (auto s = dynamic_cast<const sphere*>(h)) {
+        p.kind = PRIM_SPHERE;
+        p.material = add_material(s->mat_ptr);
+        for (int i = 0; i < 3; i++) p.d[i] = s->center[i];
+        p.d[3] = s->radius;
+    }
+    else if (auto s = dynamic_cast<const moving_sphere*>(h)) {
+        p.kind = PRIM_MOVING_SPHERE;
+        p.material = add_material(s->mat_ptr);
+        for (int i = 0; i < 3; i++) {
+            p.d[i] = s->center0[i];
+            p.d[3 + i] = s->center1[i];
+        }
+        p.d[6] = s->time0;
+        p.d[7] = s->time1;
+        p.d[8] = s->radius;
+    }
+    else if (auto rect = dynamic_cast<const xy_rect*>(h)) {
+        p.kind = PRIM_XY_RECT;
+        p.material = add_material(rect->mp);
+        double d[5] = {rect->x0, rect->x1, rect->y0, rect->y1, rect->k};
+        memcpy(p.d, d, sizeof(d));
+    }
+    else if (auto rect = dynamic_cast<const xz_rect*>(h)) {
+        p.kind = PRIM_XZ_RECT;
+        p.material = add_material(rect->mp);
+        double d[5] = {rect->x0, rect->x1, rect->z0, rect->z1, rect->k};
+        memcpy(p.d, d, sizeof(d));
+    }
+    else if (auto rect = dynamic_cast<const yz_rect*>(h)) {
+        p.kind = PRIM_YZ_RECT;
+        p.material = add_material(rect->mp);
+        double d[5] = {rect->y0, rect->y1, rect->z0, rect->z1, rect->k};
+        memcpy(p.d, d, sizeof(d));
+    }
+    else if (auto b = dynamic_cast<const box*>(h)) {
+        p.kind = PRIM_BOX;
+        p.material = add_material(b->mp);
+        for (int i = 0; i < 3; i++) {
+            p.d[i] = b->box_min[i];
+            p.d[3 + i] = b->box_max[i];
+        }
+    }
+    else if (auto b = dynamic_cast<const oriented_box*>(h)) {
+        auto x = xform_identity();
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) x.r[3 * i + j] = b->axis[j][i];
+            x.t[i] = b->origin[i];
+        }
+        p.kind = PRIM_BOX;
+        p.material = add_material(b->mp);
+        p.xform = add_xform(xform, x);
+        for (int i = 0; i < 3; i++) {
+            p.d[i] = b->box_min[i];
+            p.d[3 + i] = b->box_max[i];
+        }
+        return p.material >= 0 && add_prim(p, aabb(b->box_min, b->box_max), boundary);
+    }
+    else if (auto mesh = dynamic_cast<const triangle_mesh*>(h)) {
+        p.kind = PRIM_TRIANGLE;
+        p.material = add_material(mesh->mat_ptr);
+        if (p.material < 0) return false;
+        const auto& data = *mesh->mesh;
+        for (const auto& tri : data.triangles) {
+            point3 v[3];
+            for (int k = 0; k < 3; k++) {
+                v[k] = data.positions[tri.p[k]];
+                for (int c = 0; c < 3; c++) p.d[3 * k + c] = v[k][c];
+            }
+            p.first = -1;
+            bool has_normals = tri.n[0] >= 0 && tri.n[1] >= 0 && tri.n[2] >= 0;
+            bool has_uvs = tri.t[0] >= 0 && tri.t[1] >= 0 && tri.t[2] >= 0;
+            if (has_normals || has_uvs) {
+                packed_tri_attrib attrib = packed_tri_attrib();
+                attrib.has_normals = has_normals;
+                attrib.has_uvs = has_uvs;
+                for (int k = 0; k < 3; k++) {
+                    if (has_normals) attrib.n[k] = data.normals[tri.n[k]];
+                    if (has_uvs) attrib.uv[k] = data.uvs[tri.t[k]];
+                }
+                p.first = static_cast<int32_t>(tri_attribs.size());
+                tri_attribs.push_back(attrib);
+            }
+            point3 lo(fmin(v[0].x(), fmin(v[1].x(), v[2].x())), fmin(v[0].y(), fmin(v[1].y(), v[2].y())), fmin(v[0].z(), fmin(v[1].z(), v[2].z())));
+            point3 hi(fmax(v[0].x(), fmax(v[1].x(), v[2].x())), fmax(v[0].y(), fmax(v[1].y(), v[2].y())), fmax(v[0].z(), fmax(v[1].z(), v[2].z())));
+            add_prim(p, aabb(lo - vec3(1e-6, 1e-6, 1e-6), hi + vec3(1e-6, 1e-6, 1e-6)), boundary);
+        }
+        return true;
+    }
+    else {
+        std::cerr << "ERROR: scene image: unsupported hittable type.\n";
+        return false;
+    }
+    if (p.material < 0 || !h->bounding_box(0, 1, bounds)) return false;
+    return add_prim(p, bounds, boundary);
+}
+
+bool scene_image_writer::write(const std::string& filename, const hittable_list& world, const render_settings& settings) {
+    for (const auto& object : world.objects) {
+        if (!flatten(object, -1, false)) return false;
+    }
+
+    // Boundary prims go after the BVH prims; media refer to them relative to that point.
+    auto bvh_prims = static_cast<int32_t>(prims.size());
+    for (auto& p : prims) {
+        if (p.kind == PRIM_MEDIUM) p.first += bvh_prims;
+    }
+    prims.insert(prims.end(), boundary_prims.begin(), boundary_prims.end());
+
+    std::vector<int> index;
+    std::vector<flat_bvh_node> nodes;
+    build_flat_bvh(prim_boxes, index, nodes);
+
+    packed_header header = packed_header();
+    header.magic = scene_image_magic;
+    header.version = scene_image_version;
+    header.settings_size = sizeof(render_settings);
+    header.bvh_prims = bvh_prims;
+    header.settings = settings;
+
+    const void* data[SECTION_NUM] = {nodes.data(), index.data(), prims.data(), xforms.data(), tri_attribs.data(), materials.data(), textures.data(), blob.data()};
+    uint64_t counts[SECTION_NUM] = {nodes.size(), index.size(), prims.size(), xforms.size(), tri_attribs.size(), materials.size(), textures.size(), blob.size()};
+    uint64_t sizes[SECTION_NUM] = {sizeof(flat_bvh_node), sizeof(int), sizeof(packed_prim), sizeof(packed_xform), sizeof(packed_tri_attrib),
+                                   sizeof(packed_material), sizeof(packed_texture), 1};
+    uint64_t offset = image_align(sizeof(packed_header));
+    for (int i = 0; i < SECTION_NUM; i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].count = counts[i];
+        header.sections[i].element_size = sizes[i];
+        offset = image_align(offset + counts[i] * sizes[i]);
+    }
+    header.file_size = offset;
+
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        std::cerr << "ERROR: cannot write scene image: " << filename << ".\n";
+        return false;
+    }
+    static const char zeros[scene_image_alignment] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    uint64_t written = sizeof(header);
+    for (int i = 0; i < SECTION_NUM && ok; i++) {
+        ok = fwrite(zeros, 1, header.sections[i].offset - written, f) == header.sections[i].offset - written;
+        auto bytes = counts[i] * sizes[i];
+        ok = ok && (bytes == 0 || fwrite(data[i], 1, bytes, f) == bytes);
+        written = header.sections[i].offset + bytes;
+    }
+    ok = ok && fwrite(zeros, 1, header.file_size - written, f) == header.file_size - written;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) std::cerr << "ERROR: failed writing scene image: " << filename << ".\n";
+    return ok;
+}
+
+bool write_scene_image(const std::string& filename, const hittable_list& world, const render_settings& settings) {
+    scene_image_writer writer;
+    return writer.write(filename, world, settings);
+}
+
+// Read-only mapping of a scene image file.
+class scene_image {
+public:
+    scene_image() : base(nullptr), size(0) {}
+    ~scene_image() {
+        if (base) munmap(base, size);
+    }
+    bool open(const std::string& filename);
+    const packed_header& header() const { return *reinterpret_cast<const packed_header*>(base); }
+    template <typename T>
+    const T* section(int id) const { return reinterpret_cast<const T*>(static_cast<const char*>(base) + header().sections[id].offset); }
+    uint64_t count(int id) const { return header().sections[id].count; }
+private:
+    scene_image(const scene_image&);
+    scene_image& operator =(const scene_image&);
+    bool check_references(std::string& problem) const;
+private:
+    void* base;
+    size_t size;
+};
+
+bool scene_image::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "ERROR: scene image not found: " << filename << ".\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(packed_header)) {
+        ::close(fd);
+        std::cerr << "ERROR: not a scene image: " << filename << ".\n";
+        return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        base = nullptr;
+        std::cerr << "ERROR: cannot map scene image: " << filename << ".\n";
+        return false;
+    }
+
+    const auto& h = header();
+    bool ok = h.magic == scene_image_magic && h.version == scene_image_version && h.settings_size == sizeof(render_settings) && h.file_size == size;
+    const uint64_t sizes[SECTION_NUM] = {sizeof(flat_bvh_node), sizeof(int), sizeof(packed_prim), sizeof(packed_xform), sizeof(packed_tri_attrib),
+                                         sizeof(packed_material), sizeof(packed_texture), 1};
+    for (int i = 0; i < SECTION_NUM && ok; i++) {
+        const auto& s = h.sections[i];
+        ok = s.element_size == sizes[i] && s.offset % scene_image_alignment == 0 && s.offset <= size && s.count <= (size - s.offset) / sizes[i];
+    }
+    ok = ok && h.bvh_prims <= h.sections[SECTION_PRIMS].count;
+    std::string problem;
+    if (ok && !check_references(problem)) {
+        std::cerr << "ERROR: scene image has " << problem << ": " << filename << ".\n";
+        ok = false;
+    }
+    else if (!ok) {
+        std::cerr << "ERROR: scene image is corrupt or from another build: " << filename << ".\n";
+    }
+    if (!ok) {
+        munmap(base, size);
+        base = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// Every index and blob range the tracer follows, checked once so that nothing has to be
+// checked per ray. Sets problem to what is wrong with the first bad entry.
+bool scene_image::check_references(std::string& problem) const {
+    const auto& h = header();
+    const auto blob_size = count(SECTION_BLOB);
+    auto in_blob = [blob_size](uint64_t offset, uint64_t bytes) { return offset <= blob_size && bytes <= blob_size - offset; };
+
+    const auto* tex = section<packed_texture>(SECTION_TEXTURES);
+    const auto textures = count(SECTION_TEXTURES);
+    for (uint64_t i = 0; i < textures; i++) {
+        const auto& t = tex[i];
+        bool ok = false;
+        switch (t.kind) {
+            case TEX_SOLID:
+                ok = true;
+                break;
+            case TEX_CHECKER:
+                // Children are written before their checker.
+                ok = t.a >= 0 && static_cast<uint64_t>(t.a) < i && t.b >= 0 && static_cast<uint64_t>(t.b) < i;
+                break;
+            case TEX_NOISE: {
+                const uint64_t n = perlin::point_count;
+                auto perm = image_align(t.blob + n * sizeof(vec3));
+                ok = t.blob % scene_image_alignment == 0 && in_blob(t.blob, n * sizeof(vec3)) &&
+                     in_blob(perm, 2 * image_align(n * sizeof(int)) + n * sizeof(int));
+                break;
+            }
+            case TEX_IMAGE:
+                if (t.a == 0 && t.b == 0) {
+                    ok = true;
+                }
+                else if (t.a > 0 && t.b > 0) {
+                    ok = in_blob(t.blob, static_cast<uint64_t>(t.a) * t.b * image_texture::bytes_per_pixel + image_texture::mip_chain_size(t.a, t.b));
+                }
+                break;
+            case TEX_TILED:
+                ok = t.a >= 0 && in_blob(t.blob, static_cast<uint64_t>(t.a));
+                break;
+            case TEX_BAKED:
+                ok = t.a >= 0 && static_cast<uint64_t>(t.a) < i && t.b >= 0 && in_blob(t.blob, sizeof(bake_recipe) + static_cast<uint64_t>(t.b));
+                if (ok) {
+                    bake_recipe recipe;
+                    memcpy(&recipe, section<unsigned char>(SECTION_BLOB) + t.blob, sizeof(recipe));
+                    ok = valid_bake_recipe(recipe);
+                }
+                break;
+        }
+        if (!ok) {
+            problem = "a bad texture (" + std::to_string(i) + ")";
+            return false;
+        }
+    }
+
+    const auto* mat = section<packed_material>(SECTION_MATERIALS);
+    const auto materials = count(SECTION_MATERIALS);
+    for (uint64_t i = 0; i < materials; i++) {
+        const auto& m = mat[i];
+        bool textured = m.kind == MAT_LAMBERTIAN || m.kind == MAT_DIFFUSE_LIGHT || m.kind == MAT_ISOTROPIC;
+        bool known = textured || m.kind == MAT_METAL || m.kind == MAT_DIELECTRIC;
+        if (!known || (textured && (m.texture < 0 || static_cast<uint64_t>(m.texture) >= textures))) {
+            problem = "a bad material (" + std::to_string(i) + ")";
+            return false;
+        }
+    }
+
+    const auto* prims = section<packed_prim>(SECTION_PRIMS);
+    const auto prim_count = count(SECTION_PRIMS);
+    for (uint64_t i = 0; i < prim_count; i++) {
+        const auto& p = prims[i];
+        bool ok = p.kind >= PRIM_SPHERE && p.kind <= PRIM_MEDIUM && p.material >= 0 && static_cast<uint64_t>(p.material) < materials &&
+                  p.xform >= -1 && (p.xform < 0 || static_cast<uint64_t>(p.xform) < count(SECTION_XFORMS));
+        if (ok && p.kind == PRIM_TRIANGLE) {
+            ok = p.first >= -1 && (p.first < 0 || static_cast<uint64_t>(p.first) < count(SECTION_TRI_ATTRIBS));
+        }
+        if (ok && p.kind == PRIM_MEDIUM) {
+            // Boundaries lie past the BVH prims and are never media themselves.
+            ok = p.first >= 0 && p.count >= 0 && static_cast<uint64_t>(p.first) >= h.bvh_prims &&
+                 static_cast<uint64_t>(p.first) + p.count <= prim_count;
+            for (int b = p.first; ok && b < p.first + p.count; b++) ok = prims[b].kind != PRIM_MEDIUM;
+        }
+        if (!ok) {
+            problem = "a bad primitive (" + std::to_string(i) + ")";
+            return false;
+        }
+    }
+
+    const auto* index = section<int>(SECTION_INDEX);
+    const auto index_count = count(SECTION_INDEX);
+    for (uint64_t i = 0; i < index_count; i++) {
+        if (index[i] < 0 || static_cast<uint64_t>(index[i]) >= h.bvh_prims) {
+            problem = "a bad BVH index entry (" + std::to_string(i) + ")";
+            return false;
+        }
+    }
+
+    // Children follow their parents, so one forward pass sees every parent of a node before
+    // the node; the traversal stack holds flat_bvh_max_depth levels.
+    const auto* nodes = section<flat_bvh_node>(SECTION_NODES);
+    const auto node_count = count(SECTION_NODES);
+    std::vector<int> depth(node_count, 0);
+    for (uint64_t i = 0; i < node_count; i++) {
+        const auto& n = nodes[i];
+        bool ok;
+        if (n.count > 0) {
+            ok = n.offset >= 0 && static_cast<uint64_t>(n.offset) + n.count <= index_count;
+        }
+        else {
+            ok = n.count == 0 && n.axis >= 0 && n.axis < 3 && i + 1 < node_count && n.offset > 0 && static_cast<uint64_t>(n.offset) > i + 1 &&
+                 static_cast<uint64_t>(n.offset) < node_count && depth[i] < flat_bvh_max_depth;
+            if (ok) {
+                depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+                depth[n.offset] = std::max(depth[n.offset], depth[i] + 1);
+            }
+        }
+        if (!ok) {
+            problem = "a bad BVH node (" + std::to_string(i) + ")";
+            return false;
+        }
+    }
+    return true;
+}
+
+// The world stored in a scene image, traced directly out of the mapping. Only the
+// handful of material and texture objects are created at load; texels and noise
+// tables are used in place.
+class mapped_scene : public hittable {
+public:
+    mapped_scene(shared_ptr<scene_image> _image);
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        if (node_count == 0) return false;
+        output_box = nodes[0].box;
+        return true;
+    }
+    const flat_bvh_node* bvh_nodes() const { return nodes; }
+    uint64_t bvh_node_count() const { return node_count; }
+    // The primitives the BVH reaches come first, bvh_prim_count() of them.
+    const packed_prim* primitives() const { return prims; }
+    uint64_t bvh_prim_count() const { return image->header().bvh_prims; }
+    // Closest hit on the boundary of medium prim `medium`.
+    bool hit_boundary(const packed_prim& medium, const ray& r, double t_min, double t_max, hit_record& rec) const;
+    // Adds where r is inside the boundary of medium prim `medium`, as hittable::hit_spans.
+    bool medium_spans(const packed_prim& medium, const ray& r, ray_spans& spans) const;
+public:
+    shared_ptr<scene_image> image;
+    std::vector<shared_ptr<texture>> textures;
+    std::vector<shared_ptr<material>> materials;
+private:
+    bool hit_prim(const packed_prim& prim, const ray& r, double t_min, double t_max, hit_record& rec) const;
+    bool hit_shape(const packed_prim& prim, const ray& r, double t_min, double t_max, hit_record& rec) const;
+    bool hit_medium(const packed_prim& prim, const ray& r, double t_min, double t_max, hit_record& rec) const;
+    bool prim_spans(const packed_prim& prim, const ray& r, ray_spans& spans) const;
+private:
+    const flat_bvh_node* nodes;
+    const int* index;
+    const packed_prim* prims;
+    const packed_xform* xforms;
+    const packed_tri_attrib* tri_attribs;
+    uint64_t node_count;
+};
+
+mapped_scene::mapped_scene(shared_ptr<scene_image> _image) : image(_image) {
+    nodes = image->section<flat_bvh_node>(SECTION_NODES);
+    node_count = image->count(SECTION_NODES);
+    index = image->section<int>(SECTION_INDEX);
+    prims = image->section<packed_prim>(SECTION_PRIMS);
+    xforms = image->section<packed_xform>(SECTION_XFORMS);
+    tri_attribs = image->section<packed_tri_attrib>(SECTION_TRI_ATTRIBS);
+
+    const auto* blob = image->section<unsigned char>(SECTION_BLOB);
+    const auto* tex = image->section<packed_texture>(SECTION_TEXTURES);
+    for (uint64_t i = 0; i < image->count(SECTION_TEXTURES); i++) {
+        const auto& t = tex[i];
+        switch (t.kind) {
+            case TEX_SOLID:
+                textures.push_back(make_shared<solid_color>(t.d[0], t.d[1], t.d[2]));
+                break;
+            case TEX_CHECKER:
+                textures.push_back(make_shared<checker_texture>(textures[t.a], textures[t.b]));
+                break;
+            case TEX_NOISE: {
+                const auto n = perlin::point_count;
+                auto ranvec = reinterpret_cast<const vec3*>(blob + t.blob);
+                auto perm = reinterpret_cast<const int*>(blob + image_align(t.blob + n * sizeof(vec3)));
+                auto perm_stride = image_align(n * sizeof(int)) / sizeof(int);
+                textures.push_back(make_shared<noise_texture>(t.d[0], ranvec, perm, perm + perm_stride, perm + 2 * perm_stride));
+                break;
+            }
+            case TEX_TILED:
+                textures.push_back(make_shared<tiled_image_texture>(std::string(reinterpret_cast<const char*>(blob + t.blob), t.a)));
+                break;
+            case TEX_BAKED: {
+                bake_recipe recipe;
+                memcpy(&recipe, blob + t.blob, sizeof(recipe));
+                std::string path(reinterpret_cast<const char*>(blob + t.blob) + sizeof(recipe), t.b);
+                textures.push_back(make_shared<baked_texture>(textures[t.a], path, recipe));
+                break;
+            }
+            case TEX_IMAGE:
+                if (t.a > 0) {
+                    auto mips = blob + t.blob + static_cast<size_t>(t.a) * t.b * image_texture::bytes_per_pixel;
+                    textures.push_back(make_shared<image_texture>(blob + t.blob, t.a, t.b, mips));
+                }
+                else {
+                    textures.push_back(make_shared<image_texture>());
+                }
+                break;
+        }
+    }
+
+    const auto* mat = image->section<packed_material>(SECTION_MATERIALS);
+    for (uint64_t i = 0; i < image->count(SECTION_MATERIALS); i++) {
+        const auto& m = mat[i];
+        switch (m.kind) {
+            case MAT_LAMBERTIAN:
+                materials.push_back(make_shared<lambertian>(textures[m.texture]));
+                break;
+            case MAT_METAL:
+                materials.push_back(make_shared<metal>(color(m.d[0], m.d[1], m.d[2]), m.d[3]));
+                break;
+            case MAT_DIELECTRIC:
+                materials.push_back(make_shared<dielectric>(m.d[0], m.d[1], m.d[2], m.d[3]));
+                break;
+            case MAT_DIFFUSE_LIGHT:
+                materials.push_back(make_shared<diffuse_light>(textures[m.texture]));
+                break;
+            case MAT_ISOTROPIC:
+                materials.push_back(make_shared<isotropic>(textures[m.texture]));
+                break;
+        }
+    }
+}
+
+// Intersects in the primitive's own frame; p, normal and t come back in that frame.
+bool mapped_scene::hit_shape(const packed_prim& prim, const ray& r, double t_min, double t_max, hit_record& rec) const {
+    const auto* d = prim.d;
+    switch (prim.kind) {
+        case PRIM_SPHERE:
+        case PRIM_MOVING_SPHERE: {
+            RT_STAT_INC(prim_tests[prim.kind == PRIM_SPHERE ? STAT_PRIM_SPHERE : STAT_PRIM_MOVING_SPHERE]);
+            point3 center;
+            double radius;
+            if (prim.kind == PRIM_SPHERE) {
+                center = point3(d[0], d[1], d[2]);
+                radius = d[3];
+            }
+            else {
+                point3 c0(d[0], d[1], d[2]), c1(d[3], d[4], d[5]);
+                center = c0 + ((r.time() - d[6]) / (d[7] - d[6])) * (c1 - c0);
+                radius = d[8];
+            }
+            vec3 oc = r.origin() - center;
+            auto a = r.direction().length_squared();
+            auto half_b = dot(oc, r.direction());
+            auto c = oc.length_squared() - radius * radius;
+            auto delta = half_b * half_b - a * c;
+            if (delta < 0) return false;
+            auto sqrtdelta = sqrt(delta);
+            auto root = (-half_b - sqrtdelta) / a;
+            if (root < t_min || root > t_max) {
+                root = (-half_b + sqrtdelta) / a;
+                if (root < t_min || root > t_max) return false;
+            }
+            rec.t = root;
+            rec.p = r.at(rec.t);
+            vec3 outward_normal = (rec.p - center) / radius;
+            rec.set_face_normal(r, outward_normal);
+            if (prim.kind == PRIM_SPHERE) {
+                sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+                sphere::get_sphere_derivatives(outward_normal, radius, rec.dpdu, rec.dpdv);
+            }
+            else {
+                rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+            }
+            return true;
+        }
+        case PRIM_XY_RECT:
+        case PRIM_XZ_RECT:
+        case PRIM_YZ_RECT: {
+            RT_STAT_INC(prim_tests[STAT_PRIM_RECT]);
+            // Plane axis k and in-plane axes a, b follow the xy/xz/yz_rect layouts.
+            int k = (prim.kind == PRIM_XY_RECT) ? 2 : (prim.kind == PRIM_XZ_RECT) ? 1 : 0;
+            int a = (prim.kind == PRIM_YZ_RECT) ? 1 : 0;
+            int b = (prim.kind == PRIM_XY_RECT) ? 1 : 2;
+            auto t = (d[4] - r.origin()[k]) / r.direction()[k];
+            if (t < t_min || t > t_max) return false;
+            auto x = r.origin()[a] + t * r.direction()[a];
+            auto y = r.origin()[b] + t * r.direction()[b];
+            if (x < d[0] || x > d[1] || y < d[2] || y > d[3]) return false;
+            rec.u = (x - d[0]) / (d[1] - d[0]);
+            rec.v = (y - d[2]) / (d[3] - d[2]);
+            rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+            rec.dpdu[a] = d[1] - d[0];
+            rec.dpdv[b] = d[3] - d[2];
+            rec.t = t;
+            vec3 outward_normal(0, 0, 0);
+            outward_normal[k] = 1;
+            rec.set_face_normal(r, outward_normal);
+            rec.p = r.at(t);
+            return true;
+        }
+        case PRIM_BOX: {
+            RT_STAT_INC(prim_tests[STAT_PRIM_BOX]);
+            point3 bmin(d[0], d[1], d[2]), bmax(d[3], d[4], d[5]);
+            double t_enter, t_exit;
+            int face_enter, face_exit;
+            if (!box_slabs(r.origin(), r.direction(), bmin, bmax, t_enter, t_exit, face_enter, face_exit)) return false;
+            auto t = t_enter;
+            auto face = face_enter;
+            if (t < t_min || t > t_max) {
+                t = t_exit;
+                face = face_exit;
+                if (t < t_min || t > t_max) return false;
+            }
+            rec.t = t;
+            rec.p = r.at(t);
+            vec3 outward_normal;
+            box_face_attribs(rec.p, bmin, bmax, face, rec.u, rec.v, rec.dpdu, rec.dpdv, outward_normal);
+            rec.set_face_normal(r, outward_normal);
+            return true;
+        }
+        case PRIM_TRIANGLE: {
+            point3 p0(d[0], d[1], d[2]), p1(d[3], d[4], d[5]), p2(d[6], d[7], d[8]);
+            double t, b1, b2;
+            if (!triangle_intersect(p0, p1, p2, r, t_min, t_max, t, b1, b2)) return false;
+            auto b0 = 1.0 - b1 - b2;
+            rec.t = t;
+            rec.p = r.at(t);
+            auto geometric_normal = unit_vector(cross(p1 - p0, p2 - p0));
+            rec.set_face_normal(r, geometric_normal);
+            rec.u = b1;
+            rec.v = b2;
+            rec.dpdu = p1 - p0;
+            rec.dpdv = p2 - p0;
+            if (prim.first >= 0) {
+                const auto& attrib = tri_attribs[prim.first];
+                if (attrib.has_normals) {
+                    auto shading_normal = b0 * attrib.n[0] + b1 * attrib.n[1] + b2 * attrib.n[2];
+                    if (!shading_normal.near_zero()) {
+                        shading_normal = unit_vector(shading_normal);
+                        if (dot(shading_normal, geometric_normal) < 0) shading_normal = -shading_normal;
+                        rec.normal = rec.front_face ? shading_normal : -shading_normal;
+                    }
+                }
+                if (attrib.has_uvs) {
+                    rec.u = b0 * attrib.uv[0].u + b1 * attrib.uv[1].u + b2 * attrib.uv[2].u;
+                    rec.v = b0 * attrib.uv[0].v + b1 * attrib.uv[1].v + b2 * attrib.uv[2].v;
+                    triangle_uv_derivatives(p0, p1, p2, attrib.uv[0], attrib.uv[1], attrib.uv[2], rec.dpdu, rec.dpdv);
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool mapped_scene::hit_prim(const packed_prim& prim, const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (prim.kind == PRIM_MEDIUM) return hit_medium(prim, r, t_min, t_max, rec);
+    if (prim.xform < 0) {
+        if (!hit_shape(prim, r, t_min, t_max, rec)) return false;
+    }
+    else {
+        // Rigid transform: t is the same in both frames, only p and the normal move.
+        const auto& x = xforms[prim.xform];
+        ray local_r(xform_vector_inverse(x, r.origin() - vec3(x.t[0], x.t[1], x.t[2])), xform_vector_inverse(x, r.direction()), r.time());
+        if (!hit_shape(prim, local_r, t_min, t_max, rec)) return false;
+        rec.p = r.at(rec.t);
+        rec.normal = xform_vector(x, rec.normal);
+        rec.dpdu = xform_vector(x, rec.dpdu);
+        rec.dpdv = xform_vector(x, rec.dpdv);
+    }
+    rec.mat_ptr = materials[prim.material];
+    return true;
+}
+
+// Adds the intervals where r is inside a sphere or box prim. Returns false for shapes
+// that do not enclose a volume on their own.
+bool mapped_scene::prim_spans(const packed_prim& prim, const ray& r, ray_spans& spans) const {
+    if (prim.kind != PRIM_SPHERE && prim.kind != PRIM_MOVING_SPHERE && prim.kind != PRIM_BOX) return false;
+    auto local_r = r;
+    if (prim.xform >= 0) {
+        const auto& x = xforms[prim.xform];
+        local_r = ray(xform_vector_inverse(x, r.origin() - vec3(x.t[0], x.t[1], x.t[2])), xform_vector_inverse(x, r.direction()), r.time());
+    }
+    const auto* d = prim.d;
+    double t_enter, t_exit;
+    bool crossed;
+    if (prim.kind == PRIM_BOX) {
+        int face_enter, face_exit;
+        crossed = box_slabs(local_r.origin(), local_r.direction(), point3(d[0], d[1], d[2]), point3(d[3], d[4], d[5]), t_enter, t_exit, face_enter, face_exit);
+    }
+    else if (prim.kind == PRIM_SPHERE) {
+        crossed = sphere_span(point3(d[0], d[1], d[2]), d[3], local_r, t_enter, t_exit);
+    }
+    else {
+        point3 c0(d[0], d[1], d[2]), c1(d[3], d[4], d[5]);
+        crossed = sphere_span(c0 + ((r.time() - d[6]) / (d[7] - d[6])) * (c1 - c0), d[8], local_r, t_enter, t_exit);
+    }
+    if (crossed) spans.add(t_enter, t_exit);
+    return true;
+}
+
+bool mapped_scene::hit_boundary(const packed_prim& medium, const ray& r, double t_min, double t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+    for (int i = medium.first; i < medium.first + medium.count; i++) {
+        if (hit_prim(prims[i], r, t_min, closest_so_far, rec)) {
+            hit_anything = true;
+            closest_so_far = rec.t;
+        }
+    }
+    return hit_anything;
+}
+
+// Sphere and box boundaries give their intervals in one pass; others pair the first two
+// hits, as hittable::hit_spans does.
+bool mapped_scene::medium_spans(const packed_prim& medium, const ray& r, ray_spans& spans) const {
+    ray_spans own;
+    bool direct = true;
+    for (int i = medium.first; direct && i < medium.first + medium.count; i++) {
+        direct = prim_spans(prims[i], r, own);
+    }
+    if (!direct) {
+        hit_record rec1, rec2;
+        if (!hit_boundary(medium, r, -infinity, infinity, rec1)) return false;
+        if (!hit_boundary(medium, r, rec1.t + 0.0001, infinity, rec2)) return false;
+        own = ray_spans();
+        own.add(rec1.t, rec2.t);
+    }
+    for (int i = 0; i < own.count; i++) spans.add(own.enter[i], own.exit[i]);
+    return own.count > 0;
+}
+
+// Same free-flight sampling as constant_medium.
+bool mapped_scene::hit_medium(const packed_prim& prim, const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_STAT_INC(prim_tests[STAT_PRIM_MEDIUM]);
+    ray_spans spans;
+    if (!medium_spans(prim, r, spans)) return false;
+    if (!sample_free_flight(spans, r, t_min, t_max, prim.d[0], rec.t)) return false;
+    rec.p = r.at(rec.t);
+    rec.normal = vec3(1, 0, 0);
+    rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+    rec.front_face = true;
+    rec.mat_ptr = materials[prim.material];
+    return true;
+}
+
+bool mapped_scene::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (node_count == 0) return false;
+    auto hit_item = [&](int i, double& closest) {
+        if (!hit_prim(prims[i], r, t_min, closest, rec)) return false;
+        closest = rec.t;
+        return true;
+    };
+    return traverse_flat_bvh(nodes, index, r, t_min, t_max, hit_item);
+}
+
+// The boundary of a medium in a scene image as a hittable of its own, for code that
+// treats it like constant_medium::boundary. Refers into scene, which must outlive it.
+class mapped_medium_boundary : public hittable {
+public:
+    mapped_medium_boundary(const mapped_scene* _scene, const packed_prim* _medium) : scene(_scene), medium(_medium) {}
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return scene->hit_boundary(*medium, r, t_min, t_max, rec);
+    }
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override { return scene->medium_spans(*medium, r, spans); }
+    // Boundary boxes are not stored; nothing places this in a BVH.
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override { return false; }
+public:
+    const mapped_scene* scene;
+    const packed_prim* medium;
+};
+
+// Maps `filename` and returns its world, or nullptr. settings receives the stored render settings.
+shared_ptr<mapped_scene> load_scene_image(const std::string& filename, render_settings& settings) {
+    trace_span span("map scene image", filename);
+    auto image = make_shared<scene_image>();
+    if (!image->open(filename)) return nullptr;
+    settings = image->header().settings;
+    return make_shared<mapped_scene>(image);
+}
+
+#endif
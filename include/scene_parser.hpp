@@ -0,0 +1,548 @@
+#ifndef SCENE_PARSER_H_
+#define SCENE_PARSER_H_
+
+#include "utils.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "triangle_mesh.hpp"
+#include "obj_loader.hpp"
+#include "constant_medium.hpp"
+#include "heterogeneous_medium.hpp"
+#include "sparse_volume.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include "tiled_texture.hpp"
+#include "baked_texture.hpp"
+#include "render_settings.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Text scene description, one statement per line, '#' starts a comment:
+//
+//   settings width 800 [height 800] [aspect 1] [spp 500] [depth 50]
+//   camera lookfrom 278 278 -800 lookat 278 278 0 [vup 0 1 0] [vfov 40] [aperture 0] [focus 10] [time 0 1]
+//   background 0 0 0
+//   texture <name> solid <r g b> | checker <r g b> <r g b> | checker <even> <odd> | noise <scale> | image <path> | tiled <path>
+//                    | bake <texture> <path.bake> uv <width> <height> <cx cy cz> <radius> [tolerance <t>]
+//                    | bake <texture> <path.bake> bricks <voxel> <x0 y0 z0> <x1 y1 z1> [sphere <cx cy cz> <radius>] [tolerance <t>]
+//   material <name> lambertian <albedo> | metal <r g b> <fuzz> | dielectric <ir> [<r g b>] | diffuse_light <albedo> | isotropic <albedo>
+//   sphere <cx cy cz> <radius> <material>
+//   moving_sphere <c0> <c1> <time0> <time1> <radius> <material>
+//   xy_rect|xz_rect|yz_rect <a0> <a1> <b0> <b1> <k> <material>
+//   box <x0 y0 z0> <x1 y1 z1> <material>
+//   mesh <path.obj> <material> [scale <s>]
+//   medium <density> <albedo> <primitive statement>
+//   volume <path.rtdg|path.rtsv> <density scale> <albedo>
+//
+// settings and camera lines take any render parameter (see render_parameter_size).
+// An <albedo> is either "r g b" or "tex <name>". Any primitive or volume may be
+// followed by "rotate_y <degrees>" and "translate <x y z>" modifiers, applied left to
+// right; a medium boundary may use "none" as its material. Relative paths are resolved
+// against the directory of the scene file. A bake samples a procedural texture over the
+// uvs of the given sphere, or over bricks filling the box (only those the sphere's surface
+// passes through, if given), and caches the result in <path.bake>; see baked_texture.hpp.
+
+struct scene_token {
+    const char* s;
+    int n;
+};
+
+// Reads whitespace separated statements a line at a time and hands each one to
+// statement(). Shared by scene files and batch job files.
+class statement_parser {
+public:
+    statement_parser() : line_no(0), pos(0) {}
+    virtual ~statement_parser() {}
+protected:
+    virtual bool statement() = 0;
+    bool read(const std::string& _filename);
+
+    bool error(const std::string& msg);
+    bool at_end() const { return pos >= tokens.size(); }
+    bool is(const char* word) const;
+    bool is_number() const;
+    bool word(std::string& out);
+    bool number(double& out);
+    bool integer(int& out);
+    bool vector(vec3& out);
+    bool parameter(std::vector<render_parameter>& params);
+    std::string resolve(const std::string& path) const;
+protected:
+    std::string filename;
+    std::string base_dir;
+    int line_no;
+    std::vector<scene_token> tokens;
+    size_t pos;
+};
+
+class scene_parser : public statement_parser {
+public:
+    scene_parser() : world(nullptr), settings(nullptr) {}
+    bool parse(const std::string& _filename, hittable_list& _world, render_settings& _settings);
+protected:
+    virtual bool statement() override;
+private:
+    bool parse_texture();
+    bool parse_material();
+    bool parse_primitive(shared_ptr<hittable>& out, bool boundary);
+    bool parse_modifiers(shared_ptr<hittable>& object, const point3* box_min, const point3* box_max, shared_ptr<material> box_mat);
+    bool parse_albedo(shared_ptr<texture>& out);
+    bool parse_material_ref(shared_ptr<material>& out, bool allow_none);
+private:
+    hittable_list* world;
+    render_settings* settings;
+    std::vector<render_parameter> params;
+    std::unordered_map<std::string, shared_ptr<texture>> textures;
+    std::unordered_map<std::string, shared_ptr<material>> materials;
+    std::unordered_map<std::string, shared_ptr<mesh_data>> meshes;
+};
+
+bool statement_parser::error(const std::string& msg) {
+    std::cerr << "ERROR: " << filename << ":" << line_no << ": " << msg << ".\n";
+    return false;
+}
+
+bool statement_parser::is(const char* w) const {
+    if (at_end()) return false;
+    auto n = strlen(w);
+    return tokens[pos].n == static_cast<int>(n) && strncmp(tokens[pos].s, w, n) == 0;
+}
+
+bool statement_parser::is_number() const {
+    if (at_end()) return false;
+    const char* s = tokens[pos].s;
+    double d;
+    return obj_parse_double(s, tokens[pos].s + tokens[pos].n, d) && s == tokens[pos].s + tokens[pos].n;
+}
+
+bool statement_parser::word(std::string& out) {
+    if (at_end()) return error("unexpected end of statement");
+    out.assign(tokens[pos].s, tokens[pos].n);
+    pos++;
+    return true;
+}
+
+bool statement_parser::number(double& out) {
+    if (at_end()) return error("expected a number");
+    const char* s = tokens[pos].s;
+    const char* end = s + tokens[pos].n;
+    if (!obj_parse_double(s, end, out) || s != end) return error("expected a number, got '" + std::string(tokens[pos].s, tokens[pos].n) + "'");
+    pos++;
+    return true;
+}
+
+bool statement_parser::integer(int& out) {
+    double d;
+    if (!number(d)) return false;
+    out = static_cast<int>(d);
+    if (out != d) return error("expected an integer");
+    return true;
+}
+
+bool statement_parser::vector(vec3& out) {
+    return number(out[0]) && number(out[1]) && number(out[2]);
+}
+
+// Parses one "name value..." render parameter.
+bool statement_parser::parameter(std::vector<render_parameter>& params) {
+    render_parameter p;
+    if (!word(p.name)) return false;
+    auto n = render_parameter_size(p.name);
+    if (n == 0) return error("unknown parameter '" + p.name + "'");
+    for (int i = 0; i < n; i++) {
+        if (!number(p.value[i])) return false;
+    }
+    if ((p.name == "width" || p.name == "height" || p.name == "spp" || p.name == "depth") && p.value[0] < 1) {
+        return error(p.name + " must be positive");
+    }
+    params.push_back(p);
+    return true;
+}
+
+std::string statement_parser::resolve(const std::string& path) const {
+    if (path.empty() || path[0] == '/' || base_dir.empty()) return path;
+    return base_dir + "/" + path;
+}
+
+bool scene_parser::parse_albedo(shared_ptr<texture>& out) {
+    if (is("tex")) {
+        pos++;
+        std::string name;
+        if (!word(name)) return false;
+        auto found = textures.find(name);
+        if (found == textures.end()) return error("unknown texture '" + name + "'");
+        out = found->second;
+        return true;
+    }
+    color c;
+    if (!vector(c)) return false;
+    out = make_shared<solid_color>(c);
+    return true;
+}
+
+bool scene_parser::parse_texture() {
+    std::string name, type;
+    if (!word(name) || !word(type)) return false;
+    shared_ptr<texture> tex;
+    if (type == "solid") {
+        color c;
+        if (!vector(c)) return false;
+        tex = make_shared<solid_color>(c);
+    }
+    else if (type == "checker") {
+        if (is_number()) {
+            color even, odd;
+            if (!vector(even) || !vector(odd)) return false;
+            tex = make_shared<checker_texture>(even, odd);
+        }
+        else {
+            std::string even, odd;
+            if (!word(even) || !word(odd)) return false;
+            if (!textures.count(even) || !textures.count(odd)) return error("unknown checker child texture");
+            tex = make_shared<checker_texture>(textures[even], textures[odd]);
+        }
+    }
+    else if (type == "noise") {
+        double scale;
+        if (!number(scale)) return false;
+        tex = make_shared<noise_texture>(scale);
+    }
+    else if (type == "image") {
+        std::string path;
+        if (!word(path)) return false;
+        tex = make_shared<image_texture>(resolve(path).c_str());
+    }
+    else if (type == "tiled") {
+        std::string path;
+        if (!word(path)) return false;
+        tex = make_shared<tiled_image_texture>(resolve(path));
+    }
+    else if (type == "bake") {
+        std::string source, path, kind;
+        if (!word(source) || !word(path) || !word(kind)) return false;
+        if (!textures.count(source)) return error("unknown texture '" + source + "'");
+        auto recipe = default_bake_recipe();
+        vec3 center, box_min, box_max;
+        if (kind == "uv") {
+            recipe.kind = BAKE_UV;
+            if (!integer(recipe.width) || !integer(recipe.height) || !vector(center) || !number(recipe.radius)) return false;
+            if (recipe.width <= 0 || recipe.height <= 0 || recipe.width % baked_block_size != 0 || recipe.height % baked_block_size != 0) {
+                return error("uv bake sizes must be positive multiples of " + std::to_string(baked_block_size));
+            }
+        }
+        else if (kind == "bricks") {
+            recipe.kind = BAKE_BRICKS;
+            if (!number(recipe.voxel) || !vector(box_min) || !vector(box_max)) return false;
+            if (recipe.voxel <= 0) return error("bake voxel size must be positive");
+            if (box_min.x() >= box_max.x() || box_min.y() >= box_max.y() || box_min.z() >= box_max.z()) return error("empty bake box");
+            if (is("sphere")) {
+                pos++;
+                recipe.on_sphere = 1;
+                if (!vector(center) || !number(recipe.radius)) return false;
+            }
+        }
+        else {
+            return error("unknown bake kind '" + kind + "'");
+        }
+        if ((kind == "uv" || recipe.on_sphere) && recipe.radius <= 0) return error("bake sphere radius must be positive");
+        if (is("tolerance")) {
+            pos++;
+            if (!number(recipe.tolerance)) return false;
+            if (recipe.tolerance < 0) return error("bake tolerance must not be negative");
+        }
+        for (int a = 0; a < 3; a++) {
+            recipe.center[a] = center[a];
+            recipe.box_min[a] = box_min[a];
+            recipe.box_max[a] = box_max[a];
+        }
+        tex = make_shared<baked_texture>(textures[source], resolve(path), recipe);
+    }
+    else {
+        return error("unknown texture type '" + type + "'");
+    }
+    textures[name] = tex;
+    return true;
+}
+
+bool scene_parser::parse_material() {
+    std::string name, type;
+    if (!word(name) || !word(type)) return false;
+    shared_ptr<material> mat;
+    shared_ptr<texture> tex;
+    if (type == "lambertian") {
+        if (!parse_albedo(tex)) return false;
+        mat = make_shared<lambertian>(tex);
+    }
+    else if (type == "metal") {
+        color albedo;
+        double fuzz;
+        if (!vector(albedo) || !number(fuzz)) return false;
+        mat = make_shared<metal>(albedo, fuzz);
+    }
+    else if (type == "dielectric") {
+        double ir;
+        color tint(1, 1, 1);
+        if (!number(ir)) return false;
+        if (!at_end() && !vector(tint)) return false;
+        mat = make_shared<dielectric>(ir, tint.x(), tint.y(), tint.z());
+    }
+    else if (type == "diffuse_light") {
+        if (!parse_albedo(tex)) return false;
+        mat = make_shared<diffuse_light>(tex);
+    }
+    else if (type == "isotropic") {
+        if (!parse_albedo(tex)) return false;
+        mat = make_shared<isotropic>(tex);
+    }
+    else {
+        return error("unknown material type '" + type + "'");
+    }
+    materials[name] = mat;
+    return true;
+}
+
+bool scene_parser::parse_material_ref(shared_ptr<material>& out, bool allow_none) {
+    std::string name;
+    if (!word(name)) return false;
+    if (allow_none && name == "none") {
+        out = nullptr;
+        return true;
+    }
+    auto found = materials.find(name);
+    if (found == materials.end()) return error("unknown material '" + name + "'");
+    out = found->second;
+    return true;
+}
+
+// Applies trailing rotate_y/translate modifiers. Boxes keep a rigid frame and come out
+// as a single oriented_box; everything else is wrapped in rotate_y/translate.
+bool scene_parser::parse_modifiers(shared_ptr<hittable>& object, const point3* box_min, const point3* box_max, shared_ptr<material> box_mat) {
+    vec3 axis_x(1, 0, 0), axis_z(0, 0, 1);
+    point3 origin(0, 0, 0);
+    bool moved = false;
+    while (!at_end()) {
+        std::string key;
+        word(key);
+        if (key == "rotate_y") {
+            double angle;
+            if (!number(angle)) return false;
+            if (box_min) {
+                // Same convention as rotate_y: x' = cos x + sin z, z' = -sin x + cos z.
+                auto c = cos(degrees_to_radians(angle));
+                auto s = sin(degrees_to_radians(angle));
+                auto rot = [c, s](const vec3& v) { return vec3(c * v.x() + s * v.z(), v.y(), -s * v.x() + c * v.z()); };
+                axis_x = rot(axis_x);
+                axis_z = rot(axis_z);
+                origin = rot(origin);
+                moved = true;
+            }
+            else {
+                object = make_shared<rotate_y>(object, angle);
+            }
+        }
+        else if (key == "translate") {
+            vec3 offset;
+            if (!vector(offset)) return false;
+            if (box_min) {
+                origin += offset;
+                moved = true;
+            }
+            else {
+                object = make_shared<translate>(object, offset);
+            }
+        }
+        else {
+            return error("unknown modifier '" + key + "'");
+        }
+    }
+    if (box_min && moved) {
+        object = make_shared<oriented_box>(*box_min, *box_max, axis_x, cross(axis_z, axis_x), origin, box_mat);
+    }
+    return true;
+}
+
+bool scene_parser::parse_primitive(shared_ptr<hittable>& out, bool boundary) {
+    std::string type;
+    if (!word(type)) return false;
+    shared_ptr<material> mat;
+    if (type == "sphere") {
+        point3 center;
+        double radius;
+        if (!vector(center) || !number(radius) || !parse_material_ref(mat, boundary)) return false;
+        out = make_shared<sphere>(center, radius, mat);
+    }
+    else if (type == "moving_sphere") {
+        point3 c0, c1;
+        double t0, t1, radius;
+        if (!vector(c0) || !vector(c1) || !number(t0) || !number(t1) || !number(radius) || !parse_material_ref(mat, boundary)) return false;
+        out = make_shared<moving_sphere>(c0, c1, t0, t1, radius, mat);
+    }
+    else if (type == "xy_rect" || type == "xz_rect" || type == "yz_rect") {
+        double a0, a1, b0, b1, k;
+        if (!number(a0) || !number(a1) || !number(b0) || !number(b1) || !number(k) || !parse_material_ref(mat, boundary)) return false;
+        if (type == "xy_rect") out = make_shared<xy_rect>(a0, a1, b0, b1, k, mat);
+        else if (type == "xz_rect") out = make_shared<xz_rect>(a0, a1, b0, b1, k, mat);
+        else out = make_shared<yz_rect>(a0, a1, b0, b1, k, mat);
+    }
+    else if (type == "box") {
+        point3 p0, p1;
+        if (!vector(p0) || !vector(p1) || !parse_material_ref(mat, boundary)) return false;
+        out = make_shared<box>(p0, p1, mat);
+        return parse_modifiers(out, &p0, &p1, mat);
+    }
+    else if (type == "mesh") {
+        std::string path;
+        double scale = 1.0;
+        if (!word(path) || !parse_material_ref(mat, boundary)) return false;
+        if (is("scale")) {
+            pos++;
+            if (!number(scale)) return false;
+        }
+        // Instances of the same file and scale share one mesh_data.
+        auto key = resolve(path) + "@" + std::to_string(scale);
+        auto& data = meshes[key];
+        if (!data) {
+            data = make_shared<mesh_data>();
+            if (!load_obj(resolve(path), *data)) return error("cannot load mesh '" + path + "'");
+            if (scale != 1.0) {
+                for (auto& p : data->positions) p *= scale;
+            }
+        }
+        out = make_shared<triangle_mesh>(data, mat);
+    }
+    else {
+        return error("unknown statement '" + type + "'");
+    }
+    return parse_modifiers(out, nullptr, nullptr, nullptr);
+}
+
+bool scene_parser::statement() {
+    std::string keyword(tokens[0].s, tokens[0].n);
+    if (keyword == "settings" || keyword == "camera") {
+        pos = 1;
+        while (!at_end()) {
+            if (!parameter(params)) return false;
+        }
+        return true;
+    }
+    if (keyword == "background" || keyword == "texture" || keyword == "material" || keyword == "medium" || keyword == "volume") {
+        pos = 1;
+    }
+    if (keyword == "background") {
+        render_parameter p;
+        p.name = keyword;
+        for (int i = 0; i < 3; i++) {
+            if (!number(p.value[i])) return false;
+        }
+        params.push_back(p);
+    }
+    else if (keyword == "texture") {
+        if (!parse_texture()) return false;
+    }
+    else if (keyword == "material") {
+        if (!parse_material()) return false;
+    }
+    else if (keyword == "medium") {
+        double density;
+        shared_ptr<texture> albedo;
+        shared_ptr<hittable> boundary;
+        if (!number(density) || !parse_albedo(albedo) || !parse_primitive(boundary, true)) return false;
+        world->add(make_shared<constant_medium>(boundary, density, albedo));
+    }
+    else if (keyword == "volume") {
+        std::string path;
+        double scale;
+        shared_ptr<texture> albedo;
+        if (!word(path) || !number(scale) || !parse_albedo(albedo)) return false;
+        shared_ptr<density_field> field;
+        bool sparse = path.size() > 5 && path.compare(path.size() - 5, 5, ".rtsv") == 0;
+        if (sparse) field = load_sparse_volume(resolve(path));
+        else field = load_density_grid(resolve(path));
+        if (!field) return error("cannot load volume '" + path + "'");
+        shared_ptr<hittable> object = make_shared<heterogeneous_medium>(field, scale, albedo);
+        if (!parse_modifiers(object, nullptr, nullptr, nullptr)) return false;
+        world->add(object);
+    }
+    else {
+        shared_ptr<hittable> object;
+        if (!parse_primitive(object, false)) return false;
+        world->add(object);
+    }
+    if (!at_end()) return error("unexpected '" + std::string(tokens[pos].s, tokens[pos].n) + "'");
+    return true;
+}
+
+// Streams the file through a fixed buffer a line at a time, so large scenes never
+// need to be held in memory as text.
+bool statement_parser::read(const std::string& _filename) {
+    filename = _filename;
+    auto slash = filename.find_last_of('/');
+    base_dir = (slash == std::string::npos) ? "" : filename.substr(0, slash);
+    line_no = 0;
+
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        std::cerr << "ERROR: file not found: " << filename << ".\n";
+        return false;
+    }
+    std::vector<char> buf(1 << 16);
+    size_t have = 0;
+    bool eof = false;
+    bool ok = true;
+    while (ok) {
+        if (!eof) {
+            if (have == buf.size()) buf.resize(buf.size() * 2);
+            auto n = fread(&buf[have], 1, buf.size() - have, f);
+            have += n;
+            eof = (n == 0);
+        }
+        size_t start = 0;
+        while (ok) {
+            auto nl = start < have ? static_cast<char*>(memchr(buf.data() + start, '\n', have - start)) : nullptr;
+            if (!nl && !(eof && start < have)) break;
+            const char* s = buf.data() + start;
+            const char* end = nl ? nl : buf.data() + have;
+            line_no++;
+            tokens.clear();
+            while (s < end && *s != '#') {
+                while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) s++;
+                if (s >= end || *s == '#') break;
+                const char* t = s;
+                while (s < end && *s != ' ' && *s != '\t' && *s != '\r' && *s != '#') s++;
+                scene_token tok = {t, static_cast<int>(s - t)};
+                tokens.push_back(tok);
+            }
+            pos = 0;
+            if (!tokens.empty()) ok = statement();
+            start = nl ? static_cast<size_t>(nl - buf.data()) + 1 : have;
+        }
+        if (eof && (start >= have || !ok)) break;
+        memmove(buf.data(), buf.data() + start, have - start);
+        have -= start;
+    }
+    fclose(f);
+    return ok;
+}
+
+bool scene_parser::parse(const std::string& _filename, hittable_list& _world, render_settings& _settings) {
+    world = &_world;
+    settings = &_settings;
+    params.clear();
+    if (!read(_filename)) return false;
+    apply_render_parameters(*settings, params);
+    return true;
+}
+
+bool load_scene_file(const std::string& filename, hittable_list& world, render_settings& settings) {
+    scene_parser parser;
+    return parser.parse(filename, world, settings);
+}
+
+#endif
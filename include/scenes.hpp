@@ -0,0 +1,287 @@
+#ifndef SCENES_H_
+#define SCENES_H_
+
+#include "utils.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "material.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "constant_medium.hpp"
+#include "heterogeneous_medium.hpp"
+#include "perlin.hpp"
+#include "render_settings.hpp"
+#include "scene_generator.hpp"
+#include <string>
+
+// Scenes built in code. Scene files (scene_parser.hpp) cover everything else.
+
+// Directory holding Tex.jpg/Tex2.jpg; CMake points it at the source tree.
+#ifndef RT_ASSET_DIR
+#define RT_ASSET_DIR "."
+#endif
+
+hittable_list two_spheres() {
+    hittable_list objects;
+    auto checker = make_shared<checker_texture>(color(0.91, 0.17, 0.36), color(0.99, 0.79, 0.33));
+    objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
+    objects.add(make_shared<sphere>(point3(0,  10, 0), 10, make_shared<lambertian>(checker)));
+    return objects;
+}
+
+hittable_list two_perlin_spheres() {
+    hittable_list objects;
+
+    auto pertext = make_shared<noise_texture>(10);
+    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
+    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    return objects;
+}
+
+hittable_list simple_light() {
+    hittable_list objects;
+    
+    auto material1 = make_shared<dielectric>(1.5);
+    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    auto pertext = make_shared<noise_texture>(5);
+    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
+    objects.add(make_shared<sphere>(point3(5, 1, 3), 1, material1));
+    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, material2));
+    objects.add(make_shared<sphere>(point3(0, 2, 5), 2, material3));
+    objects.add(make_shared<sphere>(point3(12, 1, 2.5), 1, material1));
+    objects.add(make_shared<sphere>(point3(12, 1, 2.5), -0.999, material1));
+    objects.add(make_shared<xy_rect>(6, 8, 0, 2, 5.5, material3));
+    auto difflight = make_shared<diffuse_light>(color(5, 5, 5));
+    // objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    // objects.add(make_shared<xy_rect>(3, 5, 1, 3, 4, difflight));
+    objects.add(make_shared<sphere>(point3(8, 0.3, 4), 0.3, difflight));
+    objects.add(make_shared<xy_rect>(-10, 10, 0, 20, -4, difflight));
+    
+    return objects;
+}
+
+hittable_list cornell_box() {
+    hittable_list objects;
+
+    auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
+    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+    auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
+    auto light = make_shared<diffuse_light>(color(8, 8, 8));
+    auto mirror = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    auto glass = make_shared<dielectric>(1.1);
+    auto img_tex = make_shared<image_texture>(RT_ASSET_DIR "/Tex.jpg");
+    auto img_mat = make_shared<lambertian>(img_tex);
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<xz_rect>(152.5, 402.5, 152.5, 402.5, 554, light));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, img_mat));
+
+    // objects.add(make_shared<box>(point3(130, 0.01, 65), point3(295, 165, 230), glass));
+    // objects.add(make_shared<box>(point3(265, 0, 295), point3(430, 330, 460), mirror));
+    shared_ptr<hittable> box1 = make_shared<oriented_box>(point3(0, 0, 0), point3(180, 360, 180), 30, vec3(265, 0.01, 295), glass);
+    shared_ptr<hittable> box2 = make_shared<oriented_box>(point3(0, 0, 0), point3(180, 180, 180), -15, vec3(130, 0.01, 65), mirror);
+
+    objects.add(box1);
+    objects.add(box2);
+
+    return objects;
+}
+
+hittable_list smoke_box() {
+    hittable_list objects;
+    auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
+    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+    auto blue = make_shared<lambertian>(color(0.08, 0.13, 0.72));
+    auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
+    auto light = make_shared<diffuse_light>(color(8, 8, 8));    
+    auto img_tex = make_shared<image_texture>(RT_ASSET_DIR "/Tex2.jpg");
+    auto img_mat = make_shared<lambertian>(img_tex);
+    auto glass = make_shared<dielectric>(1.2);
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<xz_rect>(152.5, 402.5, 152.5, 402.5, 554.9, light));
+    objects.add(make_shared<yz_rect>(350, 500, 152.5, 402.5, 554.9, light));
+    objects.add(make_shared<yz_rect>(350, 500, 152.5, 402.5, 0.1, light));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, img_mat));
+    
+    shared_ptr<hittable> box2 = make_shared<oriented_box>(point3(0, 0, 0), point3(180, 180, 180), -15, vec3(130, 0.01, 65), glass);
+    objects.add(box2);
+    shared_ptr<hittable> box1 = make_shared<oriented_box>(point3(0, 0, 0), point3(180, 240, 180), 30, vec3(265, 0.01, 295), white);
+    objects.add(make_shared<constant_medium>(box1, 0.005, color(1, 1, 1)));
+
+    shared_ptr<hittable> sphere1 = make_shared<sphere>(point3(120, 360, 120), 90, white);
+    objects.add(make_shared<constant_medium>(sphere1, 0.02, color(0, 0, 0)));
+    return objects;
+}
+
+// A cloud: a turbulent ball of n^3 density samples that thins out towards its edge.
+shared_ptr<density_grid> cloud_grid(const point3& center, double radius, int n) {
+    auto r = vec3(radius, radius, radius);
+    auto grid = make_shared<density_grid>(n, n, n, aabb(center - r, center + r));
+    perlin noise;
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                auto p = grid->vertex(i, j, k);
+                auto falloff = 1 - (p - center).length() / radius;
+                auto d = falloff + 0.6 * noise.turb(p * (4 / radius), 6) - 0.45;
+                grid->at(i, j, k) = static_cast<float>(std::max(0.0, std::min(1.0, 2 * d)));
+            }
+        }
+    }
+    return grid;
+}
+
+// The Cornell box with a heterogeneous cloud instead of the boxes.
+hittable_list cloud_box() {
+    hittable_list objects;
+    auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
+    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+    auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
+    auto light = make_shared<diffuse_light>(color(8, 8, 8));
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<xz_rect>(152.5, 402.5, 152.5, 402.5, 554, light));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<heterogeneous_medium>(cloud_grid(point3(278, 260, 278), 200, 96), 0.05, color(0.9, 0.9, 0.9)));
+    return objects;
+}
+
+hittable_list random_scene() {
+    hittable_list world;
+    // auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto checker = make_shared<checker_texture>(color(0.91, 0.17, 0.36), color(0.99, 0.79, 0.33));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_material = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+                if (choose_material < 0.5) {
+                    auto albedo = color::random();
+                    sphere_material = make_shared<lambertian>(albedo);
+                    auto center2 = center + vec3(0, random_double(0, 0.5), 0);
+                    world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
+                }
+                else if (choose_material < 0.75) {
+                    auto albedo = color::random(0.5, 1.0);
+                    auto fuzz = random_double(0.0, 0.25);
+                    sphere_material = make_shared<metal>(albedo, fuzz);
+                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                }
+                else {
+                    sphere_material = make_shared<dielectric>(1.5, 1.0, 0.78, 0.86);
+                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = make_shared<dielectric>(1.5);
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    // world.add(make_shared<sphere>(point3(0, 1, 0), -0.99, material1));
+
+    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+// Builds the named scene together with its camera and render settings.
+// "scalable:<options>" is generate_scene's, with options as for parse_scene_generator_options.
+bool builtin_scene(const std::string& name, hittable_list& world, render_settings& settings) {
+    if (name == "scalable" || name.compare(0, 9, "scalable:") == 0) {
+        scene_generator_options options;
+        if (name.size() > 9 && !parse_scene_generator_options(name.substr(9), options)) return false;
+        world = generate_scene(options, settings);
+        return true;
+    }
+
+    settings = render_settings();
+    settings.vfov = 40.0;
+    settings.aperture = 0.0;
+    settings.background = color(0, 0, 0);
+
+    if (name == "random_scene") {
+        world = random_scene();
+        settings.background = color(0.70, 0.80, 1.00);
+        settings.lookfrom = point3(13, 2, 3);
+        settings.lookat = point3(0, 0, 0);
+        settings.vfov = 20.0;
+        settings.aperture = 0.1;
+    }
+    else if (name == "two_spheres") {
+        world = two_spheres();
+        settings.background = color(0.70, 0.80, 1.00);
+        settings.lookfrom = point3(13, 2, 3);
+        settings.lookat = point3(0, 0, 0);
+        settings.vfov = 20.0;
+    }
+    else if (name == "two_perlin_spheres") {
+        world = two_perlin_spheres();
+        settings.background = color(0.70, 0.80, 1.00);
+        settings.lookfrom = point3(13, 2, 3);
+        settings.lookat = point3(0, 0, 0);
+        settings.vfov = 20.0;
+    }
+    else if (name == "simple_light") {
+        world = simple_light();
+        settings.lookfrom = point3(26, 3, 2);
+        settings.lookat = point3(0, 2, 0);
+        settings.background = color(0, 0, 0);
+        settings.vfov = 20.0;
+    }
+    else if (name == "cornell_box") {
+        world = cornell_box();
+        settings.aspect_ratio = 1.0;
+        settings.set_image_width(800);
+        settings.samples_per_pixel = 500;
+        settings.background = color(0, 0, 0);
+        settings.lookfrom = point3(278, 278, -800);
+        settings.lookat = point3(278, 278, 0);
+        settings.vfov = 40.0;
+    }
+    else if (name == "cloud_box") {
+        world = cloud_box();
+        settings.aspect_ratio = 1.0;
+        settings.set_image_width(600);
+        settings.samples_per_pixel = 500;
+        settings.background = color(0, 0, 0);
+        settings.lookfrom = point3(278, 278, -800);
+        settings.lookat = point3(278, 278, 0);
+        settings.vfov = 40.0;
+    }
+    else if (name == "smoke_box") {
+        world = smoke_box();
+        settings.aspect_ratio = 1.0;
+        settings.set_image_width(1000);
+        settings.samples_per_pixel = 500;
+        settings.background = color(0, 0, 0);
+        settings.lookfrom = point3(278, 278, -800);
+        settings.lookat = point3(278, 278, 0);
+        settings.vfov = 40.0;
+    }
+    else {
+        std::cerr << "ERROR: unknown builtin scene: " << name << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
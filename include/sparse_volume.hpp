@@ -0,0 +1,444 @@
+#ifndef SPARSE_VOLUME_H_
+#define SPARSE_VOLUME_H_
+
+#include "utils.hpp"
+#include "aabb.hpp"
+#include "heterogeneous_medium.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sparse density volumes. Voxels are grouped into 8^3 leaves and leaves into 16^3 nodes
+// (128^3 voxels); a dense top table over the active region points at the nodes. Only
+// leaves holding a nonzero voxel are stored, each quantized to 8 bits between its own
+// min and max, so a voxel costs about a byte wherever the volume is not empty. Leaves
+// and nodes keep their max for majorants and empty-space skipping. The in-memory form
+// is the file (.rtsv) byte for byte, so large volumes are simply mapped.
+
+const uint32_t sparse_volume_magic = 0x56535452;  // "RTSV"
+const uint32_t sparse_volume_version = 1;
+const int sparse_leaf_log2 = 3;
+const int sparse_node_log2 = 4;
+const int sparse_leaf_dim = 1 << sparse_leaf_log2;                          // Voxels per leaf side
+const int sparse_node_dim = 1 << sparse_node_log2;                          // Leaves per node side
+const int sparse_node_span = 1 << (sparse_leaf_log2 + sparse_node_log2);    // Voxels per node side
+
+struct sparse_volume_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t top_origin[3];      // Voxel index of the top table's first corner, a multiple of sparse_node_span
+    int32_t top_dims[3];        // Top table size in nodes
+    int32_t active_min[3];      // Voxel index range holding nonzero voxels, inclusive
+    int32_t active_max[3];
+    uint32_t node_count;
+    uint32_t leaf_count;
+    double origin[3];           // World position of voxel (0, 0, 0)
+    double voxel_size[3];
+    uint64_t top_offset;        // int32 node index per top cell, -1 for empty
+    uint64_t node_offset;
+    uint64_t leaf_offset;
+    uint64_t file_size;
+};
+
+struct sparse_volume_node {
+    float max;
+    int32_t leaves[sparse_node_dim * sparse_node_dim * sparse_node_dim];     // -1 for empty, x fastest
+};
+
+struct sparse_volume_leaf {
+    float min;
+    float max;
+    uint8_t values[sparse_leaf_dim * sparse_leaf_dim * sparse_leaf_dim];    // min + v * (max - min) / 255, x fastest
+};
+
+class sparse_volume : public density_field {
+public:
+    sparse_volume() : base(nullptr), mapped_size(0), hdr(nullptr), top(nullptr), nodes(nullptr), leaves(nullptr) {}
+    ~sparse_volume() {
+        if (mapped_size) munmap(base, mapped_size);
+    }
+    bool open(const std::string& filename);
+    bool adopt(std::vector<unsigned char>& bytes);
+
+    const sparse_volume_header& header() const { return *hdr; }
+    // Voxel (i, j, k), 0 where nothing is stored.
+    double voxel(int i, int j, int k) const;
+
+    virtual double density(const point3& p) const override;
+    virtual double max_density(const aabb& box) const override;
+    virtual aabb bounds() const override;
+    virtual int majorant_cells() const override;
+private:
+    bool attach(unsigned char* data, size_t size);
+    const sparse_volume_leaf* leaf(int i, int j, int k) const;
+    static double leaf_value(const sparse_volume_leaf* l, int i, int j, int k) {
+        auto q = l->values[(((k & (sparse_leaf_dim - 1)) << sparse_leaf_log2 | (j & (sparse_leaf_dim - 1))) << sparse_leaf_log2) | (i & (sparse_leaf_dim - 1))];
+        return l->min + q * ((l->max - l->min) * (1.0 / 255));
+    }
+private:
+    std::vector<unsigned char> owned;
+    unsigned char* base;
+    size_t mapped_size;
+    const sparse_volume_header* hdr;
+    const int32_t* top;
+    const sparse_volume_node* nodes;
+    const sparse_volume_leaf* leaves;
+
+    sparse_volume(const sparse_volume&);
+    sparse_volume& operator=(const sparse_volume&);
+};
+
+// Checks every index lookups follow, so that they need no checks of their own.
+bool sparse_volume::attach(unsigned char* data, size_t size) {
+    base = data;
+    hdr = reinterpret_cast<const sparse_volume_header*>(data);
+    const auto& h = *hdr;
+    bool ok = size >= sizeof(sparse_volume_header) && h.magic == sparse_volume_magic && h.version == sparse_volume_version && h.file_size == size;
+    for (int a = 0; ok && a < 3; a++) ok = h.top_dims[a] >= 0 && h.top_origin[a] % sparse_node_span == 0 && h.voxel_size[a] > 0;
+    auto in_file = [size](uint64_t offset, uint64_t count, uint64_t element) {
+        return offset % sizeof(int32_t) == 0 && offset <= size && count <= (size - offset) / element;
+    };
+    uint64_t top_cells = 0;
+    if (ok) {
+        top_cells = static_cast<uint64_t>(h.top_dims[0]) * h.top_dims[1] * h.top_dims[2];
+        ok = in_file(h.top_offset, top_cells, sizeof(int32_t)) && in_file(h.node_offset, h.node_count, sizeof(sparse_volume_node))
+             && in_file(h.leaf_offset, h.leaf_count, sizeof(sparse_volume_leaf));
+    }
+    // max_density walks the top table over the active range unchecked. An empty range
+    // (min past max on any axis) is never walked.
+    bool empty = false;
+    for (int a = 0; ok && a < 3; a++) empty = empty || h.active_min[a] > h.active_max[a];
+    for (int a = 0; ok && !empty && a < 3; a++) {
+        ok = h.active_min[a] >= h.top_origin[a]
+             && static_cast<int64_t>(h.active_max[a]) - h.top_origin[a] < static_cast<int64_t>(h.top_dims[a]) * sparse_node_span;
+    }
+    if (!ok) return false;
+    top = reinterpret_cast<const int32_t*>(data + h.top_offset);
+    nodes = reinterpret_cast<const sparse_volume_node*>(data + h.node_offset);
+    leaves = reinterpret_cast<const sparse_volume_leaf*>(data + h.leaf_offset);
+
+    for (uint64_t c = 0; c < top_cells; c++) {
+        if (top[c] < -1 || (top[c] >= 0 && static_cast<uint32_t>(top[c]) >= h.node_count)) return false;
+    }
+    const int node_leaves = sparse_node_dim * sparse_node_dim * sparse_node_dim;
+    for (uint32_t n = 0; n < h.node_count; n++) {
+        for (int l = 0; l < node_leaves; l++) {
+            auto leaf = nodes[n].leaves[l];
+            if (leaf < -1 || (leaf >= 0 && static_cast<uint32_t>(leaf) >= h.leaf_count)) return false;
+        }
+    }
+    return true;
+}
+
+bool sparse_volume::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "ERROR: sparse volume not found: " << filename << ".\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(sparse_volume_header)) {
+        ::close(fd);
+        std::cerr << "ERROR: not a sparse volume: " << filename << ".\n";
+        return false;
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "ERROR: cannot map sparse volume: " << filename << ".\n";
+        return false;
+    }
+    mapped_size = size;
+    if (!attach(static_cast<unsigned char*>(data), size)) {
+        std::cerr << "ERROR: sparse volume is corrupt: " << filename << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// Takes over a volume built in memory.
+bool sparse_volume::adopt(std::vector<unsigned char>& bytes) {
+    owned.swap(bytes);
+    return attach(owned.data(), owned.size());
+}
+
+const sparse_volume_leaf* sparse_volume::leaf(int i, int j, int k) const {
+    const auto& h = *hdr;
+    // Unsigned, so indices below the table wrap around and fail the bound check too.
+    auto ti = static_cast<uint32_t>(i - h.top_origin[0]) >> (sparse_leaf_log2 + sparse_node_log2);
+    auto tj = static_cast<uint32_t>(j - h.top_origin[1]) >> (sparse_leaf_log2 + sparse_node_log2);
+    auto tk = static_cast<uint32_t>(k - h.top_origin[2]) >> (sparse_leaf_log2 + sparse_node_log2);
+    if (ti >= static_cast<uint32_t>(h.top_dims[0]) || tj >= static_cast<uint32_t>(h.top_dims[1]) || tk >= static_cast<uint32_t>(h.top_dims[2])) return nullptr;
+    auto n = top[(static_cast<size_t>(tk) * h.top_dims[1] + tj) * h.top_dims[0] + ti];
+    if (n < 0) return nullptr;
+    const int mask = sparse_node_dim - 1;
+    auto li = (i >> sparse_leaf_log2) & mask, lj = (j >> sparse_leaf_log2) & mask, lk = (k >> sparse_leaf_log2) & mask;
+    auto l = nodes[n].leaves[(lk * sparse_node_dim + lj) * sparse_node_dim + li];
+    return l < 0 ? nullptr : leaves + l;
+}
+
+double sparse_volume::voxel(int i, int j, int k) const {
+    auto l = leaf(i, j, k);
+    return l ? leaf_value(l, i, j, k) : 0.0;
+}
+
+double sparse_volume::density(const point3& p) const {
+    const auto& h = *hdr;
+    auto gx = (p.x() - h.origin[0]) / h.voxel_size[0];
+    auto gy = (p.y() - h.origin[1]) / h.voxel_size[1];
+    auto gz = (p.z() - h.origin[2]) / h.voxel_size[2];
+    auto fx = floor(gx), fy = floor(gy), fz = floor(gz);
+    if (!(fx >= h.active_min[0] - 1 && fx <= h.active_max[0] && fy >= h.active_min[1] - 1 && fy <= h.active_max[1]
+          && fz >= h.active_min[2] - 1 && fz <= h.active_max[2])) return 0;
+    auto i = static_cast<int>(fx), j = static_cast<int>(fy), k = static_cast<int>(fz);
+    auto tx = gx - fx, ty = gy - fy, tz = gz - fz;
+
+    // Corners share a leaf unless they sit across a leaf boundary, so look up only the
+    // leaves on the axes that cross one.
+    const int last = sparse_leaf_dim - 1;
+    int crossing = ((i & last) == last ? 1 : 0) | ((j & last) == last ? 2 : 0) | ((k & last) == last ? 4 : 0);
+    const sparse_volume_leaf* l[8];
+    double v[8];
+    for (int c = 0; c < 8; c++) {
+        auto ci = i + (c & 1), cj = j + ((c >> 1) & 1), ck = k + (c >> 2);
+        l[c] = (c & ~crossing) ? l[c & crossing] : leaf(ci, cj, ck);
+        v[c] = l[c] ? leaf_value(l[c], ci, cj, ck) : 0.0;
+    }
+    auto x0 = v[0] + tx * (v[1] - v[0]), x1 = v[2] + tx * (v[3] - v[2]);
+    auto x2 = v[4] + tx * (v[5] - v[4]), x3 = v[6] + tx * (v[7] - v[6]);
+    auto y0 = x0 + ty * (x1 - x0), y1 = x2 + ty * (x3 - x2);
+    return y0 + tz * (y1 - y0);
+}
+
+// Max over the voxels a lookup inside box can touch: whole nodes where the box covers
+// them, their leaves' maxima where it only clips them.
+double sparse_volume::max_density(const aabb& box) const {
+    const auto& h = *hdr;
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        lo[a] = std::max(h.active_min[a], static_cast<int>(floor((box.min()[a] - h.origin[a]) / h.voxel_size[a])));
+        hi[a] = std::min(h.active_max[a], static_cast<int>(floor((box.max()[a] - h.origin[a]) / h.voxel_size[a])) + 1);
+        if (lo[a] > hi[a]) return 0;
+    }
+    const int shift = sparse_leaf_log2 + sparse_node_log2;
+    float result = 0;
+    for (int tk = (lo[2] - h.top_origin[2]) >> shift; tk <= (hi[2] - h.top_origin[2]) >> shift; tk++) {
+        for (int tj = (lo[1] - h.top_origin[1]) >> shift; tj <= (hi[1] - h.top_origin[1]) >> shift; tj++) {
+            for (int ti = (lo[0] - h.top_origin[0]) >> shift; ti <= (hi[0] - h.top_origin[0]) >> shift; ti++) {
+                auto n = top[(static_cast<size_t>(tk) * h.top_dims[1] + tj) * h.top_dims[0] + ti];
+                if (n < 0 || nodes[n].max <= result) continue;
+                const int corner[3] = {h.top_origin[0] + ti * sparse_node_span, h.top_origin[1] + tj * sparse_node_span, h.top_origin[2] + tk * sparse_node_span};
+                int llo[3], lhi[3];
+                bool covered = true;
+                for (int a = 0; a < 3; a++) {
+                    llo[a] = (std::max(lo[a], corner[a]) - corner[a]) >> sparse_leaf_log2;
+                    lhi[a] = (std::min(hi[a], corner[a] + sparse_node_span - 1) - corner[a]) >> sparse_leaf_log2;
+                    covered = covered && llo[a] == 0 && lhi[a] == sparse_node_dim - 1;
+                }
+                if (covered) {
+                    result = nodes[n].max;
+                    continue;
+                }
+                for (int lk = llo[2]; lk <= lhi[2]; lk++) {
+                    for (int lj = llo[1]; lj <= lhi[1]; lj++) {
+                        for (int li = llo[0]; li <= lhi[0]; li++) {
+                            auto l = nodes[n].leaves[(lk * sparse_node_dim + lj) * sparse_node_dim + li];
+                            if (l >= 0) result = std::max(result, leaves[l].max);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// Lookups interpolate, so density reaches one voxel past the active voxels.
+aabb sparse_volume::bounds() const {
+    const auto& h = *hdr;
+    point3 lo, hi;
+    for (int a = 0; a < 3; a++) {
+        lo[a] = h.origin[a] + (h.active_min[a] - 1) * h.voxel_size[a];
+        hi[a] = h.origin[a] + (h.active_max[a] + 1) * h.voxel_size[a];
+    }
+    return aabb(lo, hi);
+}
+
+// About two leaves per majorant cell along the longest axis.
+int sparse_volume::majorant_cells() const {
+    const auto& h = *hdr;
+    int longest = 1;
+    for (int a = 0; a < 3; a++) longest = std::max(longest, h.active_max[a] - h.active_min[a] + 3);
+    return std::max(16, std::min(128, longest / (2 * sparse_leaf_dim)));
+}
+
+shared_ptr<sparse_volume> load_sparse_volume(const std::string& filename) {
+    trace_span span("load volume", filename);
+    auto volume = make_shared<sparse_volume>();
+    if (!volume->open(filename)) return nullptr;
+    return volume;
+}
+
+// Collects voxels leaf by leaf and packs them into the sparse layout.
+class sparse_volume_builder {
+public:
+    sparse_volume_builder(const point3& _origin, const vec3& _voxel_size) : origin(_origin), voxel_size(_voxel_size) {}
+    void set(int i, int j, int k, float value);
+    // Every vertex of a dense grid, with the grid's vertex spacing as voxel size.
+    static sparse_volume_builder from_grid(const density_grid& grid);
+
+    void pack(std::vector<unsigned char>& out) const;
+    bool write(const std::string& filename) const;
+private:
+    static uint64_t leaf_key(int li, int lj, int lk) {
+        const uint64_t bias = 1 << 20, mask = (1 << 21) - 1;
+        return ((li + bias) & mask) | (((lj + bias) & mask) << 21) | (((lk + bias) & mask) << 42);
+    }
+public:
+    point3 origin;
+    vec3 voxel_size;
+private:
+    struct leaf_coord {
+        int i, j, k;
+    };
+    struct float_leaf {
+        leaf_coord at;
+        std::vector<float> values;
+    };
+    std::unordered_map<uint64_t, float_leaf> leaves;
+};
+
+static int floor_div(int a, int b) {
+    return (a >= 0 ? a : a - b + 1) / b;
+}
+
+void sparse_volume_builder::set(int i, int j, int k, float value) {
+    auto li = floor_div(i, sparse_leaf_dim), lj = floor_div(j, sparse_leaf_dim), lk = floor_div(k, sparse_leaf_dim);
+    auto found = leaves.find(leaf_key(li, lj, lk));
+    if (found == leaves.end()) {
+        if (value == 0) return;
+        float_leaf l;
+        l.at.i = li;
+        l.at.j = lj;
+        l.at.k = lk;
+        l.values.assign(sparse_leaf_dim * sparse_leaf_dim * sparse_leaf_dim, 0.0f);
+        found = leaves.insert(std::make_pair(leaf_key(li, lj, lk), l)).first;
+    }
+    const int mask = sparse_leaf_dim - 1;
+    found->second.values[(((k & mask) << sparse_leaf_log2 | (j & mask)) << sparse_leaf_log2) | (i & mask)] = value;
+}
+
+sparse_volume_builder sparse_volume_builder::from_grid(const density_grid& grid) {
+    auto size = grid.box.max() - grid.box.min();
+    sparse_volume_builder builder(grid.box.min(), vec3(size.x() / (grid.nx - 1), size.y() / (grid.ny - 1), size.z() / (grid.nz - 1)));
+    for (int k = 0; k < grid.nz; k++) {
+        for (int j = 0; j < grid.ny; j++) {
+            for (int i = 0; i < grid.nx; i++) {
+                builder.set(i, j, k, grid.at(i, j, k));
+            }
+        }
+    }
+    return builder;
+}
+
+void sparse_volume_builder::pack(std::vector<unsigned char>& out) const {
+    sparse_volume_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = sparse_volume_magic;
+    h.version = sparse_volume_version;
+    for (int a = 0; a < 3; a++) {
+        h.origin[a] = origin[a];
+        h.voxel_size[a] = voxel_size[a];
+        h.active_min[a] = 0;
+        h.active_max[a] = -1;
+    }
+
+    // Drop leaves that ended up all zero, and find the extent of the rest.
+    std::vector<const float_leaf*> kept;
+    for (const auto& entry : leaves) {
+        const auto& l = entry.second;
+        if (std::find_if(l.values.begin(), l.values.end(), [](float v) { return v != 0; }) == l.values.end()) continue;
+        const int at[3] = {l.at.i, l.at.j, l.at.k};
+        for (int a = 0; a < 3; a++) {
+            if (kept.empty() || at[a] * sparse_leaf_dim < h.active_min[a]) h.active_min[a] = at[a] * sparse_leaf_dim;
+            if (kept.empty() || at[a] * sparse_leaf_dim + sparse_leaf_dim - 1 > h.active_max[a]) h.active_max[a] = at[a] * sparse_leaf_dim + sparse_leaf_dim - 1;
+        }
+        kept.push_back(&l);
+    }
+    // Leaves in node order keep neighbours close in the file.
+    std::sort(kept.begin(), kept.end(), [](const float_leaf* a, const float_leaf* b) {
+        if (a->at.k != b->at.k) return a->at.k < b->at.k;
+        if (a->at.j != b->at.j) return a->at.j < b->at.j;
+        return a->at.i < b->at.i;
+    });
+
+    for (int a = 0; a < 3; a++) {
+        if (kept.empty()) break;
+        h.top_origin[a] = floor_div(h.active_min[a], sparse_node_span) * sparse_node_span;
+        h.top_dims[a] = floor_div(h.active_max[a] - h.top_origin[a], sparse_node_span) + 1;
+    }
+    std::vector<int32_t> top_table(static_cast<size_t>(h.top_dims[0]) * h.top_dims[1] * h.top_dims[2], -1);
+    std::vector<sparse_volume_node> nodes;
+    std::vector<sparse_volume_leaf> packed(kept.size());
+    for (size_t n = 0; n < kept.size(); n++) {
+        const auto& l = *kept[n];
+        auto& p = packed[n];
+        p.min = *std::min_element(l.values.begin(), l.values.end());
+        p.max = *std::max_element(l.values.begin(), l.values.end());
+        auto scale = p.max > p.min ? 255 / (p.max - p.min) : 0.0f;
+        for (size_t v = 0; v < l.values.size(); v++) {
+            p.values[v] = static_cast<uint8_t>((l.values[v] - p.min) * scale + 0.5f);
+        }
+
+        const int at[3] = {l.at.i * sparse_leaf_dim - h.top_origin[0], l.at.j * sparse_leaf_dim - h.top_origin[1], l.at.k * sparse_leaf_dim - h.top_origin[2]};
+        auto& slot = top_table[(static_cast<size_t>(at[2] / sparse_node_span) * h.top_dims[1] + at[1] / sparse_node_span) * h.top_dims[0] + at[0] / sparse_node_span];
+        if (slot < 0) {
+            slot = static_cast<int32_t>(nodes.size());
+            nodes.push_back(sparse_volume_node());
+            nodes.back().max = 0;
+            std::fill(nodes.back().leaves, nodes.back().leaves + sparse_node_dim * sparse_node_dim * sparse_node_dim, -1);
+        }
+        auto& node = nodes[slot];
+        node.max = std::max(node.max, p.max);
+        const int li = (at[0] % sparse_node_span) / sparse_leaf_dim, lj = (at[1] % sparse_node_span) / sparse_leaf_dim, lk = (at[2] % sparse_node_span) / sparse_leaf_dim;
+        node.leaves[(lk * sparse_node_dim + lj) * sparse_node_dim + li] = static_cast<int32_t>(n);
+    }
+
+    auto align = [](uint64_t x) { return (x + 63) & ~static_cast<uint64_t>(63); };
+    h.node_count = static_cast<uint32_t>(nodes.size());
+    h.leaf_count = static_cast<uint32_t>(packed.size());
+    h.top_offset = align(sizeof(h));
+    h.node_offset = align(h.top_offset + top_table.size() * sizeof(int32_t));
+    h.leaf_offset = align(h.node_offset + nodes.size() * sizeof(sparse_volume_node));
+    h.file_size = h.leaf_offset + packed.size() * sizeof(sparse_volume_leaf);
+    out.assign(h.file_size, 0);
+    memcpy(out.data(), &h, sizeof(h));
+    if (!top_table.empty()) memcpy(out.data() + h.top_offset, top_table.data(), top_table.size() * sizeof(int32_t));
+    if (!nodes.empty()) memcpy(out.data() + h.node_offset, nodes.data(), nodes.size() * sizeof(sparse_volume_node));
+    if (!packed.empty()) memcpy(out.data() + h.leaf_offset, packed.data(), packed.size() * sizeof(sparse_volume_leaf));
+}
+
+bool sparse_volume_builder::write(const std::string& filename) const {
+    std::vector<unsigned char> bytes;
+    pack(bytes);
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        std::cerr << "ERROR: cannot write " << filename << ".\n";
+        return false;
+    }
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) std::cerr << "ERROR: cannot write " << filename << ".\n";
+    return ok;
+}
+
+#endif
@@ -3,27 +3,60 @@
 
 #include "hittable.hpp"
 #include "vec3.hpp"
+#include "render_stats.hpp"
+
+// Where the ray's line crosses the sphere, as t_enter <= t_exit.
+inline bool sphere_span(const point3& center, double radius, const ray& r, double& t_enter, double& t_exit) {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+    auto delta = half_b * half_b - a * c;
+    if (delta < 0) return false;
+    auto sqrtdelta = sqrt(delta);
+    t_enter = (-half_b - sqrtdelta) / a;
+    t_exit = (-half_b + sqrtdelta) / a;
+    return true;
+}
 
 class sphere : public hittable {
 public:
     sphere() {}
     sphere(point3 _center, double _radius, shared_ptr<material> m) : center(_center), radius(_radius), mat_ptr(m) {}
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit_spans(const ray& r, ray_spans& spans) const override {
+        double t_enter, t_exit;
+        if (!sphere_span(center, radius, r, t_enter, t_exit)) return false;
+        spans.add(t_enter, t_exit);
+        return true;
+    }
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 public:
     point3 center;
     double radius;
     shared_ptr <material> mat_ptr;
-private:
+public:
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         auto theta = acos(-p.y());
         auto phi = atan2(-p.z(), p.x()) + pi;
         u = phi / (2 * pi);
         v = theta / pi;
     }
+    // dp/du and dp/dv of get_sphere_uv's mapping at unit normal n.
+    static void get_sphere_derivatives(const vec3& n, double radius, vec3& dpdu, vec3& dpdv) {
+        dpdu = 2 * pi * radius * vec3(n.z(), 0, -n.x());
+        auto s = sqrt(n.x() * n.x() + n.z() * n.z());
+        if (s < 1e-8) {
+            dpdv = vec3(pi * radius, 0, 0);     // Pole: any tangent will do
+            return;
+        }
+        dpdv = pi * radius * vec3(-n.y() * n.x() / s, s, -n.y() * n.z() / s);
+    }
 };
 
 bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    RT_PERF_PRIMITIVE_REGION(PERF_REGION_SPHERE);
+    RT_STAT_INC(prim_tests[STAT_PRIM_SPHERE]);
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -44,6 +77,7 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
+    get_sphere_derivatives(outward_normal, radius, rec.dpdu, rec.dpdv);
     rec.mat_ptr = mat_ptr;
 
     return true;
@@ -3,12 +3,40 @@
 
 #include "utils.hpp"
 #include "perlin.hpp"
+#include "trace.hpp"
 #include <iostream>
+#include <vector>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+
+// How far the texture lookup point moves between neighbouring pixels, in uv and in
+// world space. All zero when unknown, which asks for the sharpest lookup.
+struct texture_footprint {
+    double dudx, dvdx, dudy, dvdy;
+    vec3 dpdx, dpdy;
+
+    texture_footprint() : dudx(0), dvdx(0), dudy(0), dvdy(0), dpdx(0, 0, 0), dpdy(0, 0, 0) {}
+};
+
+// MIP level for a footprint on a width x height image: log2 of its longer axis in texels.
+inline double mip_lod(const texture_footprint& fp, int width, int height) {
+    auto dx = sqrt(fp.dudx * fp.dudx * width * width + fp.dvdx * fp.dvdx * height * height);
+    auto dy = sqrt(fp.dudy * fp.dudy * width * width + fp.dvdy * fp.dvdy * height * height);
+    auto extent = std::max(dx, dy);
+    return extent > 1 ? log2(extent) : 0.0;
+}
+
 class texture {
 public:
     virtual color value(double u, double v, const point3& p) const = 0;
+    // Lookup filtered over the footprint. Textures without detail to lose just use value().
+    virtual color sample(double u, double v, const point3& p, const texture_footprint& fp) const {
+        return value(u, v, p);
+    }
+    // value() at n points, for callers that shade many hits at once.
+    virtual void values(const double* u, const double* v, const point3* p, color* out, int n) const {
+        for (int i = 0; i < n; i++) out[i] = value(u[i], v[i], p[i]);
+    }
 };
 
 class solid_color : public texture {
@@ -23,16 +51,24 @@ private:
     color color_value;
 };
 
+// The checker pattern: odd cells where this is negative.
+inline double checker_sines(const point3& p) {
+    return sin(5 * p.x()) * sin(5 * p.y()) * sin(5 * p.z());
+}
+
 class checker_texture : public texture {
 public:
     checker_texture() {}
     checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd) : even(_even), odd(_odd) {}
     checker_texture(color c1, color c2) : even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
     virtual color value(double u, double v, const point3& p) const override {
-        auto sines = sin(5 * p.x()) * sin(5 * p.y()) * sin(5 * p.z());
-        if (sines < 0) return odd->value(u, v, p);
+        if (checker_sines(p) < 0) return odd->value(u, v, p);
         else return even->value(u, v, p);
     }
+    virtual color sample(double u, double v, const point3& p, const texture_footprint& fp) const override {
+        if (checker_sines(p) < 0) return odd->sample(u, v, p, fp);
+        else return even->sample(u, v, p, fp);
+    }
 public:
     shared_ptr<texture> odd;
     shared_ptr<texture> even;
@@ -42,21 +78,43 @@ class noise_texture : public texture {
 public:
     noise_texture() {}
     noise_texture(double sc) : scale(sc) {}
+    noise_texture(double sc, const vec3* ranvec, const int* perm_x, const int* perm_y, const int* perm_z) : noise(ranvec, perm_x, perm_y, perm_z), scale(sc) {}
     virtual color value(double u, double v, const point3& p) const override {
         // return color(1, 1, 1) * 0.5 * (1.0 + noise.noise(scale * p));
         // return color(1, 1, 1) * noise.turb(scale * p, 3);
         return color(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 20 * noise.turb(p)));
     }
+    virtual color sample(double u, double v, const point3& p, const texture_footprint& fp) const override {
+        auto width = std::max(fp.dpdx.length(), fp.dpdy.length());
+        return color(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 20 * noise.turb(p, width, 15)));
+    }
+    virtual void values(const double* u, const double* v, const point3* p, color* out, int n) const override {
+        const int chunk = 64;
+        double turb[chunk];
+        for (int first = 0; first < n; first += chunk) {
+            auto count = std::min(chunk, n - first);
+            noise.turb_batch(p + first, turb, count);
+            for (int i = 0; i < count; i++) {
+                out[first + i] = color(1, 1, 1) * 0.5 * (1 + sin(scale * p[first + i].z() + 20 * turb[i]));
+            }
+        }
+    }
 public:
     perlin noise;
     double scale;
 };
 
+struct mip_level {
+    const unsigned char* data;
+    int width, height;
+};
+
 class image_texture : public texture {
 public:
     const static int bytes_per_pixel = 3;
-    image_texture() : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
-    image_texture(const char* filename) {
+    image_texture() : data(nullptr), width(0), height(0), bytes_per_scanline(0), owns_data(false) {}
+    image_texture(const char* filename) : owns_data(true) {
+        trace_span span("decode texture", filename);
         auto components_per_pixel = bytes_per_pixel;
         data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
         if (!data) {
@@ -64,8 +122,15 @@ public:
             width = height = 0;
         }
         bytes_per_scanline = bytes_per_pixel * width;
+        build_mips(nullptr);
     }
-    ~image_texture() { delete data; }
+    // Wraps already decoded RGB8 texels without copying them; the caller keeps them alive.
+    // mips, if given, holds the coarser levels laid out as in mip_data.
+    image_texture(const unsigned char* pixels, int w, int h, const unsigned char* mips = nullptr) : data(const_cast<unsigned char*>(pixels)),
+        width(w), height(h), bytes_per_scanline(bytes_per_pixel * w), owns_data(false) {
+        build_mips(mips);
+    }
+    ~image_texture() { if (owns_data) stbi_image_free(data); }
 
     virtual color value(double u, double v, const vec3& p) const override {
         if (data == nullptr) return color(0, 1, 1);
@@ -80,10 +145,101 @@ public:
         auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
         return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
     }
+    virtual color sample(double u, double v, const point3& p, const texture_footprint& fp) const override;
+
+    // Bytes of levels 1.. for a w x h image, each half the size of the previous down to 1x1.
+    static size_t mip_chain_size(int w, int h);
+private:
+    void build_mips(const unsigned char* mips);
+    color bilinear(const mip_level& level, double u, double v) const;
+    // levels point into data and mip_data, and data may be owned, so copies would dangle.
+    image_texture(const image_texture&);
+    image_texture& operator=(const image_texture&);
 public:
     unsigned char* data;
     int width, height;
     int bytes_per_scanline;
+    bool owns_data;
+    std::vector<unsigned char> mip_data;    // Levels 1.. when generated here
+    std::vector<mip_level> levels;          // levels[0] is data
 };
 
+size_t image_texture::mip_chain_size(int w, int h) {
+    size_t size = 0;
+    while (w > 1 || h > 1) {
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+        size += static_cast<size_t>(w) * h * bytes_per_pixel;
+    }
+    return size;
+}
+
+void image_texture::build_mips(const unsigned char* mips) {
+    levels.clear();
+    if (data == nullptr) return;
+    mip_level base = {data, width, height};
+    levels.push_back(base);
+    if (!mips) {
+        mip_data.resize(mip_chain_size(width, height));
+        mips = mip_data.data();
+    }
+    auto next = mips;
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const auto src = levels.back();
+        mip_level dst = {next, std::max(1, src.width / 2), std::max(1, src.height / 2)};
+        if (!mip_data.empty()) {
+            // Each texel averages the 2x2 (or, next to an odd edge, up to 3x3) texels it covers.
+            auto out = mip_data.data() + (next - mip_data.data());
+            for (int j = 0; j < dst.height; j++) {
+                auto j0 = j * src.height / dst.height, j1 = (j + 1) * src.height / dst.height;
+                for (int i = 0; i < dst.width; i++) {
+                    auto i0 = i * src.width / dst.width, i1 = (i + 1) * src.width / dst.width;
+                    int sum[bytes_per_pixel] = {0};
+                    for (int y = j0; y < j1; y++) {
+                        for (int x = i0; x < i1; x++) {
+                            for (int c = 0; c < bytes_per_pixel; c++) sum[c] += src.data[(y * src.width + x) * bytes_per_pixel + c];
+                        }
+                    }
+                    auto count = (j1 - j0) * (i1 - i0);
+                    for (int c = 0; c < bytes_per_pixel; c++) {
+                        out[(j * dst.width + i) * bytes_per_pixel + c] = static_cast<unsigned char>((sum[c] + count / 2) / count);
+                    }
+                }
+            }
+        }
+        levels.push_back(dst);
+        next += static_cast<size_t>(dst.width) * dst.height * bytes_per_pixel;
+    }
+}
+
+color image_texture::bilinear(const mip_level& level, double u, double v) const {
+    auto x = clamp(u, 0.0, 1.0) * level.width - 0.5;
+    auto y = (1.0 - clamp(v, 0.0, 1.0)) * level.height - 0.5;
+    auto fx = floor(x), fy = floor(y);
+    auto i0 = static_cast<int>(fx), j0 = static_cast<int>(fy);
+    auto tx = x - fx, ty = y - fy;
+    auto i1 = std::min(i0 + 1, level.width - 1), j1 = std::min(j0 + 1, level.height - 1);
+    i0 = std::max(i0, 0);
+    j0 = std::max(j0, 0);
+    auto texel = [&](int i, int j) {
+        auto pixel = level.data + (static_cast<size_t>(j) * level.width + i) * bytes_per_pixel;
+        return color(pixel[0], pixel[1], pixel[2]);
+    };
+    auto top = (1 - tx) * texel(i0, j0) + tx * texel(i1, j0);
+    auto bottom = (1 - tx) * texel(i0, j1) + tx * texel(i1, j1);
+    return (1.0 / 255.0) * ((1 - ty) * top + ty * bottom);
+}
+
+// Trilinear lookup between the two levels around mip_lod.
+color image_texture::sample(double u, double v, const point3& p, const texture_footprint& fp) const {
+    if (data == nullptr) return color(0, 1, 1);
+    auto lod = mip_lod(fp, width, height);
+    auto last = static_cast<int>(levels.size()) - 1;
+    if (lod >= last) return bilinear(levels[last], u, v);
+    auto l = static_cast<int>(lod);
+    auto f = lod - l;
+    if (f == 0) return bilinear(levels[l], u, v);
+    return (1 - f) * bilinear(levels[l], u, v) + f * bilinear(levels[l + 1], u, v);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,126 @@
+#ifndef TEXTURE_PROGRAM_H_
+#define TEXTURE_PROGRAM_H_
+
+#include "utils.hpp"
+#include "texture.hpp"
+#include <typeinfo>
+#include <vector>
+
+// A texture tree flattened into an array of ops for the materials that look it up.
+// Solid colours become constants and checkers become branches, so a lookup walks the
+// array instead of making a virtual call per node. Branches with the same constant on
+// both sides fold away, and a checker nested in another one's branch is resolved at
+// compile time since all checkers share the same pattern. Noise and image leaves are
+// called directly; any other texture, subclasses of these included, is called through
+// its virtual interface.
+
+enum texture_opcode {
+    TOP_CONST = 0,      // c
+    TOP_CHECKER,        // even, odd: op indices of the branches
+    TOP_NOISE,          // tex: a noise_texture
+    TOP_IMAGE,          // tex: an image_texture
+    TOP_CALL,           // tex: anything else
+};
+
+struct texture_op {
+    int code;
+    int even, odd;
+    color c;
+    const texture* tex;
+};
+
+class texture_program {
+public:
+    // Black, until assigned a compiled program.
+    texture_program() { emit(TOP_CONST, nullptr); }
+    explicit texture_program(const texture* root) { compile(root, 0); }
+
+    bool constant() const { return ops[0].code == TOP_CONST; }
+    const color& constant_value() const { return ops[0].c; }
+    color value(double u, double v, const point3& p) const;
+    color sample(double u, double v, const point3& p, const texture_footprint& fp) const;
+public:
+    std::vector<texture_op> ops;    // ops[0] is the root
+private:
+    int compile(const texture* t, int side);
+    int emit(int code, const texture* t) {
+        texture_op op = {code, 0, 0, color(0, 0, 0), t};
+        ops.push_back(op);
+        return static_cast<int>(ops.size()) - 1;
+    }
+};
+
+// Emits the ops for t and returns the index of its root. side is the checker branch t
+// sits in: 1 even, -1 odd, 0 not inside a checker.
+int texture_program::compile(const texture* t, int side) {
+    // Exact types only: a subclass may override what is folded or called directly here.
+    const auto& type = typeid(*t);
+    if (type == typeid(solid_color)) {
+        auto i = emit(TOP_CONST, nullptr);
+        ops[i].c = t->value(0, 0, point3());
+        return i;
+    }
+    if (type == typeid(checker_texture)) {
+        auto checker = static_cast<const checker_texture*>(t);
+        if (side > 0) return compile(checker->even.get(), side);
+        if (side < 0) return compile(checker->odd.get(), side);
+        auto i = emit(TOP_CHECKER, nullptr);
+        auto even = compile(checker->even.get(), 1);
+        auto odd = compile(checker->odd.get(), -1);
+        auto& a = ops[even];
+        auto& b = ops[odd];
+        if (a.code == TOP_CONST && b.code == TOP_CONST && a.c.x() == b.c.x() && a.c.y() == b.c.y() && a.c.z() == b.c.z()) {
+            auto c = a.c;
+            ops.resize(i + 1);
+            ops[i].code = TOP_CONST;
+            ops[i].c = c;
+            return i;
+        }
+        ops[i].even = even;
+        ops[i].odd = odd;
+        return i;
+    }
+    if (type == typeid(noise_texture)) return emit(TOP_NOISE, t);
+    if (type == typeid(image_texture)) return emit(TOP_IMAGE, t);
+    return emit(TOP_CALL, t);
+}
+
+color texture_program::value(double u, double v, const point3& p) const {
+    auto op = ops.data();
+    for (;;) {
+        switch (op->code) {
+            case TOP_CONST:
+                return op->c;
+            case TOP_CHECKER:
+                op = ops.data() + (checker_sines(p) < 0 ? op->odd : op->even);
+                break;
+            case TOP_NOISE:
+                return static_cast<const noise_texture*>(op->tex)->noise_texture::value(u, v, p);
+            case TOP_IMAGE:
+                return static_cast<const image_texture*>(op->tex)->image_texture::value(u, v, p);
+            default:
+                return op->tex->value(u, v, p);
+        }
+    }
+}
+
+color texture_program::sample(double u, double v, const point3& p, const texture_footprint& fp) const {
+    auto op = ops.data();
+    for (;;) {
+        switch (op->code) {
+            case TOP_CONST:
+                return op->c;
+            case TOP_CHECKER:
+                op = ops.data() + (checker_sines(p) < 0 ? op->odd : op->even);
+                break;
+            case TOP_NOISE:
+                return static_cast<const noise_texture*>(op->tex)->noise_texture::sample(u, v, p, fp);
+            case TOP_IMAGE:
+                return static_cast<const image_texture*>(op->tex)->image_texture::sample(u, v, p, fp);
+            default:
+                return op->tex->sample(u, v, p, fp);
+        }
+    }
+}
+
+#endif
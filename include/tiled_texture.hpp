@@ -0,0 +1,355 @@
+#ifndef TILED_TEXTURE_H_
+#define TILED_TEXTURE_H_
+
+#include "utils.hpp"
+#include "texture.hpp"
+#include "render_stats.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Out-of-core image textures. The first time an image is used it is decoded once and
+// rewritten next to the source as <image>.tiles: every MIP level cut into fixed-size
+// RGB8 tiles. Rendering then reads tiles on demand through one process-wide LRU cache
+// with a memory budget, so only the texels actually touched are ever resident.
+
+const uint32_t tiled_file_magic = 0x58545452;  // "RTTX"
+const uint32_t tiled_file_version = 1;
+const int tiled_tile_size = 64;
+
+struct tiled_file_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t tile_size;
+    int32_t level_count;
+};
+
+struct tiled_file_level {
+    int32_t width;
+    int32_t height;
+    int32_t tiles_x;
+    int32_t tiles_y;
+    uint64_t offset;        // File offset of tile (0, 0); tiles follow in row-major order
+};
+
+typedef std::vector<unsigned char> tile_data;
+
+// Shared tile store. Tiles are keyed by texture id, level and tile position and evicted
+// least recently used first once the budget is exceeded. Thread safe; file reads happen
+// outside the lock. Each thread may additionally pin a few tiles in its own lookup slots.
+class tile_cache {
+public:
+    tile_cache() : hits(0), misses(0), evictions(0), read_errors(0), budget(256u << 20), used(0) {}
+    static tile_cache& global() {
+        static tile_cache cache;
+        return cache;
+    }
+
+    // Keys of different files are told apart by an id from here in their top 24 bits.
+    static uint64_t new_id() {
+        static std::atomic<uint64_t> next_id(1);
+        return next_id++;
+    }
+
+    void set_budget(size_t bytes);
+    // nullptr if the tile cannot be read in full; nothing is cached then.
+    shared_ptr<const tile_data> fetch(uint64_t key, int fd, uint64_t offset, size_t size);
+    // fetch() through a small per-thread table of recently used tiles, so repeated lookups
+    // into the same tiles never take the lock. The data stays valid until this thread's
+    // next pinned() call.
+    const unsigned char* pinned(uint64_t key, int fd, uint64_t offset, size_t size);
+public:
+    std::atomic<uint64_t> hits, misses, evictions, read_errors;
+private:
+    void evict();
+private:
+    struct entry {
+        shared_ptr<const tile_data> tile;
+        std::list<uint64_t>::iterator lru_pos;
+    };
+    std::mutex lock;
+    std::unordered_map<uint64_t, entry> entries;
+    std::list<uint64_t> lru;    // Most recently used first
+    size_t budget;
+    size_t used;
+};
+
+void tile_cache::set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    budget = bytes;
+    evict();
+}
+
+// Expects the lock to be held.
+void tile_cache::evict() {
+    // The newest tile always stays, even if it alone is over budget.
+    while (used > budget && lru.size() > 1) {
+        auto key = lru.back();
+        lru.pop_back();
+        auto found = entries.find(key);
+        used -= found->second.tile->size();
+        entries.erase(found);
+        evictions++;
+    }
+}
+
+shared_ptr<const tile_data> tile_cache::fetch(uint64_t key, int fd, uint64_t offset, size_t size) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = entries.find(key);
+        if (found != entries.end()) {
+            lru.splice(lru.begin(), lru, found->second.lru_pos);
+            hits++;
+            return found->second.tile;
+        }
+    }
+    misses++;
+    trace_span span("read texture tile");
+    stat_allocations_allowed streaming;     // Tiles come and go with the budget
+    auto tile = make_shared<tile_data>(size);
+    if (pread(fd, tile->data(), size, static_cast<off_t>(offset)) != static_cast<ssize_t>(size)) {
+        read_errors++;
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = entries.find(key);
+    if (found != entries.end()) return found->second.tile;    // Another thread read it meanwhile
+    lru.push_front(key);
+    entry e = {tile, lru.begin()};
+    entries[key] = e;
+    used += size;
+    evict();
+    return tile;
+}
+
+const unsigned char* tile_cache::pinned(uint64_t key, int fd, uint64_t offset, size_t size) {
+    struct slot {
+        uint64_t key;
+        shared_ptr<const tile_data> tile;
+    };
+    const int slot_count = 64;
+    static thread_local slot slots[slot_count];
+
+    auto& s = slots[(key ^ (key >> 40) * 31 ^ (key >> 16) * 7) % slot_count];
+    if (s.key != key || !s.tile) {
+        s.tile = fetch(key, fd, offset, size);
+        s.key = key;
+        if (!s.tile) return nullptr;
+    }
+    return s.tile->data();
+}
+
+// Name to write path under before renaming it into place, unique across processes and threads.
+std::string temp_file_path(const std::string& path) {
+    static std::atomic<int> next_temp(0);
+    return path + "." + std::to_string(getpid()) + "." + std::to_string(next_temp++) + ".tmp";
+}
+
+// Writes the tiled MIP file for the w x h RGB8 texels in pixels. The file is written under
+// a temporary name and renamed into place, so other processes never see it half written.
+bool write_tiled_file(const std::string& path, const unsigned char* pixels, int w, int h) {
+    image_texture mips(pixels, w, h);
+    tiled_file_header header = {tiled_file_magic, tiled_file_version, w, h, tiled_tile_size, static_cast<int32_t>(mips.levels.size())};
+    std::vector<tiled_file_level> levels(mips.levels.size());
+    const size_t tile_bytes = static_cast<size_t>(tiled_tile_size) * tiled_tile_size * image_texture::bytes_per_pixel;
+    uint64_t offset = sizeof(header) + levels.size() * sizeof(tiled_file_level);
+    for (size_t l = 0; l < levels.size(); l++) {
+        levels[l].width = mips.levels[l].width;
+        levels[l].height = mips.levels[l].height;
+        levels[l].tiles_x = (levels[l].width + tiled_tile_size - 1) / tiled_tile_size;
+        levels[l].tiles_y = (levels[l].height + tiled_tile_size - 1) / tiled_tile_size;
+        levels[l].offset = offset;
+        offset += static_cast<uint64_t>(levels[l].tiles_x) * levels[l].tiles_y * tile_bytes;
+    }
+
+    auto temp_path = temp_file_path(path);
+    FILE* f = fopen(temp_path.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(levels.data(), sizeof(tiled_file_level), levels.size(), f) == levels.size();
+    // Edge tiles are padded to full size; lookups clamp to the level so the padding is never read.
+    tile_data tile(tile_bytes);
+    for (size_t l = 0; ok && l < levels.size(); l++) {
+        const auto& src = mips.levels[l];
+        for (int ty = 0; ok && ty < levels[l].tiles_y; ty++) {
+            for (int tx = 0; ok && tx < levels[l].tiles_x; tx++) {
+                std::fill(tile.begin(), tile.end(), 0);
+                for (int y = 0; y < tiled_tile_size && ty * tiled_tile_size + y < src.height; y++) {
+                    auto row = src.data + (static_cast<size_t>(ty * tiled_tile_size + y) * src.width + tx * tiled_tile_size) * image_texture::bytes_per_pixel;
+                    auto n = std::min(tiled_tile_size, src.width - tx * tiled_tile_size);
+                    memcpy(&tile[static_cast<size_t>(y) * tiled_tile_size * image_texture::bytes_per_pixel], row, n * image_texture::bytes_per_pixel);
+                }
+                ok = fwrite(tile.data(), 1, tile_bytes, f) == tile_bytes;
+            }
+        }
+    }
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(temp_path.c_str(), path.c_str()) == 0;
+    if (!ok) remove(temp_path.c_str());
+    return ok;
+}
+
+class tiled_image_texture : public texture {
+public:
+    tiled_image_texture(const std::string& filename);
+    ~tiled_image_texture() { if (fd >= 0) close(fd); }
+
+    virtual color value(double u, double v, const point3& p) const override;
+    virtual color sample(double u, double v, const point3& p, const texture_footprint& fp) const override;
+private:
+    bool open_tiles(const std::string& path);
+    const unsigned char* texel(int level, int i, int j) const;
+    color bilinear(int level, double u, double v) const;
+public:
+    std::string tiles_path;
+    int width, height;
+    std::vector<tiled_file_level> levels;
+private:
+    int fd;
+    uint64_t id;
+    mutable std::atomic<bool> read_failed;
+    tiled_image_texture(const tiled_image_texture&);
+    tiled_image_texture& operator=(const tiled_image_texture&);
+};
+
+// Uses filename.tiles when it is newer than filename, otherwise (re)builds it first.
+// filename may also name a .tiles file directly.
+tiled_image_texture::tiled_image_texture(const std::string& filename) : width(0), height(0), fd(-1), read_failed(false) {
+    id = tile_cache::new_id();
+
+    auto is_tiles = filename.size() > 6 && filename.compare(filename.size() - 6, 6, ".tiles") == 0;
+    tiles_path = is_tiles ? filename : filename + ".tiles";
+    if (!is_tiles) {
+        struct stat src_stat, tiles_stat;
+        bool fresh = stat(filename.c_str(), &src_stat) == 0 && stat(tiles_path.c_str(), &tiles_stat) == 0 && tiles_stat.st_mtime >= src_stat.st_mtime;
+        if (!fresh || !open_tiles(tiles_path)) {
+            trace_span span("decode texture", filename);
+            int w, h, n = image_texture::bytes_per_pixel;
+            auto pixels = stbi_load(filename.c_str(), &w, &h, &n, image_texture::bytes_per_pixel);
+            if (!pixels) {
+                std::cerr << "ERROR: texture image file not found: " << filename << ".\n";
+                return;
+            }
+            bool written = write_tiled_file(tiles_path, pixels, w, h);
+            stbi_image_free(pixels);
+            if (!written) {
+                std::cerr << "ERROR: cannot write texture tiles: " << tiles_path << ".\n";
+                return;
+            }
+        }
+    }
+    if (fd < 0 && !open_tiles(tiles_path)) {
+        std::cerr << "ERROR: bad texture tile file: " << tiles_path << ".\n";
+    }
+}
+
+// Checks the level table against the header and the file size, so that every tile a
+// lookup can ask for lies inside the file.
+bool tiled_image_texture::open_tiles(const std::string& path) {
+    if (fd >= 0) return true;
+    int f = open(path.c_str(), O_RDONLY);
+    if (f < 0) return false;
+    tiled_file_header header;
+    struct stat st;
+    bool ok = fstat(f, &st) == 0 && pread(f, &header, sizeof(header), 0) == sizeof(header) && header.magic == tiled_file_magic
+              && header.version == tiled_file_version && header.tile_size == tiled_tile_size && header.width > 0 && header.height > 0
+              && header.level_count > 0 && header.level_count < 32;
+    if (ok) {
+        levels.resize(header.level_count);
+        auto bytes = levels.size() * sizeof(tiled_file_level);
+        ok = pread(f, levels.data(), bytes, sizeof(header)) == static_cast<ssize_t>(bytes);
+    }
+    // Levels halve down to 1 x 1, and their tiles follow the table back to back.
+    const uint64_t tile_bytes = static_cast<uint64_t>(tiled_tile_size) * tiled_tile_size * image_texture::bytes_per_pixel;
+    uint64_t offset = sizeof(header) + levels.size() * sizeof(tiled_file_level);
+    for (size_t l = 0; ok && l < levels.size(); l++) {
+        const auto& level = levels[l];
+        auto w = l == 0 ? header.width : std::max(1, levels[l - 1].width / 2);
+        auto h = l == 0 ? header.height : std::max(1, levels[l - 1].height / 2);
+        ok = level.width == w && level.height == h && level.tiles_x == (w + tiled_tile_size - 1) / tiled_tile_size
+             && level.tiles_y == (h + tiled_tile_size - 1) / tiled_tile_size && level.offset == offset;
+        offset += static_cast<uint64_t>(level.tiles_x) * level.tiles_y * tile_bytes;
+    }
+    ok = ok && levels.back().width == 1 && levels.back().height == 1 && offset <= static_cast<uint64_t>(st.st_size);
+    if (!ok) {
+        close(f);
+        levels.clear();
+        return false;
+    }
+    fd = f;
+    width = header.width;
+    height = header.height;
+    return true;
+}
+
+// Texel (i, j) of a level, with j = 0 at the top row, or nullptr if its tile cannot be read.
+const unsigned char* tiled_image_texture::texel(int level, int i, int j) const {
+    const auto& l = levels[level];
+    auto tx = i / tiled_tile_size, ty = j / tiled_tile_size;
+    auto key = (id << 40) | (static_cast<uint64_t>(level) << 32) | (static_cast<uint64_t>(ty) << 16) | static_cast<uint64_t>(tx);
+    const size_t tile_bytes = static_cast<size_t>(tiled_tile_size) * tiled_tile_size * image_texture::bytes_per_pixel;
+    auto tile = tile_cache::global().pinned(key, fd, l.offset + (static_cast<uint64_t>(ty) * l.tiles_x + tx) * tile_bytes, tile_bytes);
+    if (!tile) {
+        if (!read_failed.exchange(true)) std::cerr << "ERROR: cannot read texture tiles: " << tiles_path << ".\n";
+        return nullptr;
+    }
+    auto x = i - tx * tiled_tile_size, y = j - ty * tiled_tile_size;
+    return tile + (static_cast<size_t>(y) * tiled_tile_size + x) * image_texture::bytes_per_pixel;
+}
+
+color tiled_image_texture::value(double u, double v, const point3& p) const {
+    if (fd < 0) return color(0, 1, 1);
+    u = clamp(u, 0.0, 1.0);
+    v = 1.0 - clamp(v, 0.0, 1.0);
+    auto i = std::min(static_cast<int>(u * width), width - 1);
+    auto j = std::min(static_cast<int>(v * height), height - 1);
+    auto pixel = texel(0, i, j);
+    if (!pixel) return color(0, 1, 1);
+    const auto color_scale = 1.0 / 255.0;
+    return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+}
+
+color tiled_image_texture::bilinear(int level, double u, double v) const {
+    const auto& l = levels[level];
+    auto x = clamp(u, 0.0, 1.0) * l.width - 0.5;
+    auto y = (1.0 - clamp(v, 0.0, 1.0)) * l.height - 0.5;
+    auto fx = floor(x), fy = floor(y);
+    auto i0 = static_cast<int>(fx), j0 = static_cast<int>(fy);
+    auto tx = x - fx, ty = y - fy;
+    auto i1 = std::min(i0 + 1, l.width - 1), j1 = std::min(j0 + 1, l.height - 1);
+    i0 = std::max(i0, 0);
+    j0 = std::max(j0, 0);
+    auto fetch = [&](int i, int j) {
+        auto pixel = texel(level, i, j);
+        return pixel ? color(pixel[0], pixel[1], pixel[2]) : color(0, 255, 255);
+    };
+    auto top = (1 - tx) * fetch(i0, j0) + tx * fetch(i1, j0);
+    auto bottom = (1 - tx) * fetch(i0, j1) + tx * fetch(i1, j1);
+    return (1.0 / 255.0) * ((1 - ty) * top + ty * bottom);
+}
+
+color tiled_image_texture::sample(double u, double v, const point3& p, const texture_footprint& fp) const {
+    if (fd < 0) return color(0, 1, 1);
+    auto lod = mip_lod(fp, width, height);
+    auto last = static_cast<int>(levels.size()) - 1;
+    if (lod >= last) return bilinear(last, u, v);
+    auto l = static_cast<int>(lod);
+    auto f = lod - l;
+    if (f == 0) return bilinear(l, u, v);
+    return (1 - f) * bilinear(l, u, v) + f * bilinear(l + 1, u, v);
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of where a run spends its time: scene loading, texture decoding, BVH builds,
+// sample passes and output, as spans per thread. Recording starts with trace::start()
+// (--trace file.json) and is exported in the Chrome trace event format, which Perfetto
+// and chrome://tracing open. Until then a span is a single test of a flag.
+
+struct trace_event {
+    const char* name;       // A string literal
+    std::string detail;
+    double start;           // Microseconds since the trace started
+    double duration;
+};
+
+class trace {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    static bool enabled() { return on(); }
+    // The calling thread becomes thread 0.
+    static void start() {
+        origin();
+        local();
+        on() = true;
+    }
+    static double now() { return std::chrono::duration<double, std::micro>(clock::now() - origin()).count(); }
+    static void record(const char* name, const std::string& detail, double start, double duration) {
+        trace_event e = {name, detail, start, duration};
+        local().events.push_back(e);
+    }
+    // Writes every thread's spans. Only call once the other threads are done.
+    static bool write(const std::string& path);
+private:
+    struct thread_events {
+        int tid;
+        std::vector<trace_event> events;
+    };
+    static bool& on() {
+        static bool flag = false;
+        return flag;
+    }
+    static clock::time_point origin() {
+        static const clock::time_point t = clock::now();
+        return t;
+    }
+    static std::mutex& registry_lock() {
+        static std::mutex lock;
+        return lock;
+    }
+    static std::vector<thread_events*>& registry() {
+        static std::vector<thread_events*> threads;
+        return threads;
+    }
+    static thread_events& local() {
+        static thread_local thread_events* events = nullptr;
+        if (!events) {
+            std::lock_guard<std::mutex> guard(registry_lock());
+            events = new thread_events();
+            events->tid = static_cast<int>(registry().size());
+            registry().push_back(events);
+        }
+        return *events;
+    }
+};
+
+// Records the time until it goes out of scope, if tracing is on.
+class trace_span {
+public:
+    explicit trace_span(const char* _name) : name(_name), start(trace::enabled() ? trace::now() : -1) {}
+    trace_span(const char* _name, const std::string& _detail)
+        : name(_name), start(trace::enabled() ? trace::now() : -1) {
+        if (start >= 0) detail = _detail;
+    }
+    ~trace_span() {
+        if (start >= 0) trace::record(name, detail, start, trace::now() - start);
+    }
+private:
+    const char* name;
+    std::string detail;
+    double start;
+    trace_span(const trace_span&);
+    trace_span& operator=(const trace_span&);
+};
+
+inline void trace_write_string(FILE* f, const std::string& s) {
+    fputc('"', f);
+    for (auto c : s) {
+        if (c == '"' || c == '\\') fputc('\\', f);
+        if (static_cast<unsigned char>(c) < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+bool trace::write(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(registry_lock());
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (auto thread : registry()) {
+        auto thread_name = thread->tid == 0 ? std::string("main") : "worker " + std::to_string(thread->tid);
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", thread->tid, thread_name.c_str());
+        first = false;
+        for (const auto& e : thread->events) {
+            fprintf(f, ",\n{\"name\": ");
+            trace_write_string(f, e.name);
+            fprintf(f, ", \"cat\": \"render\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", thread->tid, e.start, e.duration);
+            if (!e.detail.empty()) {
+                fprintf(f, ", \"args\": {\"detail\": ");
+                trace_write_string(f, e.detail);
+                fputc('}', f);
+            }
+            fputc('}', f);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        std::cerr << "ERROR: cannot write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
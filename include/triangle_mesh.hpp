@@ -0,0 +1,149 @@
+#ifndef TRIANGLE_MESH_H_
+#define TRIANGLE_MESH_H_
+
+#include "utils.hpp"
+#include "hittable.hpp"
+#include "flat_bvh.hpp"
+#include "render_stats.hpp"
+#include "trace.hpp"
+#include <vector>
+
+struct mesh_uv {
+    double u, v;
+};
+
+struct mesh_triangle {
+    int p[3];   // Position indices
+    int n[3];   // Normal indices, -1 if the vertex has none
+    int t[3];   // Texture coordinate indices, -1 if the vertex has none
+};
+
+// Indexed vertex data, shared by every triangle_mesh instance built from it.
+struct mesh_data {
+    std::vector<point3> positions;
+    std::vector<vec3> normals;
+    std::vector<mesh_uv> uvs;
+    std::vector<mesh_triangle> triangles;
+};
+
+class triangle_mesh : public hittable {
+public:
+    triangle_mesh() {}
+    triangle_mesh(shared_ptr<const mesh_data> _mesh, shared_ptr<material> m) : mesh(_mesh), mat_ptr(m) { build(); }
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        if (nodes.empty()) return false;
+        output_box = nodes[0].box;
+        return true;
+    }
+public:
+    shared_ptr<const mesh_data> mesh;
+    shared_ptr<material> mat_ptr;
+    std::vector<flat_bvh_node> nodes;
+    std::vector<int> tri_index;
+private:
+    void build();
+};
+
+// Moller-Trumbore. b1 and b2 are the barycentric weights of the second and third vertex.
+inline bool triangle_intersect(const point3& p0, const point3& p1, const point3& p2, const ray& r, double t_min, double t_max,
+                               double& t, double& b1, double& b2) {
+    RT_STAT_INC(prim_tests[STAT_PRIM_TRIANGLE]);
+    auto e1 = p1 - p0;
+    auto e2 = p2 - p0;
+    auto pvec = cross(r.direction(), e2);
+    auto det = dot(e1, pvec);
+    if (fabs(det) < 1e-12) return false;
+    auto inv_det = 1.0 / det;
+    auto tvec = r.origin() - p0;
+    b1 = dot(tvec, pvec) * inv_det;
+    if (b1 < 0 || b1 > 1) return false;
+    auto qvec = cross(tvec, e1);
+    b2 = dot(r.direction(), qvec) * inv_det;
+    if (b2 < 0 || b1 + b2 > 1) return false;
+    t = dot(e2, qvec) * inv_det;
+    return t >= t_min && t <= t_max;
+}
+
+// dp/du and dp/dv of the triangle's uv parameterization; zero if the uvs are degenerate.
+inline void triangle_uv_derivatives(const point3& p0, const point3& p1, const point3& p2,
+                                    const mesh_uv& t0, const mesh_uv& t1, const mesh_uv& t2, vec3& dpdu, vec3& dpdv) {
+    auto du02 = t0.u - t2.u, dv02 = t0.v - t2.v;
+    auto du12 = t1.u - t2.u, dv12 = t1.v - t2.v;
+    auto det = du02 * dv12 - dv02 * du12;
+    if (fabs(det) < 1e-12) {
+        dpdu = dpdv = vec3(0, 0, 0);
+        return;
+    }
+    auto dp02 = p0 - p2, dp12 = p1 - p2;
+    dpdu = (dv12 * dp02 - dv02 * dp12) / det;
+    dpdv = (du02 * dp12 - du12 * dp02) / det;
+}
+
+void triangle_mesh::build() {
+    auto n = mesh->triangles.size();
+    std::vector<aabb> boxes(n);
+    for (size_t i = 0; i < n; i++) {
+        const auto& tri = mesh->triangles[i];
+        const auto& p0 = mesh->positions[tri.p[0]];
+        const auto& p1 = mesh->positions[tri.p[1]];
+        const auto& p2 = mesh->positions[tri.p[2]];
+        point3 lo(std::min(p0.x(), std::min(p1.x(), p2.x())), std::min(p0.y(), std::min(p1.y(), p2.y())), std::min(p0.z(), std::min(p1.z(), p2.z())));
+        point3 hi(std::max(p0.x(), std::max(p1.x(), p2.x())), std::max(p0.y(), std::max(p1.y(), p2.y())), std::max(p0.z(), std::max(p1.z(), p2.z())));
+        // Pad flat boxes so axis-aligned triangles still have volume.
+        boxes[i] = aabb(lo - vec3(1e-6, 1e-6, 1e-6), hi + vec3(1e-6, 1e-6, 1e-6));
+    }
+    trace_span span("build mesh bvh");
+    build_flat_bvh(boxes, tri_index, nodes);
+}
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty()) return false;
+    int hit_tri = -1;
+    double hit_b1 = 0, hit_b2 = 0;
+    auto hit_triangle = [&](int i, double& closest) {
+        const auto& p = mesh->triangles[i].p;
+        double t, b1, b2;
+        if (!triangle_intersect(mesh->positions[p[0]], mesh->positions[p[1]], mesh->positions[p[2]], r, t_min, closest, t, b1, b2)) return false;
+        closest = t;
+        hit_tri = i;
+        hit_b1 = b1;
+        hit_b2 = b2;
+        return true;
+    };
+    if (!traverse_flat_bvh(nodes.data(), tri_index.data(), r, t_min, t_max, hit_triangle)) return false;
+
+    const auto& tri = mesh->triangles[hit_tri];
+    const auto& p0 = mesh->positions[tri.p[0]];
+    auto b0 = 1.0 - hit_b1 - hit_b2;
+    rec.t = t_max;
+    rec.p = r.at(t_max);
+    auto geometric_normal = unit_vector(cross(mesh->positions[tri.p[1]] - p0, mesh->positions[tri.p[2]] - p0));
+    rec.set_face_normal(r, geometric_normal);
+    if (tri.n[0] >= 0 && tri.n[1] >= 0 && tri.n[2] >= 0) {
+        auto shading_normal = b0 * mesh->normals[tri.n[0]] + hit_b1 * mesh->normals[tri.n[1]] + hit_b2 * mesh->normals[tri.n[2]];
+        if (!shading_normal.near_zero()) {
+            shading_normal = unit_vector(shading_normal);
+            if (dot(shading_normal, geometric_normal) < 0) shading_normal = -shading_normal;
+            rec.normal = rec.front_face ? shading_normal : -shading_normal;
+        }
+    }
+    if (tri.t[0] >= 0 && tri.t[1] >= 0 && tri.t[2] >= 0) {
+        const auto& t0 = mesh->uvs[tri.t[0]];
+        const auto& t1 = mesh->uvs[tri.t[1]];
+        const auto& t2 = mesh->uvs[tri.t[2]];
+        rec.u = b0 * t0.u + hit_b1 * t1.u + hit_b2 * t2.u;
+        rec.v = b0 * t0.v + hit_b1 * t1.v + hit_b2 * t2.v;
+        triangle_uv_derivatives(p0, mesh->positions[tri.p[1]], mesh->positions[tri.p[2]], t0, t1, t2, rec.dpdu, rec.dpdv);
+    }
+    else {
+        rec.u = hit_b1;
+        rec.v = hit_b2;
+        rec.dpdu = mesh->positions[tri.p[1]] - p0;
+        rec.dpdv = mesh->positions[tri.p[2]] - p0;
+    }
+    rec.mat_ptr = mat_ptr;
+    return true;
+}
+
+#endif
@@ -19,24 +19,26 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// The generator behind random_double(), default seeded; reseed it for an independent run.
+inline std::mt19937& random_generator() {
+    static std::mt19937 generator;
+    return generator;
+}
+
 inline double random_double() {
     static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return distribution(random_generator());
 }
 
+// Both draw from random_generator() too. (Each used to keep a static distribution, which
+// froze the range of its first call for every later one.)
 inline double random_double(double min, double max) {
-    static std::uniform_real_distribution<double> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return min + (max - min) * random_double();
 }
 
+// In [min, max].
 inline int random_int(int min, int max) {
-    static std::uniform_int_distribution<int> distribution(min, max + 1);    
-    static std::mt19937 generator;
-    int res = distribution(generator);
-    return res;
-
+    return std::min(min + static_cast<int>(random_double() * (max - min + 1)), max);
 }
 
 inline double clamp(double x, double min, double max) {
@@ -9,8 +9,18 @@
 #include "aarect.hpp"
 #include "box.hpp"
 #include "constant_medium.hpp"
+#include "triangle_mesh.hpp"
+#include "obj_loader.hpp"
+#include "render_settings.hpp"
+#include "scene_image.hpp"
+#include "scenes.hpp"
+#include "scene_parser.hpp"
+#include "renderer.hpp"
+#include "batch.hpp"
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <sys/stat.h>
 //#include <omp.h>
 
 double hit_sphere(const point3& center, double radius, const ray& r) {
@@ -27,306 +37,147 @@ double hit_sphere(const point3& center, double radius, const ray& r) {
     }
 }
 
-color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
-    hit_record rec;
-    if (depth <= 0) return color(0, 0, 0);
-    if (!world.hit(r, 0.0001, infinity, rec)) return background;
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-        return emitted;
-    }
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
-}
-
-hittable_list two_spheres() {
-    hittable_list objects;
-    auto checker = make_shared<checker_texture>(color(0.91, 0.17, 0.36), color(0.99, 0.79, 0.33));
-    objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    objects.add(make_shared<sphere>(point3(0,  10, 0), 10, make_shared<lambertian>(checker)));
-    return objects;
-}
-
-hittable_list two_perlin_spheres() {
-    hittable_list objects;
-
-    auto pertext = make_shared<noise_texture>(10);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-    return objects;
-}
-
-hittable_list simple_light() {
-    hittable_list objects;
-    
-    auto material1 = make_shared<dielectric>(1.5);
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    auto pertext = make_shared<noise_texture>(5);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(5, 1, 3), 1, material1));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, material2));
-    objects.add(make_shared<sphere>(point3(0, 2, 5), 2, material3));
-    objects.add(make_shared<sphere>(point3(12, 1, 2.5), 1, material1));
-    objects.add(make_shared<sphere>(point3(12, 1, 2.5), -0.999, material1));
-    objects.add(make_shared<xy_rect>(6, 8, 0, 2, 5.5, material3));
-    auto difflight = make_shared<diffuse_light>(color(5, 5, 5));
-    // objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
-    // objects.add(make_shared<xy_rect>(3, 5, 1, 3, 4, difflight));
-    objects.add(make_shared<sphere>(point3(8, 0.3, 4), 0.3, difflight));
-    objects.add(make_shared<xy_rect>(-10, 10, 0, 20, -4, difflight));
-    
-    return objects;
-}
-
-hittable_list cornell_box() {
-    hittable_list objects;
-
-    auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
-    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
-    auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
-    auto light = make_shared<diffuse_light>(color(8, 8, 8));
-    auto mirror = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    auto glass = make_shared<dielectric>(1.1);
-    auto img_tex = make_shared<image_texture>("/Users/zihanliu/workspace/rt-weekend-gpurt/Tex.jpg");
-    auto img_mat = make_shared<lambertian>(img_tex);
-
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(152.5, 402.5, 152.5, 402.5, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, img_mat));
-
-    // objects.add(make_shared<box>(point3(130, 0.01, 65), point3(295, 165, 230), glass));
-    // objects.add(make_shared<box>(point3(265, 0, 295), point3(430, 330, 460), mirror));
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(180, 360, 180), glass);
-    box1 = make_shared<rotate_y>(box1, 30);
-    box1 = make_shared<translate>(box1, vec3(265, 0.01, 295));
-
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(180, 180, 180), mirror);
-    box2 = make_shared<rotate_y>(box2, -15);
-    box2 = make_shared<translate>(box2, vec3(130, 0.01, 65));
-
-    objects.add(box1);
-    objects.add(box2);
-
-    return objects;
-}
-
-hittable_list smoke_box() {
-    hittable_list objects;
-    auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
-    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
-    auto blue = make_shared<lambertian>(color(0.08, 0.13, 0.72));
-    auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
-    auto light = make_shared<diffuse_light>(color(8, 8, 8));    
-    auto img_tex = make_shared<image_texture>("/Users/zihanliu/workspace/rt-weekend-gpurt/Tex2.jpg");
-    auto img_mat = make_shared<lambertian>(img_tex);
-    auto glass = make_shared<dielectric>(1.2);
-
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(152.5, 402.5, 152.5, 402.5, 554.9, light));
-    objects.add(make_shared<yz_rect>(350, 500, 152.5, 402.5, 554.9, light));
-    objects.add(make_shared<yz_rect>(350, 500, 152.5, 402.5, 0.1, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, img_mat));
-    
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(180, 180, 180), glass);
-    box2 = make_shared<rotate_y>(box2, -15);
-    box2 = make_shared<translate>(box2, vec3(130, 0.01, 65));
-    objects.add(box2);
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(180, 240, 180), white);
-    box1 = make_shared<rotate_y>(box1, 30);
-    box1 = make_shared<translate>(box1, vec3(265, 0.01, 295));
-    objects.add(make_shared<constant_medium>(box1, 0.005, color(1, 1, 1)));
-
-    shared_ptr<hittable> sphere1 = make_shared<sphere>(point3(120, 360, 120), 90, white);
-    objects.add(make_shared<constant_medium>(sphere1, 0.02, color(0, 0, 0)));
-    return objects;
-}
-
-hittable_list random_scene() {
-    hittable_list world;
-    // auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    auto checker = make_shared<checker_texture>(color(0.91, 0.17, 0.36), color(0.99, 0.79, 0.33));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_material = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-                if (choose_material < 0.5) {
-                    auto albedo = color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    auto center2 = center + vec3(0, random_double(0, 0.5), 0);
-                    world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
-                }
-                else if (choose_material < 0.75) {
-                    auto albedo = color::random(0.5, 1.0);
-                    auto fuzz = random_double(0.0, 0.25);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else {
-                    sphere_material = make_shared<dielectric>(1.5, 1.0, 0.78, 0.86);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
+int main(int argc, char** argv) {
+    std::string scene_path;
+    std::string builtin_name;
+    std::string output_dir = "render_output";
+    std::string save_image_path;
+    std::string load_image_path;
+    std::string batch_path;
+    std::string convert_in, convert_out;
+    bool cost_map = false;
+    std::string trace_path;
+    std::string alloc_strict;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--builtin" && i + 1 < argc) {
+            builtin_name = argv[++i];
+        }
+        else if (arg == "--output" && i + 1 < argc) {
+            output_dir = argv[++i];
+        }
+        else if (arg == "--save-image" && i + 1 < argc) {
+            save_image_path = argv[++i];
+        }
+        else if (arg == "--load-image" && i + 1 < argc) {
+            load_image_path = argv[++i];
+        }
+        else if (arg == "--batch" && i + 1 < argc) {
+            batch_path = argv[++i];
+        }
+        else if (arg == "--convert-volume" && i + 2 < argc) {
+            convert_in = argv[++i];
+            convert_out = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (arg == "--alloc-strict" && i + 1 < argc) {
+            alloc_strict = argv[++i];
+        }
+        else if (arg == "--cost-map") {
+            cost_map = true;
+        }
+        else if (arg == "--texture-cache-mb" && i + 1 < argc) {
+            tile_cache::global().set_budget(static_cast<size_t>(atof(argv[++i]) * (1 << 20)));
+        }
+        else if (arg[0] != '-' && scene_path.empty()) {
+            scene_path = arg;
+        }
+        else {
+            scene_path.clear();
+            builtin_name.clear();
+            load_image_path.clear();
+            batch_path.clear();
+            convert_in.clear();
+            break;
         }
     }
+    if (scene_path.empty() && builtin_name.empty() && load_image_path.empty() && batch_path.empty() && convert_in.empty()) {
+        std::cerr << "Usage: " << argv[0] << " (scene-file | --builtin name | --load-image scene.rtsi | --batch jobs-file | --convert-volume in.rtdg out.rtsv) [--output dir] [--save-image scene.rtsi] [--texture-cache-mb n] [--cost-map] [--trace trace.json] [--alloc-strict warn|fail]\n"
+                  << "Builtin scenes: random_scene, two_spheres, two_perlin_spheres, simple_light, cornell_box, smoke_box, cloud_box\n";
+        return 1;
+    }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-    // world.add(make_shared<sphere>(point3(0, 1, 0), -0.99, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    return world;
-}
-
-int main(int argc, char** argv) {
-    auto aspect_ratio = 16.0 / 9.0;
-    int image_width = 1920;
-    int image_height = static_cast<int>(image_width / aspect_ratio);
-    int samples_per_pixel = 200;
-    int max_depth = 50;
+    if (!convert_in.empty()) {
+        auto grid = load_density_grid(convert_in);
+        if (!grid || !sparse_volume_builder::from_grid(*grid).write(convert_out)) return 1;
+        std::cout << "Wrote " << convert_out << std::endl;
+        return 0;
+    }
 
-    double ***img = new double** [image_height];
-    for (int j = 0; j < image_height; j++) img[j] = new double* [image_width];
-    for (int j = 0; j < image_height; j++) {
-        for (int i = 0; i < image_width; i++) {
-            img[j][i] = new double[3];
+    if (!alloc_strict.empty()) {
+        if (!render_stats_enabled) {
+            std::cerr << "ERROR: --alloc-strict needs a build with RT_ENABLE_STATS.\n";
+            return 1;
+        }
+        if (alloc_strict == "warn") render_stats::alloc_strictness() = STAT_ALLOC_WARN;
+        else if (alloc_strict == "fail") render_stats::alloc_strictness() = STAT_ALLOC_FAIL;
+        else {
+            std::cerr << "ERROR: --alloc-strict takes warn or fail.\n";
+            return 1;
         }
     }
+    if (!trace_path.empty()) trace::start();
+    if (!batch_path.empty()) {
+        mkdir(output_dir.c_str(), 0755);
+        bool ok = run_batch(batch_path, output_dir);
+        if (!trace_path.empty()) ok = trace::write(trace_path) && ok;
+        return ok ? 0 : 1;
+    }
 
-    // // World
-    // auto world = random_scene();
-    // hittable_list bvh_world;
-    // bvh_world.add(make_shared<bvh_node>(world, 0, 1));
-
-
-    // // Camera
-    // point3 look_from(13, 2, 3);
-    // point3 look_at(0, 0, 0);
-    // vec3 vup(0, 1, 0);
-    // auto dist_to_focus = 10.0;
-    // auto aperture = 0.1;
-    // camera cam(look_from, look_at, vup, 30, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-
+    render_settings settings;
     hittable_list world;
-    point3 lookfrom;
-    point3 lookat;
-    auto vfov = 40.0;
-    auto aperture = 0.0;
-    color background(0, 0, 0);
-
-    switch (7) {
-        case 1:
-            world = random_scene();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            aperture = 0.1;
-            break;
-        case 2:
-            world = two_spheres();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            break;
-        case 3:
-            world = two_perlin_spheres();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            break;
-        case 4:
-            break;
-        case 5:
-            world = simple_light();
-            lookfrom = point3(26, 3, 2);
-            lookat = point3(0, 2, 0);
-            background = color(0, 0, 0);
-            vfov = 20.0;
-            break;
-        default:
-        case 6:
-            world = cornell_box();
-            aspect_ratio = 1.0;
-            image_width = 800;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            samples_per_pixel = 500;
-            background = color(0, 0, 0);
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-        case 7:
-            world = smoke_box();
-            aspect_ratio = 1.0;
-            image_width = 1000;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            samples_per_pixel = 500;
-            background = color(0, 0, 0);
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-            break;
-    }    
     hittable_list bvh_world;
-    bvh_world.add(make_shared<bvh_node>(world, 0, 1));
-
-    vec3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-
-    color **pixel_colors;
-    pixel_colors = new color* [image_height];
-    for (int j = 0; j < image_height; j++) pixel_colors[j] = new color [image_width];
-    for (int j = 0; j < image_height; j++) {
-        for (int i = 0; i < image_width; i++) {
-            pixel_colors[j][i] = color(0, 0, 0);
-        }
+    medium_lighting lighting;
+
+    if (!load_image_path.empty()) {
+        stat_timer timer(STAT_PHASE_LOAD);
+        trace_span span("load scene", load_image_path);
+        auto image_world = load_scene_image(load_image_path, settings);
+        if (!image_world) return 1;
+        bvh_world.add(image_world);
+        lighting.collect(*image_world);
     }
-    for (int s = 0; s < samples_per_pixel; s++) {
-        // #pragma omp parallel for
-        for (int j = image_height - 1; j >= 0; j--) {
-            for (int i = 0; i < image_width; i++) {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_colors[j][i] += ray_color(r, background, bvh_world, max_depth);
-                auto pc = get_color(pixel_colors[j][i], s);
-                img[j][i][0] = pc[0];
-                img[j][i][1] = pc[1];
-                img[j][i][2] = pc[2];
+    else {
+        {
+            stat_timer timer(STAT_PHASE_LOAD);
+            trace_span span("load scene", builtin_name.empty() ? scene_path : "builtin:" + builtin_name);
+            if (!builtin_name.empty()) {
+                if (!builtin_scene(builtin_name, world, settings)) return 1;
             }
-        }
-        std::ofstream fout("/Users/zihanliu/workspace/rt-weekend-gpurt/render_output/img_" + std::to_string(s) + ".ppm", std::ios::out);
-        fout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-        for (int j = image_height - 1; j >= 0; j--) {
-            for (int i = 0; i < image_width; i++) {
-                fout << static_cast<int>(256 * clamp(img[j][i][0], 0.0, 0.999)) << ' '
-                     << static_cast<int>(256 * clamp(img[j][i][1], 0.0, 0.999)) << ' '
-                     << static_cast<int>(256 * clamp(img[j][i][2], 0.0, 0.999)) << '\n';
+            else if (!load_scene_file(scene_path, world, settings)) {
+                return 1;
             }
         }
-        fout.close();
+        if (!save_image_path.empty()) {
+            if (!write_scene_image(save_image_path, world, settings)) return 1;
+            std::cout << "Wrote " << save_image_path << std::endl;
+            return 0;
+        }
+        stat_timer timer(STAT_PHASE_BUILD);
+        trace_span span("build bvh");
+        bvh_world.add(make_shared<bvh_node>(world, 0, 1));
+        lighting.collect(world);
+    }
+
+    mkdir(output_dir.c_str(), 0755);
+
+    camera cam = settings.make_camera();
+    frame_buffer frame(settings.image_width, settings.image_height);
+    cost_buffer cost(cost_map ? settings.image_width : 0, cost_map ? settings.image_height : 0);
+    std::string image_path;
+    for (int s = 0; s < settings.samples_per_pixel; s++) {
+        // #pragma omp parallel for
+        render_pass(bvh_world, settings, cam, frame, &lighting, cost_map ? &cost : nullptr);
+        image_path.assign(output_dir).append("/img_").append(std::to_string(s)).append(".ppm");
+        write_ppm(image_path, frame);
         std::cout << s << std::endl;
         // #pragma omp barrier
     }
+    if (cost_map && !write_cost_maps(output_dir + "/img", cost)) return 1;
+    if (!write_render_stats(output_dir + "/stats.json")) return 1;
+    if (!trace_path.empty() && !trace::write(trace_path)) return 1;
     // for (int j = image_height - 1; j >= 0; --j) {
     //     for (int i = 0; i < image_width; ++i) {
     //         std::cout << static_cast<int>(256 * clamp(img[j][i][0], 0.0, 0.999)) << ' '